@@ -0,0 +1,141 @@
+/* Branch prediction for the processor simulators */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "isa.h"
+#include "bpred.h"
+
+/* Counters at least this large predict taken */
+#define WEAKLY_TAKEN 2
+
+static char *bp_names[] = {"taken", "btfnt", "bimodal", "gshare"};
+
+bpred_ptr new_bpred(bp_kind_t kind, int bits, int ras_size)
+{
+    bpred_ptr bp = (bpred_ptr) calloc(1, sizeof(bpred_rec));
+    bp->kind = kind;
+    bp->bits = bits;
+    if (kind == BP_BIMODAL || kind == BP_GSHARE) {
+	bp->pht = (byte_t *) malloc((word_t) 1 << bits);
+	memset(bp->pht, WEAKLY_TAKEN, (word_t) 1 << bits);
+    }
+    bp->ras_size = ras_size;
+    if (ras_size > 0)
+	bp->ras = (word_t *) calloc(ras_size, sizeof(word_t));
+    return bp;
+}
+
+void free_bpred(bpred_ptr bp)
+{
+    free((void *) bp->pht);
+    free((void *) bp->ras);
+    free((void *) bp);
+}
+
+bool_t parse_bpred(char *s, bp_kind_t *kindp, int *bitsp)
+{
+    int k;
+    for (k = BP_TAKEN; k <= BP_GSHARE; k++) {
+	int n = strlen(bp_names[k]);
+	if (strncmp(s, bp_names[k], n) != 0)
+	    continue;
+	*kindp = k;
+	*bitsp = BP_BITS;
+	if (s[n] == '\0')
+	    return TRUE;
+	if (s[n] == ':' && sscanf(s+n+1, "%d", bitsp) == 1)
+	    return *bitsp > 0 && *bitsp <= 24;
+	return FALSE;
+    }
+    return FALSE;
+}
+
+bool_t bp_predict(bpred_ptr bp, word_t pc, word_t target, word_t *indexp)
+{
+    word_t mask = ((word_t) 1 << bp->bits) - 1;
+    *indexp = 0;
+    switch (bp->kind) {
+    case BP_BTFNT:
+	return (uword_t) target <= (uword_t) pc;
+    case BP_BIMODAL:
+	*indexp = pc & mask;
+	break;
+    case BP_GSHARE:
+	*indexp = (pc ^ bp->ghr) & mask;
+	break;
+    default:
+	return TRUE;
+    }
+    return bp->pht[*indexp] >= WEAKLY_TAKEN;
+}
+
+void bp_update(bpred_ptr bp, word_t index, bool_t taken)
+{
+    if (!bp->pht)
+	return;
+    if (taken && bp->pht[index] < 3)
+	bp->pht[index]++;
+    if (!taken && bp->pht[index] > 0)
+	bp->pht[index]--;
+    bp->ghr = (bp->ghr << 1) | (taken != 0);
+}
+
+word_t bp_ret_target(bpred_ptr bp)
+{
+    if (bp->ras_count == 0)
+	return BP_NONE;
+    return bp->ras[bp->ras_top];
+}
+
+void bp_call(bpred_ptr bp, word_t retaddr)
+{
+    if (bp->ras_size == 0)
+	return;
+    bp->ras_top = (bp->ras_top + 1) % bp->ras_size;
+    bp->ras[bp->ras_top] = retaddr;
+    if (bp->ras_count < bp->ras_size)
+	bp->ras_count++;
+}
+
+void bp_ret(bpred_ptr bp)
+{
+    if (bp->ras_count == 0)
+	return;
+    bp->ras_top = (bp->ras_top + bp->ras_size - 1) % bp->ras_size;
+    bp->ras_count--;
+}
+
+word_t bp_ras_save(bpred_ptr bp)
+{
+    return ((word_t) bp->ras_top << 32) | bp->ras_count;
+}
+
+/* Entries overwritten since the save are not recovered */
+void bp_ras_restore(bpred_ptr bp, word_t pos)
+{
+    bp->ras_top = (int) (pos >> 32);
+    bp->ras_count = (int) (pos & 0xFFFFFFFF);
+}
+
+/* Percentage of n in total */
+static double percent(word_t n, word_t total)
+{
+    return total > 0 ? 100.0 * n / total : 0.0;
+}
+
+void print_bpred(bpred_ptr bp, FILE *outfile)
+{
+    fprintf(outfile, "Predictor: %s", bp_names[bp->kind]);
+    if (bp->pht)
+	fprintf(outfile, ", %d entries", 1 << bp->bits);
+    if (bp->ras_size > 0)
+	fprintf(outfile, ", return-address stack of %d", bp->ras_size);
+    fprintf(outfile, "\n");
+    fprintf(outfile, "Conditional jumps: %lld, %lld mispredicted (%.2f%%)\n",
+	    bp->jumps, bp->jump_misses, percent(bp->jump_misses, bp->jumps));
+    fprintf(outfile, "Returns: %lld, %lld mispredicted (%.2f%%), %lld stalled\n",
+	    bp->rets, bp->ret_misses, percent(bp->ret_misses, bp->rets),
+	    bp->ret_stalls);
+}
@@ -0,0 +1,70 @@
+/* Branch prediction for the processor simulators */
+
+/* Conditional jumps are predicted by one of:
+     taken     Always taken
+     btfnt     Backward taken, forward not taken
+     bimodal   Table of 2-bit saturating counters, indexed by PC
+     gshare    Table of 2-bit counters, indexed by PC xor global history
+   Unconditional jumps and calls are always followed.
+   Returns are optionally predicted by a return-address stack, pushed
+   when a call is fetched and popped when a return is fetched, and
+   restored to a saved position when instructions are cancelled.  Tables
+   are trained as each jump is resolved, with the entry chosen when it
+   was predicted, which the pipeline carries along with the jump. */
+
+typedef enum { BP_TAKEN, BP_BTFNT, BP_BIMODAL, BP_GSHARE } bp_kind_t;
+
+/* Default log2 of number of table entries */
+#define BP_BITS 10
+
+/* Stands for no prediction of a return */
+#define BP_NONE ((word_t) -1)
+
+typedef struct {
+  bp_kind_t kind;
+  int bits;
+  byte_t *pht;     /* 2-bit counters, for bimodal and gshare */
+  word_t ghr;      /* Outcomes of latest jumps, latest in bit 0 */
+  /* Return-address stack, as a ring that overwrites its oldest entry */
+  int ras_size;
+  word_t *ras;
+  int ras_top;
+  int ras_count;
+  /* Statistics */
+  word_t jumps;
+  word_t jump_misses;
+  word_t rets;
+  word_t ret_misses;
+  word_t ret_stalls;
+} bpred_rec, *bpred_ptr;
+
+/* Create predictor with 2^bits table entries and ras_size entries of
+   return-address stack (0 for none) */
+bpred_ptr new_bpred(bp_kind_t kind, int bits, int ras_size);
+void free_bpred(bpred_ptr bp);
+
+/* Parse predictor name, optionally followed by ":bits".
+   Return FALSE if not valid */
+bool_t parse_bpred(char *s, bp_kind_t *kindp, int *bitsp);
+
+/* Predict whether jump at pc to target is taken.  Set *indexp to the
+   table entry to be trained by bp_update */
+bool_t bp_predict(bpred_ptr bp, word_t pc, word_t target, word_t *indexp);
+
+/* Train with outcome of jump predicted from entry index */
+void bp_update(bpred_ptr bp, word_t index, bool_t taken);
+
+/* Predicted return address, or BP_NONE */
+word_t bp_ret_target(bpred_ptr bp);
+
+/* Update return-address stack when call or return is fetched */
+void bp_call(bpred_ptr bp, word_t retaddr);
+void bp_ret(bpred_ptr bp);
+
+/* Position of return-address stack, to be restored when the
+   instructions fetched after it are cancelled */
+word_t bp_ras_save(bpred_ptr bp);
+void bp_ras_restore(bpred_ptr bp, word_t pos);
+
+/* Print statistics */
+void print_bpred(bpred_ptr bp, FILE *outfile);
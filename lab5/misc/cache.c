@@ -0,0 +1,193 @@
+/* Cache model for the processor simulators */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "isa.h"
+#include "cache.h"
+
+static char *repl_names[] = {"lru", "fifo", "random"};
+
+static bool_t power_of_2(int n)
+{
+    return n > 0 && (n & (n-1)) == 0;
+}
+
+bool_t parse_cache(char *s, cache_cfg_ptr cfg)
+{
+    char *opt;
+    int n;
+
+    cfg->repl = REPL_LRU;
+    cfg->write_back = TRUE;
+    cfg->write_allocate = TRUE;
+    cfg->latency = CACHE_LATENCY;
+    if (sscanf(s, "%d%n", &cfg->size, &n) != 1)
+	return FALSE;
+    s += n;
+    if (*s == 'k' || *s == 'K') {
+	cfg->size *= 1024;
+	s++;
+    }
+    if (sscanf(s, ":%d:%d%n", &cfg->assoc, &cfg->block, &n) != 2)
+	return FALSE;
+    for (opt = s + n; *opt == ':'; opt += n) {
+	opt++;
+	n = strcspn(opt, ":");
+	if (n == 3 && strncmp(opt, "lru", n) == 0)
+	    cfg->repl = REPL_LRU;
+	else if (n == 4 && strncmp(opt, "fifo", n) == 0)
+	    cfg->repl = REPL_FIFO;
+	else if (n == 6 && strncmp(opt, "random", n) == 0)
+	    cfg->repl = REPL_RANDOM;
+	else if (n == 2 && strncmp(opt, "wb", n) == 0)
+	    cfg->write_back = TRUE;
+	else if (n == 2 && strncmp(opt, "wt", n) == 0)
+	    cfg->write_back = FALSE;
+	else if (n == 2 && strncmp(opt, "wa", n) == 0)
+	    cfg->write_allocate = TRUE;
+	else if (n == 3 && strncmp(opt, "nwa", n) == 0)
+	    cfg->write_allocate = FALSE;
+	else if (strncmp(opt, "lat=", 4) != 0 ||
+		 sscanf(opt+4, "%d", &cfg->latency) != 1 || cfg->latency < 0)
+	    return FALSE;
+    }
+    if (*opt != '\0')
+	return FALSE;
+    return power_of_2(cfg->block) && cfg->assoc > 0 &&
+	cfg->size % (cfg->assoc * cfg->block) == 0 &&
+	power_of_2(cfg->size / (cfg->assoc * cfg->block));
+}
+
+cache_ptr new_cache(char *name, cache_cfg_ptr cfg, cache_ptr next,
+		    int mem_latency)
+{
+    cache_ptr c = (cache_ptr) calloc(1, sizeof(cache_rec));
+    c->name = name;
+    c->cfg = *cfg;
+    c->sets = cfg->size / (cfg->assoc * cfg->block);
+    while ((1 << c->block_bits) < cfg->block)
+	c->block_bits++;
+    c->next = next;
+    c->mem_latency = mem_latency;
+    c->lines = (cache_line_ptr) calloc(c->sets * cfg->assoc,
+				       sizeof(cache_line_rec));
+    c->seed = 1;
+    return c;
+}
+
+void free_cache(cache_ptr c)
+{
+    free((void *) c->lines);
+    free((void *) c);
+}
+
+/* Cycles for the next level to read or write block number b */
+static int next_level(cache_ptr c, word_t b, bool_t write)
+{
+    if (!c->next)
+	return c->mem_latency;
+    return c->next->cfg.latency +
+	cache_access(c->next, b << c->block_bits, c->cfg.block, write);
+}
+
+/* Block of set to replace: an empty one if any */
+static cache_line_ptr victim(cache_ptr c, cache_line_ptr set)
+{
+    cache_line_ptr v = set;
+    int i;
+    for (i = 0; i < c->cfg.assoc; i++) {
+	if (!set[i].valid)
+	    return &set[i];
+	if (set[i].stamp < v->stamp)
+	    v = &set[i];
+    }
+    if (c->cfg.repl == REPL_RANDOM) {
+	/* Linear congruential generator, from ANSI C rand */
+	c->seed = c->seed * 1103515245 + 12345;
+	v = &set[(c->seed >> 16) % c->cfg.assoc];
+    }
+    return v;
+}
+
+/* Access block number b */
+static int access_block(cache_ptr c, word_t b, bool_t write)
+{
+    cache_line_ptr set = &c->lines[(b & (c->sets-1)) * c->cfg.assoc];
+    word_t tag = b / c->sets;
+    cache_line_ptr l;
+    int cycles = 0;
+    int i;
+
+    if (write)
+	c->writes++;
+    else
+	c->reads++;
+    c->clock++;
+    for (i = 0; i < c->cfg.assoc; i++) {
+	l = &set[i];
+	if (l->valid && l->tag == tag) {
+	    if (c->cfg.repl == REPL_LRU)
+		l->stamp = c->clock;
+	    if (write && c->cfg.write_back)
+		l->dirty = TRUE;
+	    else if (write)
+		cycles = next_level(c, b, TRUE);
+	    return cycles;
+	}
+    }
+
+    if (write)
+	c->write_misses++;
+    else
+	c->read_misses++;
+    if (write && !c->cfg.write_allocate)
+	return next_level(c, b, TRUE);
+    l = victim(c, set);
+    if (l->valid && l->dirty) {
+	c->writebacks++;
+	cycles += next_level(c, l->tag * c->sets + (b & (c->sets-1)), TRUE);
+    }
+    cycles += next_level(c, b, FALSE);
+    l->valid = TRUE;
+    l->tag = tag;
+    l->stamp = c->clock;
+    l->dirty = write && c->cfg.write_back;
+    if (write && !c->cfg.write_back)
+	cycles += next_level(c, b, TRUE);
+    return cycles;
+}
+
+int cache_access(cache_ptr c, word_t addr, int len, bool_t write)
+{
+    word_t b;
+    int cycles = 0;
+    for (b = (uword_t) addr >> c->block_bits;
+	 b <= (uword_t) (addr + len - 1) >> c->block_bits; b++)
+	cycles += access_block(c, b, write);
+    return cycles;
+}
+
+static double percent(word_t n, word_t total)
+{
+    return total > 0 ? 100.0 * n / total : 0.0;
+}
+
+void print_cache(cache_ptr c, FILE *outfile)
+{
+    fprintf(outfile, "%s: %d bytes, %d-way, %d-byte blocks, %s, %s, %s",
+	    c->name, c->cfg.size, c->cfg.assoc, c->cfg.block,
+	    repl_names[c->cfg.repl],
+	    c->cfg.write_back ? "write-back" : "write-through",
+	    c->cfg.write_allocate ? "write-allocate" : "no-write-allocate");
+    if (c->next)
+	fprintf(outfile, ", misses to %s\n", c->next->name);
+    else
+	fprintf(outfile, ", misses to memory (%d cycles)\n", c->mem_latency);
+    fprintf(outfile, "  Reads: %lld, %lld missed (%.2f%%).  "
+	    "Writes: %lld, %lld missed (%.2f%%).  Writebacks: %lld\n",
+	    c->reads, c->read_misses, percent(c->read_misses, c->reads),
+	    c->writes, c->write_misses, percent(c->write_misses, c->writes),
+	    c->writebacks);
+}
@@ -0,0 +1,78 @@
+/* Cache model for the processor simulators */
+
+/* Caches keep tags only.  Data always come from the simulated memory,
+   so a cache changes when an access completes but never its result.
+   A cache is a set-associative array of blocks, with one of:
+     lru       Replace the block least recently used
+     fifo      Replace the block filled earliest
+     random    Replace a pseudo-random block (the same each run)
+   Writes are either write-back (wb), marking the block dirty and
+   writing it to the next level when it is replaced, or write-through
+   (wt), passing every write on and waiting for it.  A write that
+   misses either fills the block first (wa, write-allocate) or only
+   goes to the next level (nwa).  Each level below the first is
+   reached from the one above in its latency, plus its own miss
+   penalty; below the last level is memory.  A first-level cache has
+   no latency of its own: a hit takes the simulator's access time. */
+
+typedef enum { REPL_LRU, REPL_FIFO, REPL_RANDOM } repl_t;
+
+/* Default access time of a cache below the first level, and of memory */
+#define CACHE_LATENCY 10
+#define MEM_LATENCY 100
+
+/* Parameters of one cache */
+typedef struct {
+  int size;          /* Bytes of data */
+  int assoc;         /* Blocks per set */
+  int block;         /* Bytes per block */
+  repl_t repl;
+  bool_t write_back;
+  bool_t write_allocate;
+  int latency;       /* Cycles to access from the level above, when
+			that is a cache */
+} cache_cfg_rec, *cache_cfg_ptr;
+
+typedef struct {
+  word_t tag;
+  word_t stamp;      /* Time of last use (LRU) or fill (FIFO) */
+  bool_t valid;
+  bool_t dirty;
+} cache_line_rec, *cache_line_ptr;
+
+typedef struct cache_rec {
+  char *name;
+  cache_cfg_rec cfg;
+  int sets;
+  int block_bits;
+  struct cache_rec *next;  /* Next level, or NULL for memory */
+  int mem_latency;         /* Cycles to access memory, when last level */
+  cache_line_ptr lines;    /* Set s is lines[s*assoc..(s+1)*assoc) */
+  word_t clock;
+  uword_t seed;
+  /* Statistics */
+  word_t reads;
+  word_t read_misses;
+  word_t writes;
+  word_t write_misses;
+  word_t writebacks;
+} cache_rec, *cache_ptr;
+
+/* Parse "size:assoc:block" followed by any of ":lru", ":fifo",
+   ":random", ":wb", ":wt", ":wa", ":nwa" and ":lat=n".  Size may end
+   in k.  Defaults are lru, wb, wa and CACHE_LATENCY.  Return FALSE if
+   not valid */
+bool_t parse_cache(char *s, cache_cfg_ptr cfg);
+
+/* Create empty cache, missing to next, or to memory taking
+   mem_latency cycles if next is NULL */
+cache_ptr new_cache(char *name, cache_cfg_ptr cfg, cache_ptr next,
+		    int mem_latency);
+void free_cache(cache_ptr c);
+
+/* Read or write len bytes at addr.  Return the cycles this takes
+   beyond a hit: 0 if every block touched hits */
+int cache_access(cache_ptr c, word_t addr, int len, bool_t write);
+
+/* Print configuration and statistics */
+void print_cache(cache_ptr c, FILE *outfile);
@@ -0,0 +1,62 @@
+/* Check the statistics of caches under each replacement policy */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "isa.h"
+#include "cache.h"
+
+/* CACHETEST never runs in GUI mode */
+int gui_mode = 0;
+
+static int checks = 0;
+static int failures = 0;
+
+static void check_count(char *what, word_t got, word_t expect)
+{
+    checks++;
+    if (got != expect) {
+	printf("%s: %lld, expected %lld\n", what, got, expect);
+	failures++;
+    }
+}
+
+/* Read n distinct blocks through a single-set 4-way cache, so that
+   each one misses and all but the first 4 evict a block */
+static void check_sweep(char *spec, int n)
+{
+    cache_cfg_rec cfg;
+    cache_ptr c;
+    char what[80];
+    int i;
+
+    if (!parse_cache(spec, &cfg)) {
+	printf("%s: not a valid cache\n", spec);
+	failures++;
+	return;
+    }
+    c = new_cache("L1D", &cfg, NULL, MEM_LATENCY);
+    for (i = 0; i < n; i++)
+	cache_access(c, (word_t) i * cfg.block, 8, FALSE);
+    sprintf(what, "%s reads", spec);
+    check_count(what, c->reads, n);
+    sprintf(what, "%s read misses", spec);
+    check_count(what, c->read_misses, n);
+    sprintf(what, "%s writes", spec);
+    check_count(what, c->writes, 0);
+    sprintf(what, "%s writebacks", spec);
+    check_count(what, c->writebacks, 0);
+    free_cache(c);
+}
+
+int main(int argc, char *argv[])
+{
+    check_sweep("64:4:16:lru", 64);
+    check_sweep("64:4:16:fifo", 64);
+    check_sweep("64:4:16:random", 64);
+    if (failures == 0)
+	printf("  All %d cache checks succeed\n", checks);
+    else
+	printf("  %d/%d cache checks failed\n", failures, checks);
+    return failures != 0;
+}
@@ -0,0 +1,231 @@
+/* Lock-step checking of a processor simulator against the ISA model */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "isa.h"
+#include "check.h"
+
+/* Queue indices are published with release stores and read with
+   acquire loads, so that a slot is complete when seen */
+#ifdef __GNUC__
+#define LOAD_ACQ(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define STORE_REL(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+#else
+#define LOAD_ACQ(p) (*(p))
+#define STORE_REL(p, v) (*(p) = (v))
+#endif
+
+static void add_write(retire_ptr r, chk_kind_t kind, word_t addr, word_t val)
+{
+    chk_write_ptr w;
+    if (r->nwrites == CHK_WRITES)
+	return;
+    w = &r->writes[r->nwrites++];
+    w->kind = kind;
+    w->addr = addr;
+    w->val = val;
+}
+
+static void pipe_hook(void *arg, mem_t m, word_t pos, int len, word_t val)
+{
+    check_ptr c = (check_ptr) arg;
+    add_write(&c->pending, CHK_MEM, pos, val);
+}
+
+static void isa_reg_hook(void *arg, mem_t m, word_t pos, int len, word_t val)
+{
+    check_ptr c = (check_ptr) arg;
+    add_write(&c->isa_rec, CHK_REG, pos/8, val);
+}
+
+static void isa_mem_hook(void *arg, mem_t m, word_t pos, int len, word_t val)
+{
+    check_ptr c = (check_ptr) arg;
+    add_write(&c->isa_rec, CHK_MEM, pos, val);
+}
+
+/* Keep only the last write to each location, ordered by location */
+static void canonical(retire_ptr r)
+{
+    int i, n = 0;
+    /* Insertion sort keeps equal locations in order of writing */
+    for (i = 1; i < r->nwrites; i++) {
+	chk_write_rec w = r->writes[i];
+	int j = i;
+	while (j > 0 && (r->writes[j-1].kind > w.kind ||
+			 (r->writes[j-1].kind == w.kind &&
+			  r->writes[j-1].addr > w.addr))) {
+	    r->writes[j] = r->writes[j-1];
+	    j--;
+	}
+	r->writes[j] = w;
+    }
+    for (i = 0; i < r->nwrites; i++) {
+	if (n > 0 && r->writes[n-1].kind == r->writes[i].kind &&
+	    r->writes[n-1].addr == r->writes[i].addr)
+	    n--;
+	r->writes[n++] = r->writes[i];
+    }
+    r->nwrites = n;
+}
+
+static bool_t same_writes(retire_ptr a, retire_ptr b)
+{
+    int i;
+    if (a->nwrites != b->nwrites)
+	return FALSE;
+    for (i = 0; i < a->nwrites; i++)
+	if (a->writes[i].kind != b->writes[i].kind ||
+	    a->writes[i].addr != b->writes[i].addr ||
+	    a->writes[i].val != b->writes[i].val)
+	    return FALSE;
+    return TRUE;
+}
+
+/* Append description of r to buf of length len */
+static int describe(char *buf, int len, char *who, retire_ptr r)
+{
+    int n = snprintf(buf, len, "  %s PC = 0x%llx, Status '%s', writes:",
+		     who, r->pc, stat_name(r->stat));
+    int i;
+    for (i = 0; i < r->nwrites && n < len; i++) {
+	chk_write_ptr w = &r->writes[i];
+	if (w->kind == CHK_REG)
+	    n += snprintf(buf+n, len-n, " %s=0x%llx",
+			  reg_name(w->addr), w->val);
+	else
+	    n += snprintf(buf+n, len-n, " M[0x%llx]=0x%llx", w->addr, w->val);
+    }
+    if (n < len)
+	n += snprintf(buf+n, len-n, "\n");
+    return n < len ? n : len;
+}
+
+/* Execute one ISA instruction and compare it with r */
+static void check_one(check_ptr c, retire_ptr r)
+{
+    retire_ptr ir = &c->isa_rec;
+    bool_t ok;
+    ir->pc = c->isa->s->pc;
+    ir->nwrites = 0;
+    ir->stat = c->isa_stat = step_machine(c->isa);
+    ok = ir->pc == r->pc && ir->stat == r->stat;
+    if (ok && (r->stat == STAT_AOK || r->stat == STAT_HLT)) {
+	canonical(r);
+	canonical(ir);
+	ok = same_writes(r, ir);
+    }
+    if (!ok) {
+	int n = snprintf(c->msg, CHK_MSGLEN,
+			 "Divergence at instruction %lld\n", c->checked + 1);
+	n += describe(c->msg + n, CHK_MSGLEN - n, "Simulator:", r);
+	describe(c->msg + n, CHK_MSGLEN - n, "ISA:      ", ir);
+	STORE_REL(&c->failed, 1);
+	return;
+    }
+    c->checked++;
+}
+
+/* Checking thread.  Consumes queue until told it is done */
+static void *check_worker(void *arg)
+{
+    check_ptr c = (check_ptr) arg;
+    while (1) {
+	word_t head = LOAD_ACQ(&c->head);
+	if (c->tail == head) {
+	    if (LOAD_ACQ(&c->done) && LOAD_ACQ(&c->head) == c->tail)
+		break;
+	    sched_yield();
+	    continue;
+	}
+	if (!c->failed)
+	    check_one(c, &c->queue[c->tail % CHK_QUEUE]);
+	STORE_REL(&c->tail, c->tail + 1);
+    }
+    return NULL;
+}
+
+check_ptr new_checker(mem_t reg, mem_t mem, lazy_cc_rec cc,
+		      bool_t threaded)
+{
+    check_ptr c = (check_ptr) calloc(1, sizeof(check_rec));
+    state_ptr s;
+    /* Exceptions are reported by status alone */
+    c->isa = new_machine(0, NULL, NULL);
+    c->isa->engine = ENGINE_STEP;
+    s = c->isa->s;
+    free_mem(s->r);
+    free_mem(s->m);
+    /* A checking thread must not share pages with the simulator */
+    s->r = threaded ? clone_mem(reg) : copy_mem(reg);
+    s->m = threaded ? clone_mem(mem) : copy_mem(mem);
+    s->cc = cc;
+    c->isa_stat = STAT_AOK;
+    set_write_hook(s->r, isa_reg_hook, (void *) c);
+    set_write_hook(s->m, isa_mem_hook, (void *) c);
+    c->mem = mem;
+    set_write_hook(mem, pipe_hook, (void *) c);
+    c->threaded = threaded;
+    if (threaded) {
+	c->queue = (retire_ptr) malloc(CHK_QUEUE * sizeof(retire_rec));
+	c->thread = malloc(sizeof(pthread_t));
+	pthread_create((pthread_t *) c->thread, NULL, check_worker,
+		       (void *) c);
+    }
+    return c;
+}
+
+void check_reg(check_ptr c, reg_id_t r, word_t val)
+{
+    if (r != REG_NONE)
+	add_write(&c->pending, CHK_REG, r, val);
+}
+
+void check_retire(check_ptr c, word_t pc, stat_t stat)
+{
+    retire_ptr r = &c->pending;
+    r->pc = pc;
+    r->stat = stat;
+    c->retired++;
+    if (!c->threaded) {
+	if (!c->failed)
+	    check_one(c, r);
+    } else if (!LOAD_ACQ(&c->failed)) {
+	/* Wait for a free slot */
+	while (c->head - LOAD_ACQ(&c->tail) == CHK_QUEUE)
+	    sched_yield();
+	c->queue[c->head % CHK_QUEUE] = *r;
+	STORE_REL(&c->head, c->head + 1);
+    }
+    r->nwrites = 0;
+}
+
+bool_t check_failed(check_ptr c)
+{
+    return LOAD_ACQ(&c->failed) != 0;
+}
+
+void finish_checker(check_ptr c)
+{
+    if (c->threaded && c->thread) {
+	STORE_REL(&c->done, 1);
+	pthread_join(*(pthread_t *) c->thread, NULL);
+	free(c->thread);
+	c->thread = NULL;
+    }
+    set_write_hook(c->mem, NULL, NULL);
+    set_write_hook(c->isa->s->r, NULL, NULL);
+    set_write_hook(c->isa->s->m, NULL, NULL);
+}
+
+void free_checker(check_ptr c)
+{
+    finish_checker(c);
+    free_machine(c->isa);
+    free((void *) c->queue);
+    free((void *) c);
+}
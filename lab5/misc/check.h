@@ -0,0 +1,89 @@
+/* Lock-step checking of a processor simulator against the ISA model */
+
+/* As each instruction retires, the simulator reports the registers it
+   writes, and its memory writes are captured through a write hook.
+   The ISA model then executes one instruction, and the two are
+   compared: PC, status, and the final value of each register and
+   memory word written.  Writes are compared only for instructions
+   that complete normally, since a faulting instruction's partial
+   effects depend on the implementation.  Checking stops at the first
+   divergence.
+
+   The ISA model can run on a second thread, fed through a
+   single-producer, single-consumer queue of retired instructions.
+   The simulator then learns of a divergence up to CHK_QUEUE
+   instructions after it happens, but the report still names the
+   instruction that diverged. */
+
+/* Most writes recorded for one instruction */
+#define CHK_WRITES 8
+
+/* Length of queue to checking thread.  A power of 2 */
+#define CHK_QUEUE 1024
+
+/* Longest divergence report */
+#define CHK_MSGLEN 512
+
+typedef enum { CHK_REG, CHK_MEM } chk_kind_t;
+
+typedef struct {
+  chk_kind_t kind;
+  word_t addr;     /* Register ID or memory address */
+  word_t val;
+} chk_write_rec, *chk_write_ptr;
+
+/* Effects of one retired instruction */
+typedef struct {
+  word_t pc;
+  stat_t stat;
+  int nwrites;
+  chk_write_rec writes[CHK_WRITES];
+} retire_rec, *retire_ptr;
+
+typedef struct {
+  /* Reference model */
+  machine_ptr isa;
+  /* Status of latest ISA instruction */
+  stat_t isa_stat;
+  /* Effects of ISA instruction being executed */
+  retire_rec isa_rec;
+  /* Memory of simulator, with write hook */
+  mem_t mem;
+  /* Effects of simulator instruction not yet retired */
+  retire_rec pending;
+  /* Instructions retired by simulator, and checked */
+  word_t retired;
+  word_t checked;
+  /* Set once a divergence is found, with its description */
+  int failed;
+  char msg[CHK_MSGLEN];
+  /* Checking thread and its queue */
+  bool_t threaded;
+  void *thread;
+  retire_ptr queue;
+  word_t head;     /* Next slot written by simulator */
+  word_t tail;     /* Next slot read by checking thread */
+  int done;
+} check_rec, *check_ptr;
+
+/* Begin checking a simulator whose register file, memory, and
+   condition codes are reg, mem, and cc.  The ISA model starts from
+   copies of these.  Installs a write hook on mem */
+check_ptr new_checker(mem_t reg, mem_t mem, lazy_cc_rec cc,
+		      bool_t threaded);
+
+/* Record write of val to register r by instruction about to retire */
+void check_reg(check_ptr c, reg_id_t r, word_t val);
+
+/* Retire instruction at pc with status stat, comparing it with the ISA
+   model, or queueing it to be compared */
+void check_retire(check_ptr c, word_t pc, stat_t stat);
+
+/* Has a divergence been found? */
+bool_t check_failed(check_ptr c);
+
+/* Wait until all retired instructions are checked, and remove hooks.
+   The ISA model is then in the state after the last one checked */
+void finish_checker(check_ptr c);
+
+void free_checker(check_ptr c);
@@ -0,0 +1,324 @@
+/* Record and replay of simulator execution */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "isa.h"
+#include "history.h"
+
+/* Redoing this many steps costs about as much as restoring memories
+   from a checkpoint */
+#define RESTORE_COST 16
+
+/* Longest command line of hist_debug */
+#define CMDLEN 256
+
+hist_ptr new_history(word_t window)
+{
+    hist_ptr h = (hist_ptr) calloc(1, sizeof(hist_rec));
+    h->window = window;
+    return h;
+}
+
+void free_history(hist_ptr h)
+{
+    int i, j;
+    for (i = 0; i < h->nmems; i++)
+	set_write_hook(h->mems[i], NULL, NULL);
+    for (i = 0; i < h->nckpts; i++)
+	for (j = 0; j < h->nmems; j++)
+	    free_mem(h->ckpts[i].copies[j]);
+    free((void *) h->ckpts);
+    free((void *) h->writes);
+    free((void *) h->wstart);
+    free((void *) h->stats);
+    free((void *) h->states);
+    free((void *) h);
+}
+
+void hist_add_mem(hist_ptr h, mem_t m)
+{
+    if (h->nmems == HIST_MEMS) {
+	fprintf(stderr, "Too many memories in history\n");
+	exit(1);
+    }
+    h->mems[h->nmems++] = m;
+}
+
+void hist_add_area(hist_ptr h, void *addr, int len)
+{
+    if (h->nareas == HIST_AREAS) {
+	fprintf(stderr, "Too many state areas in history\n");
+	exit(1);
+    }
+    h->areas[h->nareas] = addr;
+    h->area_lens[h->nareas++] = len;
+    h->state_len += len;
+}
+
+/* Record the old and new values of a write about to happen */
+static void hist_hook(void *arg, mem_t m, word_t pos, int len, word_t val)
+{
+    hist_ptr h = (hist_ptr) arg;
+    hist_write_ptr w;
+    int i;
+    if (h->replaying)
+	return;
+    for (i = 0; h->mems[i] != m; i++)
+	;
+    if (h->nwrites == h->maxwrites) {
+	h->maxwrites = h->maxwrites ? 2*h->maxwrites : 1024;
+	h->writes = (hist_write_ptr)
+	    realloc(h->writes, h->maxwrites * sizeof(hist_write_rec));
+    }
+    w = &h->writes[h->nwrites++];
+    w->pos = pos;
+    w->newval = val;
+    w->mem = i;
+    w->len = len;
+    if (len == 8) {
+	get_word_val(m, pos, &w->oldval);
+    } else {
+	byte_t b = 0;
+	get_byte_val(m, pos, &b);
+	w->oldval = b;
+    }
+}
+
+static void save_areas(hist_ptr h, word_t step)
+{
+    byte_t *state = h->states + (step - h->first) * h->state_len;
+    int i;
+    for (i = 0; i < h->nareas; i++) {
+	memcpy(state, h->areas[i], h->area_lens[i]);
+	state += h->area_lens[i];
+    }
+}
+
+static void load_areas(hist_ptr h, word_t step)
+{
+    byte_t *state = h->states + (step - h->first) * h->state_len;
+    int i;
+    for (i = 0; i < h->nareas; i++) {
+	memcpy(h->areas[i], state, h->area_lens[i]);
+	state += h->area_lens[i];
+    }
+}
+
+static void add_ckpt(hist_ptr h)
+{
+    hist_ckpt_ptr c;
+    int i;
+    if (h->nckpts == h->maxckpts) {
+	h->maxckpts = h->maxckpts ? 2*h->maxckpts : 16;
+	h->ckpts = (hist_ckpt_ptr)
+	    realloc(h->ckpts, h->maxckpts * sizeof(hist_ckpt_rec));
+    }
+    c = &h->ckpts[h->nckpts++];
+    c->step = h->last;
+    for (i = 0; i < h->nmems; i++)
+	c->copies[i] = copy_mem(h->mems[i]);
+}
+
+void hist_start(hist_ptr h)
+{
+    int i;
+    h->first = h->last = h->cur = 0;
+    h->nwrites = 0;
+    if (h->maxsteps == 0) {
+	h->maxsteps = 1024;
+	h->wstart = (word_t *) malloc(h->maxsteps * sizeof(word_t));
+	h->stats = (byte_t *) malloc(h->maxsteps);
+	h->states = (byte_t *) malloc(h->maxsteps * h->state_len);
+    }
+    h->wstart[0] = 0;
+    h->stats[0] = STAT_AOK;
+    save_areas(h, 0);
+    add_ckpt(h);
+    for (i = 0; i < h->nmems; i++)
+	set_write_hook(h->mems[i], hist_hook, (void *) h);
+}
+
+/* Discard steps before the latest checkpoint at least window old */
+static void trim(hist_ptr h)
+{
+    int k, i, j;
+    word_t drop, wdrop;
+    for (k = h->nckpts-1; k > 0; k--)
+	if (h->ckpts[k].step + h->window <= h->last)
+	    break;
+    if (k == 0)
+	return;
+    for (i = 0; i < k; i++)
+	for (j = 0; j < h->nmems; j++)
+	    free_mem(h->ckpts[i].copies[j]);
+    h->nckpts -= k;
+    memmove(h->ckpts, h->ckpts + k, h->nckpts * sizeof(hist_ckpt_rec));
+
+    /* Writes of the new first step are part of its checkpoint */
+    drop = h->ckpts[0].step - h->first;
+    wdrop = h->wstart[drop];
+    h->nwrites -= wdrop;
+    memmove(h->writes, h->writes + wdrop,
+	    h->nwrites * sizeof(hist_write_rec));
+    for (i = drop; i <= h->last - h->first; i++)
+	h->wstart[i-drop] = h->wstart[i] - wdrop;
+    memmove(h->stats, h->stats + drop, h->last - h->first - drop + 1);
+    memmove(h->states, h->states + drop * h->state_len,
+	    (h->last - h->first - drop + 1) * h->state_len);
+    h->first += drop;
+}
+
+void hist_record_step(hist_ptr h, stat_t e)
+{
+    word_t n = h->last - h->first + 1;
+    if (n == h->maxsteps) {
+	h->maxsteps *= 2;
+	h->wstart = (word_t *)
+	    realloc(h->wstart, h->maxsteps * sizeof(word_t));
+	h->stats = (byte_t *) realloc(h->stats, h->maxsteps);
+	h->states = (byte_t *)
+	    realloc(h->states, h->maxsteps * h->state_len);
+    }
+    h->cur = ++h->last;
+    h->wstart[n] = h->nwrites;
+    h->stats[n] = e;
+    save_areas(h, h->last);
+    if (h->last % HIST_INTERVAL == 0) {
+	add_ckpt(h);
+	if (h->window > 0 && h->last - h->first > 2*h->window)
+	    trim(h);
+    }
+}
+
+/* Apply write w, using its new value if redo and old value if not */
+static void apply_write(hist_ptr h, hist_write_ptr w, bool_t redo)
+{
+    word_t val = redo ? w->newval : w->oldval;
+    if (w->len == 8)
+	set_word_val(h->mems[w->mem], w->pos, val);
+    else
+	set_byte_val(h->mems[w->mem], w->pos, (byte_t) val);
+}
+
+bool_t hist_forward(hist_ptr h)
+{
+    word_t i;
+    if (h->cur >= h->last)
+	return FALSE;
+    h->cur++;
+    h->replaying = TRUE;
+    for (i = h->wstart[h->cur - h->first - 1];
+	 i < h->wstart[h->cur - h->first]; i++)
+	apply_write(h, &h->writes[i], TRUE);
+    h->replaying = FALSE;
+    load_areas(h, h->cur);
+    return TRUE;
+}
+
+bool_t hist_back(hist_ptr h)
+{
+    word_t i;
+    if (h->cur <= h->first)
+	return FALSE;
+    h->replaying = TRUE;
+    for (i = h->wstart[h->cur - h->first];
+	 i > h->wstart[h->cur - h->first - 1]; i--)
+	apply_write(h, &h->writes[i-1], FALSE);
+    h->replaying = FALSE;
+    h->cur--;
+    load_areas(h, h->cur);
+    return TRUE;
+}
+
+bool_t hist_goto(hist_ptr h, word_t step)
+{
+    word_t dist = step > h->cur ? step - h->cur : h->cur - step;
+    int k, i;
+    if (step < h->first || step > h->last)
+	return FALSE;
+    /* Latest checkpoint at or before step */
+    for (k = h->nckpts-1; h->ckpts[k].step > step; k--)
+	;
+    if (step - h->ckpts[k].step + RESTORE_COST < dist) {
+	for (i = 0; i < h->nmems; i++)
+	    restore_mem(h->mems[i], h->ckpts[k].copies[i]);
+	h->cur = h->ckpts[k].step;
+	load_areas(h, h->cur);
+    }
+    while (h->cur < step)
+	hist_forward(h);
+    while (h->cur > step)
+	hist_back(h);
+    return TRUE;
+}
+
+stat_t hist_stat(hist_ptr h)
+{
+    return h->stats[h->cur - h->first];
+}
+
+/* Move one step forward, executing it if not recorded */
+static bool_t debug_forward(hist_ptr h, hist_sim_ptr sim, word_t limit)
+{
+    if (hist_forward(h))
+	return TRUE;
+    if (hist_stat(h) != STAT_AOK || h->last >= limit)
+	return FALSE;
+    hist_record_step(h, sim->step(sim->arg));
+    return TRUE;
+}
+
+void hist_debug(hist_ptr h, hist_sim_ptr sim, FILE *in, word_t limit)
+{
+    char line[CMDLEN];
+    while (fgets(line, CMDLEN, in)) {
+	char cmd = 0;
+	word_t arg = 1;
+	int nargs = sscanf(line, " %c %lli", &cmd, &arg);
+	word_t i;
+	if (nargs < 1)
+	    continue;
+	switch (cmd) {
+	case 's':
+	    for (i = 0; i < arg && debug_forward(h, sim, limit); i++)
+		;
+	    break;
+	case 'b':
+	    for (i = 0; i < arg && hist_back(h); i++)
+		;
+	    break;
+	case 'g':
+	    if (nargs < 2 || arg < h->first) {
+		printf("Step %lld is not recorded\n", arg);
+		continue;
+	    }
+	    if (!hist_goto(h, arg)) {
+		hist_goto(h, h->last);
+		while (h->cur < arg && debug_forward(h, sim, limit))
+		    ;
+	    }
+	    break;
+	case 'c':
+	case 'r':
+	    if (nargs < 2) {
+		printf("Command '%c' needs an address\n", cmd);
+		continue;
+	    }
+	    while (cmd == 'c' ? debug_forward(h, sim, limit) : hist_back(h))
+		if (sim->get_pc(sim->arg) == arg)
+		    break;
+	    break;
+	case 'i':
+	    sim->show(sim->arg, h->cur, hist_stat(h), TRUE);
+	    continue;
+	case 'q':
+	    return;
+	default:
+	    printf("Commands: s [n], b [n], g n, c addr, r addr, i, q\n");
+	    continue;
+	}
+	sim->show(sim->arg, h->cur, hist_stat(h), FALSE);
+    }
+}
@@ -0,0 +1,121 @@
+/* Record and replay of simulator execution */
+
+/* A history records, for every step of a simulator, the writes made
+   to a set of memories (register files and data memories) and a
+   snapshot of a set of state areas (PC, condition codes, status,
+   pipeline registers).  Writes are captured through write hooks, with
+   both old and new values, so that steps can be undone and redone
+   without running the simulator.  Every HIST_INTERVAL steps the
+   memories are checkpointed with copy_mem, which shares unchanged
+   pages, so that any recorded step is reached by redoing at most
+   HIST_INTERVAL steps from a checkpoint.  Steps more than window
+   before the latest are discarded a checkpoint at a time, so that
+   long runs use bounded memory. */
+
+#define HIST_MEMS 4
+#define HIST_AREAS 80
+#define HIST_INTERVAL 1024
+
+/* Default number of steps that can be undone */
+#define HIST_WINDOW 100000
+
+/* One write to a memory */
+typedef struct {
+  word_t pos;
+  word_t oldval;
+  word_t newval;
+  byte_t mem;      /* Index of memory in mems */
+  byte_t len;      /* 1 or 8 bytes */
+} hist_write_rec, *hist_write_ptr;
+
+/* Memories as of step */
+typedef struct {
+  word_t step;
+  mem_t copies[HIST_MEMS];
+} hist_ckpt_rec, *hist_ckpt_ptr;
+
+typedef struct {
+  /* What is recorded */
+  int nmems;
+  mem_t mems[HIST_MEMS];
+  int nareas;
+  void *areas[HIST_AREAS];
+  int area_lens[HIST_AREAS];
+  int state_len;
+  /* Steps first..last are recorded.  Machine is in state after cur */
+  word_t first;
+  word_t last;
+  word_t cur;
+  word_t window;
+  /* Writes of step i are writes[wstart[i-first-1]..wstart[i-first]) */
+  hist_write_ptr writes;
+  word_t nwrites;
+  word_t maxwrites;
+  /* Per step: index of end of its writes, status, and state areas */
+  word_t *wstart;
+  byte_t *stats;
+  byte_t *states;
+  word_t maxsteps;
+  /* Checkpoints, oldest first.  The first is at step first */
+  hist_ckpt_ptr ckpts;
+  int nckpts;
+  int maxckpts;
+  /* Set while history itself writes memories */
+  bool_t replaying;
+} hist_rec, *hist_ptr;
+
+/* Create history keeping at least window steps */
+hist_ptr new_history(word_t window);
+void free_history(hist_ptr h);
+
+/* Record writes to m, through a write hook installed by hist_start */
+void hist_add_mem(hist_ptr h, mem_t m);
+
+/* Record len bytes at addr after every step */
+void hist_add_area(hist_ptr h, void *addr, int len);
+
+/* Record variable v */
+#define HIST_VAR(h, v) hist_add_area(h, &(v), sizeof(v))
+
+/* Begin recording with current state as step 0 */
+void hist_start(hist_ptr h);
+
+/* Record step just executed by the simulator, with status e.
+   Only valid when cur == last */
+void hist_record_step(hist_ptr h, stat_t e);
+
+/* Move one step forward or back through recorded steps.
+   Return FALSE if there is none */
+bool_t hist_forward(hist_ptr h);
+bool_t hist_back(hist_ptr h);
+
+/* Move to recorded step.  Return FALSE if it is not recorded */
+bool_t hist_goto(hist_ptr h, word_t step);
+
+/* Status of current step */
+stat_t hist_stat(hist_ptr h);
+
+/* Interactive debugging */
+
+/* How hist_debug operates on a simulator */
+typedef struct {
+  /* Execute one step and return its status */
+  stat_t (*step)(void *arg);
+  /* Current PC, for breakpoints */
+  word_t (*get_pc)(void *arg);
+  /* Print current state.  Print changed registers and memory if full */
+  void (*show)(void *arg, word_t step, stat_t e, bool_t full);
+  void *arg;
+} hist_sim_rec, *hist_sim_ptr;
+
+/* Read commands from in, moving forward and backward in execution.
+   Steps are executed by the simulator only when beyond those
+   recorded, and never more than limit in all.  Commands:
+     s [n]     Step forward n steps (default 1)
+     b [n]     Step back n steps (default 1)
+     g n       Go to step n
+     c addr    Continue forward until PC = addr
+     r addr    Continue backward until PC = addr
+     i         Show changes to registers and memory
+     q         Quit */
+void hist_debug(hist_ptr h, hist_sim_ptr sim, FILE *in, word_t limit);
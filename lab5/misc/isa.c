@@ -2,15 +2,48 @@
 #include <ctype.h>
 #include <stdio.h>
 #include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "isa.h"
 
 
+#ifdef HAS_GUI
 /* Are we running in GUI mode? */
 extern int gui_mode;
+#endif
 
 /* Bytes Per Line = Block size of memory */
 #define BPL 32
 
+/* Longest instruction encoding, in bytes */
+#define MAX_INSTR_LEN 10
+
+/* Is [pos, pos+n) within memory m?  One unsigned compare, since a
+   negative pos converts to a huge value.  Requires m->len >= n */
+#define IN_BOUNDS(m, pos, n) ((uword_t) (pos) <= (uword_t) ((m)->len - (n)))
+
+/* Convert between host order and the little-endian order of Y86 words */
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define LE64(x) __builtin_bswap64(x)
+#else
+#define LE64(x) (x)
+#endif
+
+/* Memories are compared this many bytes at a time */
+#define DIFF_CHUNK 256
+
+/* run_state handler for instructions needing step_state's error checks */
+#define H_SLOW 16
+
+/* Most instructions in one translated block */
+#define BLOCK_MAX 32
+/* Number of entries in translated block cache */
+#define BCACHE_SIZE 512
+
+static void free_blocks(mem_t m);
+
 struct {
     char *name;
     int id;
@@ -36,12 +69,30 @@ struct {
 };
 
 
+/* Name lookups use perfect hashing: the multipliers and shifts below
+   were chosen offline so that no two names in a table collide.  Any
+   change to the names requires choosing them anew */
+static unsigned name_hash(char *name, unsigned mult, int shift)
+{
+    unsigned h = 0;
+    for (; *name; name++)
+	h = h * mult + (unsigned char) *name;
+    return h ^ (h >> shift);
+}
+
+#define REG_HASH(name) (name_hash(name, 7, 10) & 31)
+
+/* Register ID for each hash value, or -1 */
+static const signed char reg_slot[32] = {
+     1,  6, 14, -1, -1, -1, -1, -1,  4,  8, -1,  2, -1, -1,  9, -1,
+    -1,  5, -1, -1, -1, -1,  0, -1,  7,  3, -1, -1, 12, 13, 10, 11,
+};
+
 reg_id_t find_register(char *name)
 {
-    int i;
-    for (i = 0; i < REG_NONE; i++)
-	if (!strcmp(name, reg_table[i].name))
-	    return reg_table[i].id;
+    int i = reg_slot[REG_HASH(name)];
+    if (i >= 0 && !strcmp(name, reg_table[i].name))
+	return reg_table[i].id;
     return REG_ERR;
 }
 
@@ -59,41 +110,48 @@ int reg_valid(reg_id_t id)
   return id >= 0 && id < REG_NONE && reg_table[id].id == id;
 }
 
+/* Instructions with encodings, as fields of instr_t */
+#define ENCODED_INSTRS(X) \
+    X("nop",    HPACK(I_NOP, F_NONE), 1, NO_ARG, 0, 0, NO_ARG, 0, 0)          \
+    X("halt",   HPACK(I_HALT, F_NONE), 1, NO_ARG, 0, 0, NO_ARG, 0, 0)         \
+    X("rrmovq", HPACK(I_RRMOVQ, F_NONE), 2, R_ARG, 1, 1, R_ARG, 1, 0)         \
+    /* Conditional move instructions are variants of RRMOVQ */                \
+    X("cmovle", HPACK(I_RRMOVQ, C_LE), 2, R_ARG, 1, 1, R_ARG, 1, 0)           \
+    X("cmovl", HPACK(I_RRMOVQ, C_L), 2, R_ARG, 1, 1, R_ARG, 1, 0)             \
+    X("cmove", HPACK(I_RRMOVQ, C_E), 2, R_ARG, 1, 1, R_ARG, 1, 0)             \
+    X("cmovne", HPACK(I_RRMOVQ, C_NE), 2, R_ARG, 1, 1, R_ARG, 1, 0)           \
+    X("cmovge", HPACK(I_RRMOVQ, C_GE), 2, R_ARG, 1, 1, R_ARG, 1, 0)           \
+    X("cmovg", HPACK(I_RRMOVQ, C_G), 2, R_ARG, 1, 1, R_ARG, 1, 0)             \
+    /* arg1hi indicates number of bytes */                                    \
+    X("irmovq", HPACK(I_IRMOVQ, F_NONE), 10, I_ARG, 2, 8, R_ARG, 1, 0)        \
+    X("rmmovq", HPACK(I_RMMOVQ, F_NONE), 10, R_ARG, 1, 1, M_ARG, 1, 0)        \
+    X("mrmovq", HPACK(I_MRMOVQ, F_NONE), 10, M_ARG, 1, 0, R_ARG, 1, 1)        \
+    X("addq",   HPACK(I_ALU, A_ADD), 2, R_ARG, 1, 1, R_ARG, 1, 0)             \
+    X("subq",   HPACK(I_ALU, A_SUB), 2, R_ARG, 1, 1, R_ARG, 1, 0)             \
+    X("andq",   HPACK(I_ALU, A_AND), 2, R_ARG, 1, 1, R_ARG, 1, 0)             \
+    X("xorq",   HPACK(I_ALU, A_XOR), 2, R_ARG, 1, 1, R_ARG, 1, 0)             \
+    /* arg1hi indicates number of bytes */                                    \
+    X("jmp",    HPACK(I_JMP, C_YES), 9, I_ARG, 1, 8, NO_ARG, 0, 0)            \
+    X("jle",    HPACK(I_JMP, C_LE), 9, I_ARG, 1, 8, NO_ARG, 0, 0)             \
+    X("jl",     HPACK(I_JMP, C_L), 9, I_ARG, 1, 8, NO_ARG, 0, 0)              \
+    X("je",     HPACK(I_JMP, C_E), 9, I_ARG, 1, 8, NO_ARG, 0, 0)              \
+    X("jne",    HPACK(I_JMP, C_NE), 9, I_ARG, 1, 8, NO_ARG, 0, 0)             \
+    X("jge",    HPACK(I_JMP, C_GE), 9, I_ARG, 1, 8, NO_ARG, 0, 0)             \
+    X("jg",     HPACK(I_JMP, C_G), 9, I_ARG, 1, 8, NO_ARG, 0, 0)              \
+    X("call",   HPACK(I_CALL, F_NONE),    9, I_ARG, 1, 8, NO_ARG, 0, 0)       \
+    X("ret",    HPACK(I_RET, F_NONE), 1, NO_ARG, 0, 0, NO_ARG, 0, 0)          \
+    X("pushq",  HPACK(I_PUSHQ, F_NONE) , 2, R_ARG, 1, 1, NO_ARG, 0, 0)        \
+    X("popq",   HPACK(I_POPQ, F_NONE) ,  2, R_ARG, 1, 1, NO_ARG, 0, 0)        \
+    X("iaddq",  HPACK(I_IADDQ, F_NONE), 10, I_ARG, 2, 8, R_ARG, 1, 0)         \
+    /* this is just a hack to make the I_POP2 code have an associated name */ \
+    X("pop2",   HPACK(I_POP2, F_NONE) , 0, NO_ARG, 0, 0, NO_ARG, 0, 0)
+
+#define INSTR_REC(...) { __VA_ARGS__ },
+#define CODE_NAME(name, code, ...) [code] = name,
+
 instr_t instruction_set[] = 
 {
-    {"nop",    HPACK(I_NOP, F_NONE), 1, NO_ARG, 0, 0, NO_ARG, 0, 0 },
-    {"halt",   HPACK(I_HALT, F_NONE), 1, NO_ARG, 0, 0, NO_ARG, 0, 0 },
-    {"rrmovq", HPACK(I_RRMOVQ, F_NONE), 2, R_ARG, 1, 1, R_ARG, 1, 0 },
-    /* Conditional move instructions are variants of RRMOVQ */
-    {"cmovle", HPACK(I_RRMOVQ, C_LE), 2, R_ARG, 1, 1, R_ARG, 1, 0 },
-    {"cmovl", HPACK(I_RRMOVQ, C_L), 2, R_ARG, 1, 1, R_ARG, 1, 0 },
-    {"cmove", HPACK(I_RRMOVQ, C_E), 2, R_ARG, 1, 1, R_ARG, 1, 0 },
-    {"cmovne", HPACK(I_RRMOVQ, C_NE), 2, R_ARG, 1, 1, R_ARG, 1, 0 },
-    {"cmovge", HPACK(I_RRMOVQ, C_GE), 2, R_ARG, 1, 1, R_ARG, 1, 0 },
-    {"cmovg", HPACK(I_RRMOVQ, C_G), 2, R_ARG, 1, 1, R_ARG, 1, 0 },
-    /* arg1hi indicates number of bytes */
-    {"irmovq", HPACK(I_IRMOVQ, F_NONE), 10, I_ARG, 2, 8, R_ARG, 1, 0 },
-    {"rmmovq", HPACK(I_RMMOVQ, F_NONE), 10, R_ARG, 1, 1, M_ARG, 1, 0 },
-    {"mrmovq", HPACK(I_MRMOVQ, F_NONE), 10, M_ARG, 1, 0, R_ARG, 1, 1 },
-    {"addq",   HPACK(I_ALU, A_ADD), 2, R_ARG, 1, 1, R_ARG, 1, 0 },
-    {"subq",   HPACK(I_ALU, A_SUB), 2, R_ARG, 1, 1, R_ARG, 1, 0 },
-    {"andq",   HPACK(I_ALU, A_AND), 2, R_ARG, 1, 1, R_ARG, 1, 0 },
-    {"xorq",   HPACK(I_ALU, A_XOR), 2, R_ARG, 1, 1, R_ARG, 1, 0 },
-    /* arg1hi indicates number of bytes */
-    {"jmp",    HPACK(I_JMP, C_YES), 9, I_ARG, 1, 8, NO_ARG, 0, 0 },
-    {"jle",    HPACK(I_JMP, C_LE), 9, I_ARG, 1, 8, NO_ARG, 0, 0 },
-    {"jl",     HPACK(I_JMP, C_L), 9, I_ARG, 1, 8, NO_ARG, 0, 0 },
-    {"je",     HPACK(I_JMP, C_E), 9, I_ARG, 1, 8, NO_ARG, 0, 0 },
-    {"jne",    HPACK(I_JMP, C_NE), 9, I_ARG, 1, 8, NO_ARG, 0, 0 },
-    {"jge",    HPACK(I_JMP, C_GE), 9, I_ARG, 1, 8, NO_ARG, 0, 0 },
-    {"jg",     HPACK(I_JMP, C_G), 9, I_ARG, 1, 8, NO_ARG, 0, 0 },
-    {"call",   HPACK(I_CALL, F_NONE),    9, I_ARG, 1, 8, NO_ARG, 0, 0 },
-    {"ret",    HPACK(I_RET, F_NONE), 1, NO_ARG, 0, 0, NO_ARG, 0, 0 },
-    {"pushq",  HPACK(I_PUSHQ, F_NONE) , 2, R_ARG, 1, 1, NO_ARG, 0, 0 },
-    {"popq",   HPACK(I_POPQ, F_NONE) ,  2, R_ARG, 1, 1, NO_ARG, 0, 0 },
-    {"iaddq",  HPACK(I_IADDQ, F_NONE), 10, I_ARG, 2, 8, R_ARG, 1, 0 },
-    /* this is just a hack to make the I_POP2 code have an associated name */
-    {"pop2",   HPACK(I_POP2, F_NONE) , 0, NO_ARG, 0, 0, NO_ARG, 0, 0 },
+    ENCODED_INSTRS(INSTR_REC)
 
     /* For allocation instructions, arg1hi indicates number of bytes */
     {".byte",  0x00, 1, I_ARG, 0, 1, NO_ARG, 0, 0 },
@@ -106,23 +164,34 @@ instr_t instruction_set[] =
 instr_t invalid_instr =
     {"XXX",     0   , 0, NO_ARG, 0, 0, NO_ARG, 0, 0 };
 
+#define INSTR_HASH(name) (name_hash(name, 908, 12) & 63)
+
+/* Index in instruction_set for each hash value, or -1 */
+static const signed char instr_slot[64] = {
+     2, -1, -1,  6, 28, -1,  9, 26, 22, -1, 19, -1, -1, 23, -1, -1,
+    -1, -1,  0, -1, -1,  5, -1,  8, 27, -1, -1, 14, 16, 20, -1, 12,
+    -1, 10, 32, -1, 30, 17, -1, 15, 24, 29, 25, 11,  4, -1, -1, -1,
+    -1, 13, -1, 18, -1,  7, 21, -1,  1, -1, -1,  3, 31, -1, -1, -1,
+};
+
 instr_ptr find_instr(char *name)
 {
-    int i;
-    for (i = 0; instruction_set[i].name; i++)
-	if (strcmp(instruction_set[i].name,name) == 0)
-	    return &instruction_set[i];
+    int i = instr_slot[INSTR_HASH(name)];
+    if (i >= 0 && strcmp(instruction_set[i].name, name) == 0)
+	return &instruction_set[i];
     return NULL;
 }
 
+/* Name of instruction for each encoding, or NULL */
+static char * const code_names[256] = {
+    ENCODED_INSTRS(CODE_NAME)
+};
+
 /* Return name of instruction given its encoding */
 char *iname(int instr) {
-    int i;
-    for (i = 0; instruction_set[i].name; i++) {
-	if (instr == instruction_set[i].code)
-	    return instruction_set[i].name;
-    }
-    return "<bad>";
+    if (instr < 0 || instr > 0xFF || !code_names[instr])
+	return "<bad>";
+    return code_names[instr];
 }
 
 
@@ -132,50 +201,330 @@ instr_ptr bad_instr()
 }
 
 
-mem_t init_mem(int len)
+/* Words per page, and 64-bit words of dirty bitmap per page */
+#define PAGE_WORDS (PAGE_SIZE/8)
+#define DIRTY_WORDS (PAGE_WORDS/64)
+
+/* Page of memory.  Pages and page tables are shared copy-on-write
+   between memories; refs counts the sharers */
+typedef struct page_rec {
+  int refs;
+  /* Distinct nonzero value after every write */
+  uword_t stamp;
+  /* Stamp of the page this one was copied from, or 0 if it started
+     out zeroed.  Only words marked in dirty can differ from that
+     page, if it has not been written since */
+  uword_t base;
+  uword_t dirty[DIRTY_WORDS];
+  byte_t data[PAGE_SIZE];
+} page_rec, *page_ptr;
+
+/* Second-level page table */
+typedef struct ptab_rec {
+  int refs;
+  page_ptr pages[PTAB_SIZE];
+} ptab_rec, *ptab_ptr;
+
+/* Decode entries for one page of memory.  blocks records which
+   DBLOCK-byte blocks hold valid entries */
+typedef struct dpage_rec {
+  byte_t blocks[PAGE_SIZE/DBLOCK];
+  decode_rec d[PAGE_SIZE];
+} dpage_rec, *dpage_ptr;
+
+/* Stands in for every page not yet written */
+static page_rec zero_page;
+
+/* Source of page stamps.  Shared by all memories, so incremented
+   atomically when threads may be running machines at once */
+static uword_t last_stamp = 0;
+#ifdef __GNUC__
+#define NEXT_STAMP() __sync_add_and_fetch(&last_stamp, 1)
+#else
+#define NEXT_STAMP() (++last_stamp)
+#endif
+
+#define PAGE_NUM(pos) ((uword_t) (pos) >> PAGE_BITS)
+#define PAGE_OFF(pos) ((pos) & (PAGE_SIZE-1))
+#define DIR_NUM(pos) ((uword_t) (pos) >> (PAGE_BITS+PTAB_BITS))
+#define PTAB_IDX(pos) (PAGE_NUM(pos) & (PTAB_SIZE-1))
+
+/* Find page holding valid address pos.  Return NULL if never written */
+static page_ptr find_page(mem_t m, word_t pos)
+{
+    ptab_ptr t = m->dir[DIR_NUM(pos)];
+    return t ? t->pages[PTAB_IDX(pos)] : NULL;
+}
+
+/* Find page holding valid address pos for reading */
+static byte_t *read_addr(mem_t m, word_t pos)
+{
+    page_ptr p = find_page(m, pos);
+    if (!p)
+	p = &zero_page;
+    return p->data + PAGE_OFF(pos);
+}
+
+/* Drop one reference to page table t, freeing what is no longer shared */
+static void release_ptab(ptab_ptr t)
+{
+    int j;
+    if (--t->refs > 0)
+	return;
+    for (j = 0; j < PTAB_SIZE; j++) {
+	page_ptr p = t->pages[j];
+	if (p && --p->refs == 0)
+	    free((void *) p);
+    }
+    free((void *) t);
+}
+
+/* Find page holding the n bytes at valid address pos for writing,
+   allocating it if necessary, and copying it and its page table if
+   shared.  The bytes must lie within one page */
+static byte_t *write_addr(mem_t m, word_t pos, int n)
+{
+    word_t w;
+    ptab_ptr t = m->dir[DIR_NUM(pos)];
+    page_ptr p;
+    if (!t) {
+	t = (ptab_ptr) calloc(1, sizeof(ptab_rec));
+	t->refs = 1;
+	m->dir[DIR_NUM(pos)] = t;
+    } else if (t->refs > 1) {
+	ptab_ptr nt = (ptab_ptr) malloc(sizeof(ptab_rec));
+	int j;
+	*nt = *t;
+	nt->refs = 1;
+	for (j = 0; j < PTAB_SIZE; j++)
+	    if (nt->pages[j])
+		nt->pages[j]->refs++;
+	t->refs--;
+	t = nt;
+	m->dir[DIR_NUM(pos)] = t;
+    }
+    p = t->pages[PTAB_IDX(pos)];
+    if (!p) {
+	p = (page_ptr) calloc(1, sizeof(page_rec));
+	p->refs = 1;
+	p->base = 0;
+	t->pages[PTAB_IDX(pos)] = p;
+	m->npages++;
+    } else if (p->refs > 1) {
+	page_ptr np = (page_ptr) malloc(sizeof(page_rec));
+	memcpy(np->data, p->data, PAGE_SIZE);
+	memset(np->dirty, 0, sizeof(np->dirty));
+	np->refs = 1;
+	np->base = p->stamp;
+	p->refs--;
+	p = np;
+	t->pages[PTAB_IDX(pos)] = p;
+    }
+    p->stamp = NEXT_STAMP();
+    for (w = PAGE_OFF(pos)/8; w <= PAGE_OFF(pos+n-1)/8; w++)
+	p->dirty[w/64] |= (uword_t) 1 << (w%64);
+    return p->data + PAGE_OFF(pos);
+}
+
+/* Release all pages of m */
+static void free_pages(mem_t m)
+{
+    word_t i;
+    for (i = 0; i < m->ndir; i++) {
+	if (m->dir[i])
+	    release_ptab(m->dir[i]);
+	m->dir[i] = NULL;
+    }
+    m->npages = 0;
+}
+
+mem_t init_mem(word_t len)
 {
 
     mem_t result = (mem_t) malloc(sizeof(mem_rec));
+    /* Nonempty, so that IN_BOUNDS works for words */
+    if (len < BPL)
+	len = BPL;
     len = ((len+BPL-1)/BPL)*BPL;
     result->len = len;
-    result->contents = (byte_t *) calloc(len, 1);
+    result->ndir = DIR_NUM(len-1) + 1;
+    result->dir = (ptab_ptr *) calloc(result->ndir, sizeof(ptab_ptr));
+    result->npages = 0;
+    result->dpages = NULL;
+    result->bcache = NULL;
+    result->bgen = 0;
+    result->hook = NULL;
+    result->hook_arg = NULL;
     return result;
 }
 
 void clear_mem(mem_t m)
 {
-    memset(m->contents, 0, m->len);
+    free_pages(m);
+    flush_decoded(m);
 }
 
 void free_mem(mem_t m)
 {
-    free((void *) m->contents);
+    free_blocks(m);
+    flush_decoded(m);
+    free_pages(m);
+    free((void *) m->dir);
     free((void *) m);
 }
 
+/* The copy shares all page tables with oldm.  Pages are copied only
+   when one of the memories writes them */
 mem_t copy_mem(mem_t oldm)
 {
     mem_t newm = init_mem(oldm->len);
-    memcpy(newm->contents, oldm->contents, oldm->len);
+    word_t i;
+    for (i = 0; i < oldm->ndir; i++) {
+	ptab_ptr t = oldm->dir[i];
+	if (t)
+	    t->refs++;
+	newm->dir[i] = t;
+    }
+    newm->npages = oldm->npages;
     return newm;
 }
 
+void restore_mem(mem_t m, mem_t src)
+{
+    word_t i;
+    for (i = 0; i < src->ndir; i++)
+	if (src->dir[i])
+	    src->dir[i]->refs++;
+    free_pages(m);
+    flush_decoded(m);
+    for (i = 0; i < m->ndir && i < src->ndir; i++)
+	m->dir[i] = src->dir[i];
+    for (; i < src->ndir; i++)
+	if (src->dir[i])
+	    release_ptab(src->dir[i]);
+    m->npages = src->npages;
+}
+
+/* Page tables and pages are copied now, so that the copy and oldm can
+   be used by different threads */
+mem_t clone_mem(mem_t oldm)
+{
+    mem_t newm = init_mem(oldm->len);
+    word_t i;
+    int j;
+    for (i = 0; i < oldm->ndir; i++) {
+	ptab_ptr t = oldm->dir[i];
+	ptab_ptr nt;
+	if (!t)
+	    continue;
+	nt = (ptab_ptr) calloc(1, sizeof(ptab_rec));
+	nt->refs = 1;
+	for (j = 0; j < PTAB_SIZE; j++) {
+	    page_ptr p = t->pages[j];
+	    page_ptr np;
+	    if (!p)
+		continue;
+	    np = (page_ptr) calloc(1, sizeof(page_rec));
+	    memcpy(np->data, p->data, PAGE_SIZE);
+	    np->refs = 1;
+	    /* Same as p, with no words dirty, until either is written */
+	    np->base = p->stamp;
+	    np->stamp = NEXT_STAMP();
+	    nt->pages[j] = np;
+	}
+	newm->dir[i] = nt;
+    }
+    newm->npages = oldm->npages;
+    return newm;
+}
+
+/* Find first word in [pos, end) where data od and nd differ, checking
+   only words marked in dirty.  Return -1 if there is none */
+static word_t dirty_diff(uword_t *dirty, byte_t *od, byte_t *nd,
+			 word_t pos, word_t end)
+{
+    for (; pos < end; pos += 8) {
+	word_t w = PAGE_OFF(pos)/8;
+	if (!dirty[w/64]) {
+	    /* Skip rest of this bitmap word */
+	    pos = (pos | (64*8-1)) - 7;
+	    continue;
+	}
+	if ((dirty[w/64] >> (w%64)) & 1 &&
+	    memcmp(od+PAGE_OFF(pos), nd+PAGE_OFF(pos), 8) != 0)
+	    return pos;
+    }
+    return -1;
+}
+
+word_t next_diff(mem_t oldm, mem_t newm, word_t pos)
+{
+    word_t len = oldm->len;
+    if (newm->len < len)
+	len = newm->len;
+    while (pos < len) {
+	page_ptr op, np;
+	byte_t *od, *nd;
+	word_t end;
+	/* Skip ranges shared, or never written in either memory */
+	if (oldm->dir[DIR_NUM(pos)] == newm->dir[DIR_NUM(pos)]) {
+	    pos = (DIR_NUM(pos) + 1) << (PAGE_BITS+PTAB_BITS);
+	    continue;
+	}
+	op = find_page(oldm, pos);
+	np = find_page(newm, pos);
+	end = (PAGE_NUM(pos) + 1) << PAGE_BITS;
+	if (op == np) {
+	    pos = end;
+	    continue;
+	}
+	if (end > len)
+	    end = len;
+	if (!op)
+	    op = &zero_page;
+	if (!np)
+	    np = &zero_page;
+	od = op->data;
+	nd = np->data;
+	/* When one page derives from the other, unchanged since, only
+	   the words it has written can differ */
+	if (np->base == op->stamp || op->base == np->stamp) {
+	    word_t dpos = dirty_diff(np->base == op->stamp ? np->dirty : op->dirty,
+				     od, nd, pos, end);
+	    if (dpos >= 0)
+		return dpos;
+	    pos = end;
+	    continue;
+	}
+	while (pos < end) {
+	    word_t cnt = DIFF_CHUNK - pos % DIFF_CHUNK;
+	    if (pos + cnt > end)
+		cnt = end - pos;
+	    if (memcmp(od+PAGE_OFF(pos), nd+PAGE_OFF(pos), cnt) != 0) {
+		/* Find the word within the chunk */
+		while (memcmp(od+PAGE_OFF(pos), nd+PAGE_OFF(pos), 8) == 0)
+		    pos += 8;
+		return pos;
+	    }
+	    pos += cnt;
+	}
+    }
+    return -1;
+}
+
 bool_t diff_mem(mem_t oldm, mem_t newm, FILE *outfile)
 {
     word_t pos;
-    int len = oldm->len;
     bool_t diff = FALSE;
-    if (newm->len < len)
-	len = newm->len;
-    for (pos = 0; (!diff || outfile) && pos < len; pos += 8) {
+    for (pos = next_diff(oldm, newm, 0); pos >= 0;
+	 pos = next_diff(oldm, newm, pos+8)) {
         word_t ov = 0;  word_t nv = 0;
+	diff = TRUE;
+	if (!outfile)
+	    break;
 	get_word_val(oldm, pos, &ov);
 	get_word_val(newm, pos, &nv);
-	if (nv != ov) {
-	    diff = TRUE;
-	    if (outfile)
-		fprintf(outfile, "0x%.4llx:\t0x%.16llx\t0x%.16llx\n", pos, ov, nv);
-	}
+	fprintf(outfile, "0x%.4llx:\t0x%.16llx\t0x%.16llx\n", pos, ov, nv);
     }
     return diff;
 }
@@ -190,15 +539,170 @@ int hex2dig(char c)
 	return c - 'a' + 10;
 }
 
+/* Longest line of .yo file */
 #define LINELEN 4096
-int load_mem(mem_t m, FILE *infile, int report_error)
+
+/* Format message and pass it to error callback, if there is one */
+static void report(error_fn_t error, void *error_arg, char *fmt, ...)
+{
+    char msg[LINELEN+256];
+    va_list ap;
+    if (!error)
+	return;
+    va_start(ap, fmt);
+    vsnprintf(msg, sizeof(msg), fmt, ap);
+    va_end(ap);
+    error(error_arg, msg);
+}
+
+void error_to_file(void *arg, char *msg)
+{
+    fputs(msg, (FILE *) arg);
+}
+
+/* SWAR constants: one in each byte, and high bit of each byte */
+#define ONES 0x0101010101010101ULL
+#define HIGHS (ONES*0x80)
+
+/* High bit of each byte b of x where lo < b < hi.  Bytes of x must be
+   below 0x80 */
+#define BYTES_BETWEEN(x, lo, hi) \
+    ((ONES*(127+(hi)) - ((x) & ONES*127)) & ~(x) & \
+     (((x) & ONES*127) + ONES*(127-(lo))) & HIGHS)
+
+/* Convert 8 hex digits at s into 4 bytes at dest, handling all
+   characters at once in a 64-bit word.  Return FALSE, leaving
+   dest unchanged, if they are not all hex digits */
+static bool_t hex8(const char *s, byte_t *dest)
+{
+    uword_t x, v;
+    int i;
+    memcpy(&x, s, 8);
+    x = LE64(x);
+    if (x & HIGHS)
+	return FALSE;
+    if ((BYTES_BETWEEN(x, '0'-1, '9'+1) |
+	 BYTES_BETWEEN(x | ONES*0x20, 'a'-1, 'f'+1)) != HIGHS)
+	return FALSE;
+    /* Letters have bit 6 set and low nibble one less than value-9 */
+    v = (x & ONES*0x0F) + 9 * ((x >> 6) & ONES);
+    /* Pair up nibbles, then squeeze out the empty bytes */
+    v = ((v << 4) | (v >> 8)) & 0x00FF00FF00FF00FFULL;
+    v = (v | (v >> 8)) & 0x0000FFFF0000FFFFULL;
+    v = (v | (v >> 16)) & 0xFFFFFFFFULL;
+    for (i = 0; i < 4; i++)
+	dest[i] = (byte_t) (v >> (8*i));
+    return TRUE;
+}
+
+/* Get contents of file from its current position.  Maps it into
+   memory when possible.  Sets *lenp and *mappedp.  Return NULL if
+   cannot be read */
+static char *read_file(FILE *infile, size_t *lenp, bool_t *mappedp)
+{
+    struct stat st;
+    long start = ftell(infile);
+    char *buf = NULL;
+    size_t len = 0, size = 0, cnt;
+    int fd = fileno(infile);
+    if (start >= 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) &&
+	st.st_size > start) {
+	/* Offset of mapping must be page aligned */
+	long skip = start % sysconf(_SC_PAGESIZE);
+	char *map = mmap(NULL, st.st_size - start + skip, PROT_READ,
+			 MAP_PRIVATE, fd, start - skip);
+	if (map != MAP_FAILED) {
+	    *lenp = st.st_size - start;
+	    *mappedp = TRUE;
+	    return map + skip;
+	}
+    }
+    /* Fall back on reading a pipe or terminal */
+    *mappedp = FALSE;
+    do {
+	if (len == size) {
+	    size = size ? 2*size : LINELEN;
+	    buf = (char *) realloc(buf, size);
+	}
+	cnt = fread(buf + len, 1, size - len, infile);
+	len += cnt;
+    } while (cnt > 0);
+    *lenp = len;
+    return buf;
+}
+
+static void release_file(char *buf, size_t len, bool_t mapped)
+{
+    if (mapped) {
+	long skip = (uword_t) buf % sysconf(_SC_PAGESIZE);
+	munmap(buf - skip, len + skip);
+    } else
+	free((void *) buf);
+}
+
+/* Get n-byte little-endian value from object file */
+static word_t get_obj_int(unsigned char *s, int n)
+{
+    uword_t val = 0;
+    int i;
+    for (i = 0; i < n; i++)
+	val |= (uword_t) s[i] << (8*i);
+    return val;
+}
+
+/* Load memory from object file contents buf */
+static int load_obj(mem_t m, char *buf, size_t len,
+		    error_fn_t error, void *error_arg)
+{
+    unsigned char *ubuf = (unsigned char *) buf;
+    word_t nseg, i;
+    size_t pos = OBJ_HDR_LEN;
+    int byte_cnt = 0;
+    if (len < OBJ_HDR_LEN || ubuf[4] != OBJ_VERSION) {
+	report(error, error_arg, "Error reading file. Bad object header\n");
+	return 0;
+    }
+    nseg = get_obj_int(ubuf+5, 4);
+    for (i = 0; i < nseg; i++) {
+	word_t addr, cnt;
+	if (len - pos < 12) {
+	    report(error, error_arg, "Error reading file. Truncated segment\n");
+	    return 0;
+	}
+	addr = get_obj_int(ubuf+pos, 8);
+	cnt = get_obj_int(ubuf+pos+8, 4);
+	pos += 12;
+	if (len - pos < cnt) {
+	    report(error, error_arg, "Error reading file. Truncated segment\n");
+	    return 0;
+	}
+	if (!set_bytes(m, addr, ubuf+pos, cnt)) {
+	    report(error, error_arg,
+		   "Error reading file. Invalid address. 0x%llx\n",
+		   addr < 0 || addr >= m->len ? addr : m->len);
+	    return 0;
+	}
+	pos += cnt;
+	byte_cnt += cnt;
+    }
+    return byte_cnt;
+}
+
+static int load_mem_cb(mem_t m, FILE *infile,
+		       error_fn_t error, void *error_arg)
 {
-    /* Read contents of .yo file */
+    /* Contents of .yo file */
+    size_t len;
+    bool_t mapped;
+    char *contents = read_file(infile, &len, &mapped);
+    size_t lpos = 0;
     char buf[LINELEN];
     char c, ch, cl;
     int byte_cnt = 0;
     int lineno = 0;
     word_t bytepos = 0;
+    /* Bytes of one line */
+    byte_t bytes[LINELEN/2];
 #ifdef HAS_GUI
     int empty_line = 1;
     int addr = 0;
@@ -208,8 +712,26 @@ int load_mem(mem_t m, FILE *infile, int report_error)
     char line[LINELEN];
     int index = 0;
 #endif /* HAS_GUI */   
-    while (fgets(buf, LINELEN, infile)) {
+    /* Old decodings are discarded wholesale */
+    flush_decoded(m);
+    if (!contents)
+	return 0;
+    if (len >= 4 && memcmp(contents, OBJ_MAGIC, 4) == 0) {
+	byte_cnt = load_obj(m, contents, len, error, error_arg);
+	release_file(contents, len, mapped);
+	return byte_cnt;
+    }
+    while (lpos < len) {
 	int cpos = 0;
+	int nbytes = 0;
+	/* Copy line, as fgets would */
+	char *nl = memchr(contents + lpos, '\n', len - lpos);
+	size_t llen = nl ? nl - (contents + lpos) + 1 : len - lpos;
+	if (llen > LINELEN - 1)
+	    llen = LINELEN - 1;
+	memcpy(buf, contents + lpos, llen);
+	buf[llen] = '\0';
+	lpos += llen;
 #ifdef HAS_GUI
 	empty_line = 1;
 #endif
@@ -234,12 +756,12 @@ int load_mem(mem_t m, FILE *infile, int report_error)
 	    cpos++;
 
 	if (buf[cpos++] != ':') {
-	    if (report_error) {
-		fprintf(stderr, "Error reading file. Expected colon\n");
-		fprintf(stderr, "Line %d:%s\n", lineno, buf);
-		fprintf(stderr,
-			"Reading '%c' at position %d\n", buf[cpos], cpos);
-	    }
+	    report(error, error_arg,
+		   "Error reading file. Expected colon\n"
+		   "Line %d:%s\n"
+		   "Reading '%c' at position %d\n",
+		   lineno, buf, buf[cpos], cpos);
+	    release_file(contents, len, mapped);
 	    return 0;
 	}
 
@@ -251,28 +773,40 @@ int load_mem(mem_t m, FILE *infile, int report_error)
 	while (isspace((int)buf[cpos]))
 	    cpos++;
 
-	/* Get code */
+	/* Get code, 4 bytes at a time while possible.  buf is
+	   NUL-terminated, so hex8 stops before reading past it */
+	while (cpos + 8 < LINELEN && hex8(buf + cpos, bytes + nbytes)) {
+#ifdef HAS_GUI
+	    if (index + 8 <= 20) {
+		memcpy(hexcode + index, buf + cpos, 8);
+		index += 8;
+	    }
+	    empty_line = 0;
+#endif
+	    cpos += 8;
+	    nbytes += 4;
+	}
 	while (isxdigit((int)(ch=buf[cpos++])) && 
 	       isxdigit((int)(cl=buf[cpos++]))) {
-	    byte_t byte = 0;
-	    if (bytepos >= m->len) {
-		if (report_error) {
-		    fprintf(stderr,
-			    "Error reading file. Invalid address. 0x%llx\n",
-			    bytepos);
-		    fprintf(stderr, "Line %d:%s\n", lineno, buf);
-		}
-		return 0;
-	    }
-	    byte = hex2dig(ch)*16+hex2dig(cl);
-	    m->contents[bytepos++] = byte;
-	    byte_cnt++;
+	    bytes[nbytes++] = hex2dig(ch)*16+hex2dig(cl);
 #ifdef HAS_GUI
 	    empty_line = 0;
-	    hexcode[index++] = ch;
-	    hexcode[index++] = cl;
+	    if (index < 20) {
+		hexcode[index++] = ch;
+		hexcode[index++] = cl;
+	    }
 #endif
 	}
+	if (!set_bytes(m, bytepos, bytes, nbytes)) {
+	    report(error, error_arg,
+		   "Error reading file. Invalid address. 0x%llx\n"
+		   "Line %d:%s\n",
+		   bytepos < 0 || bytepos >= m->len ? bytepos : m->len,
+		   lineno, buf);
+	    release_file(contents, len, mapped);
+	    return 0;
+	}
+	byte_cnt += nbytes;
 #ifdef HAS_GUI
 	/* Fill rest of hexcode with blanks.
 	   Needs to be 2x longest instruction */
@@ -296,55 +830,155 @@ int load_mem(mem_t m, FILE *infile, int report_error)
 	}
 #endif /* HAS_GUI */ 
     }
+    release_file(contents, len, mapped);
     return byte_cnt;
 }
 
+int load_mem(mem_t m, FILE *infile, int report_error)
+{
+    return load_mem_cb(m, infile, report_error ? error_to_file : NULL,
+		       stderr);
+}
+
 bool_t get_byte_val(mem_t m, word_t pos, byte_t *dest)
 {
-    if (pos < 0 || pos >= m->len)
+    if (!IN_BOUNDS(m, pos, 1))
 	return FALSE;
-    *dest = m->contents[pos];
+    *dest = *read_addr(m, pos);
     return TRUE;
 }
 
+/* Does the word at pos lie within a single page? */
+#define IN_PAGE(pos) (PAGE_OFF(pos) <= PAGE_SIZE-8)
+
+/* memcpy compiles to a single load or store of any alignment */
 bool_t get_word_val(mem_t m, word_t pos, word_t *dest)
 {
-    int i;
-    word_t val;
-    if (pos < 0 || pos + 8 > m->len)
+    uword_t val;
+    if (!IN_BOUNDS(m, pos, 8))
 	return FALSE;
-    val = 0;
-    for (i = 0; i < 8; i++) {
-	word_t b =  m->contents[pos+i] & 0xFF;
-	val = val | (b <<(8*i));
+    if (IN_PAGE(pos)) {
+	memcpy(&val, read_addr(m, pos), 8);
+	val = LE64(val);
+    } else {
+	int i;
+	val = 0;
+	for (i = 0; i < 8; i++)
+	    val |= (uword_t) *read_addr(m, pos+i) << (8*i);
     }
     *dest = val;
     return TRUE;
 }
 
+int get_words(mem_t m, word_t pos, word_t *dest, int cnt)
+{
+    int i;
+    if (pos < 0)
+	return 0;
+    if (pos + 8*(word_t) cnt > m->len)
+	cnt = pos < m->len ? (m->len - pos) / 8 : 0;
+    for (i = 0; i < cnt; i++)
+	get_word_val(m, pos+8*i, &dest[i]);
+    return cnt;
+}
+
+/* Discard decodings of any instruction overlapping the cnt bytes
+   starting at pos */
+static void invalidate_decoded(mem_t m, word_t pos, int cnt)
+{
+    word_t lo = pos-MAX_INSTR_LEN+1;
+    word_t hi = pos+cnt-1;
+    word_t b, a;
+    if (lo < 0)
+	lo = 0;
+    if (hi >= m->len)
+	hi = m->len-1;
+    for (b = lo/DBLOCK; b <= hi/DBLOCK; b++) {
+	word_t end = (b+1)*DBLOCK-1;
+	dpage_ptr dp = m->dpages[PAGE_NUM(b*DBLOCK)];
+	if (!dp || !dp->blocks[PAGE_OFF(b*DBLOCK)/DBLOCK])
+	    continue;
+	if (end > hi)
+	    end = hi;
+	for (a = (b*DBLOCK > lo ? b*DBLOCK : lo); a <= end; a++) {
+	    decode_ptr d = &dp->d[PAGE_OFF(a)];
+	    if (d->valid && a + d->len > pos) {
+		d->valid = FALSE;
+		/* Code of some translated block has changed */
+		if (d->translated)
+		    m->bgen++;
+	    }
+	}
+    }
+}
+
 bool_t set_byte_val(mem_t m, word_t pos, byte_t val)
 {
-    if (pos < 0 || pos >= m->len)
+    if (!IN_BOUNDS(m, pos, 1))
 	return FALSE;
-    m->contents[pos] = val;
+    if (m->hook)
+	m->hook(m->hook_arg, m, pos, 1, val);
+    *write_addr(m, pos, 1) = val;
+    if (m->dpages)
+	invalidate_decoded(m, pos, 1);
     return TRUE;
 }
 
 bool_t set_word_val(mem_t m, word_t pos, word_t val)
 {
-    int i;
-    if (pos < 0 || pos + 8 > m->len)
+    uword_t le = LE64((uword_t) val);
+    if (!IN_BOUNDS(m, pos, 8))
 	return FALSE;
-    for (i = 0; i < 8; i++) {
-	m->contents[pos+i] = (byte_t) val & 0xFF;
-	val >>= 8;
+    if (m->hook)
+	m->hook(m->hook_arg, m, pos, 8, val);
+    if (m->dpages)
+	invalidate_decoded(m, pos, 8);
+    if (IN_PAGE(pos)) {
+	memcpy(write_addr(m, pos, 8), &le, 8);
+    } else {
+	int i;
+	for (i = 0; i < 8; i++)
+	    *write_addr(m, pos+i, 1) = (byte_t) (val >> (8*i));
     }
     return TRUE;
 }
 
+bool_t set_bytes(mem_t m, word_t pos, byte_t *src, int cnt)
+{
+    if (cnt == 0)
+	return TRUE;
+    if (!IN_BOUNDS(m, pos, cnt) || cnt > m->len)
+	return FALSE;
+    if (m->hook) {
+	int i;
+	for (i = 0; i < cnt; i++)
+	    m->hook(m->hook_arg, m, pos+i, 1, src[i]);
+    }
+    if (m->dpages)
+	invalidate_decoded(m, pos, cnt);
+    while (cnt > 0) {
+	/* Copy up to end of page */
+	int n = PAGE_SIZE - PAGE_OFF(pos);
+	if (n > cnt)
+	    n = cnt;
+	memcpy(write_addr(m, pos, n), src, n);
+	pos += n;
+	src += n;
+	cnt -= n;
+    }
+    return TRUE;
+}
+
+void set_write_hook(mem_t m, write_hook_t hook, void *arg)
+{
+    m->hook = hook;
+    m->hook_arg = arg;
+}
+
 void dump_memory(FILE *outfile, mem_t m, word_t pos, int len)
 {
-    int i, j;
+    word_t i;
+    int j;
     while (pos % BPL) {
 	pos --;
 	len ++;
@@ -356,12 +990,134 @@ void dump_memory(FILE *outfile, mem_t m, word_t pos, int len)
 	len = m->len-pos;
 
     for (i = 0; i < len; i+=BPL) {
-	word_t val = 0;
+	word_t vals[BPL/8];
+	int cnt = get_words(m, pos+i, vals, BPL/8);
 	fprintf(outfile, "0x%.4llx:", pos+i);
-	for (j = 0; j < BPL; j+= 8) {
-	    get_word_val(m, pos+i+j, &val);
-	    fprintf(outfile, " %.16llx", val);
-	}
+	for (j = 0; j < BPL/8; j++)
+	    fprintf(outfile, " %.16llx", j < cnt ? vals[j] : 0);
+    }
+}
+
+/* Does instruction have a register specifier byte? */
+static bool_t need_regids(itype_t icode)
+{
+    return (icode == I_RRMOVQ || icode == I_ALU || icode == I_PUSHQ ||
+	    icode == I_POPQ || icode == I_IRMOVQ || icode == I_RMMOVQ ||
+	    icode == I_MRMOVQ || icode == I_IADDQ);
+}
+
+/* Does instruction have a constant word? */
+static bool_t need_imm(itype_t icode)
+{
+    return (icode == I_IRMOVQ || icode == I_RMMOVQ || icode == I_MRMOVQ ||
+	    icode == I_JMP || icode == I_CALL || icode == I_IADDQ);
+}
+
+/* Choose run_state handler.  Any encoding for which step_state could
+   report an error is given to the slow handler */
+static byte_t pick_handler(decode_ptr d)
+{
+    bool_t fast;
+    switch (d->icode) {
+    case I_NOP:
+    case I_HALT:
+    case I_RET:
+	fast = TRUE;
+	break;
+    case I_RRMOVQ:
+	fast = d->ok1 && reg_valid(d->ra) && reg_valid(d->rb);
+	break;
+    case I_ALU:
+	fast = d->ok1 && reg_valid(d->ra) && reg_valid(d->rb) &&
+	    d->ifun < A_NONE;
+	break;
+    case I_IRMOVQ:
+    case I_IADDQ:
+	fast = d->ok1 && d->okc && reg_valid(d->rb);
+	break;
+    case I_RMMOVQ:
+    case I_MRMOVQ:
+	fast = d->ok1 && d->okc && reg_valid(d->ra);
+	break;
+    case I_JMP:
+    case I_CALL:
+	fast = d->okc;
+	break;
+    case I_PUSHQ:
+    case I_POPQ:
+	fast = d->ok1 && reg_valid(d->ra);
+	break;
+    default:
+	fast = FALSE;
+	break;
+    }
+    return fast ? d->icode : H_SLOW;
+}
+
+/* Decode instruction at valid address pos into d */
+static void decode_instr(mem_t m, word_t pos, decode_ptr d)
+{
+    byte_t byte1 = 0;
+    word_t valc = 0;
+    word_t valp = pos+1;
+
+    d->instr = *read_addr(m, pos);
+    d->icode = HI4(d->instr);
+    d->ifun = LO4(d->instr);
+    d->ra = REG_NONE;
+    d->rb = REG_NONE;
+    d->ok1 = TRUE;
+    d->okc = TRUE;
+    if (need_regids(d->icode)) {
+	d->ok1 = get_byte_val(m, valp, &byte1);
+	valp++;
+	d->ra = HI4(byte1);
+	d->rb = LO4(byte1);
+    }
+    if (need_imm(d->icode)) {
+	d->okc = get_word_val(m, valp, &valc);
+	valp += 8;
+    }
+    d->valc = valc;
+    d->valp = valp;
+    d->len = valp - pos;
+    d->handler = pick_handler(d);
+    d->translated = FALSE;
+    d->valid = TRUE;
+}
+
+decode_ptr get_decoded(mem_t m, word_t pos)
+{
+    dpage_ptr dp;
+    decode_ptr d;
+    if (!IN_BOUNDS(m, pos, 1))
+	return NULL;
+    if (!m->dpages)
+	m->dpages = (dpage_ptr *) calloc(PAGE_NUM(m->len-1) + 1,
+					 sizeof(dpage_ptr));
+    dp = m->dpages[PAGE_NUM(pos)];
+    if (!dp) {
+	dp = (dpage_ptr) calloc(1, sizeof(dpage_rec));
+	m->dpages[PAGE_NUM(pos)] = dp;
+    }
+    d = &dp->d[PAGE_OFF(pos)];
+    if (!d->valid) {
+	decode_instr(m, pos, d);
+	dp->blocks[PAGE_OFF(pos)/DBLOCK] = TRUE;
+    }
+    return d;
+}
+
+void flush_decoded(mem_t m)
+{
+    /* Translated blocks are also stale */
+    m->bgen++;
+    if (m->dpages) {
+	word_t i;
+	for (i = 0; i <= PAGE_NUM(m->len-1); i++)
+	    free((void *) m->dpages[i]);
+	free((void *) m->dpages);
+	m->dpages = NULL;
     }
 }
 
@@ -383,21 +1139,18 @@ mem_t copy_reg(mem_t oldr)
 bool_t diff_reg(mem_t oldr, mem_t newr, FILE *outfile)
 {
     word_t pos;
-    int len = oldr->len;
     bool_t diff = FALSE;
-    if (newr->len < len)
-	len = newr->len;
-    for (pos = 0; (!diff || outfile) && pos < len; pos += 8) {
+    for (pos = next_diff(oldr, newr, 0); pos >= 0;
+	 pos = next_diff(oldr, newr, pos+8)) {
         word_t ov = 0;
         word_t nv = 0;
+	diff = TRUE;
+	if (!outfile)
+	    break;
 	get_word_val(oldr, pos, &ov);
 	get_word_val(newr, pos, &nv);
-	if (nv != ov) {
-	    diff = TRUE;
-	    if (outfile)
-		fprintf(outfile, "%s:\t0x%.16llx\t0x%.16llx\n",
-			reg_table[pos/8].name, ov, nv);
-	}
+	fprintf(outfile, "%s:\t0x%.16llx\t0x%.16llx\n",
+		reg_table[pos/8].name, ov, nv);
     }
     return diff;
 }
@@ -524,6 +1277,29 @@ char *cc_name(cc_t c)
 	return cc_names[c];
 }
 
+cc_t get_cc(lazy_cc_ptr l)
+{
+    if (l->pending) {
+	l->cc = compute_cc(l->op, l->argA, l->argB);
+	l->pending = FALSE;
+    }
+    return l->cc;
+}
+
+void set_cc(lazy_cc_ptr l, cc_t cc)
+{
+    l->cc = cc;
+    l->pending = FALSE;
+}
+
+void set_cc_op(lazy_cc_ptr l, alu_t op, word_t argA, word_t argB)
+{
+    l->op = op;
+    l->argA = argA;
+    l->argB = argB;
+    l->pending = TRUE;
+}
+
 /* Status types */
 
 char *stat_names[] = { "BUB", "AOK", "HLT", "ADR", "INS", "PIP" };
@@ -535,15 +1311,374 @@ char *stat_name(stat_t e)
     return stat_names[e];
 }
 
+/**************** Profiling ************************/
+
+typedef struct prof_page_rec {
+  word_t count[PAGE_SIZE];
+  word_t taken[PAGE_SIZE];
+} prof_page_rec, *prof_page_ptr;
+
+/* Number of most executed PCs printed by print_profile */
+#define HOTSPOTS 10
+
+static char *icode_names[16] =
+    {"halt", "nop", "rrmovq/cmovXX", "irmovq", "rmmovq", "mrmovq",
+     "OPq", "jXX", "call", "ret", "pushq", "popq", "iaddq",
+     "pop2", "invalid (0xE)", "invalid (0xF)"};
+
+profile_ptr new_profile(word_t len)
+{
+    profile_ptr p = (profile_ptr) calloc(1, sizeof(profile_rec));
+    p->len = len;
+    p->pages = (prof_page_ptr *) calloc(PAGE_NUM(len-1) + 1,
+					sizeof(prof_page_ptr));
+    return p;
+}
+
+void free_profile(profile_ptr p)
+{
+    word_t i;
+    for (i = 0; i <= PAGE_NUM(p->len-1); i++)
+	free((void *) p->pages[i]);
+    free((void *) p->pages);
+    free((void *) p);
+}
+
+/* Counts of page holding valid address pc, allocating if necessary */
+static inline prof_page_ptr prof_page(profile_ptr p, word_t pc)
+{
+    prof_page_ptr pg = p->pages[PAGE_NUM(pc)];
+    if (!pg) {
+	pg = (prof_page_ptr) calloc(1, sizeof(prof_page_rec));
+	p->pages[PAGE_NUM(pc)] = pg;
+    }
+    return pg;
+}
+
+static inline void count_instr(profile_ptr p, word_t pc, itype_t icode)
+{
+    prof_page(p, pc)->count[PAGE_OFF(pc)]++;
+    p->icodes[icode & 0xF]++;
+}
+
+static inline void count_taken(profile_ptr p, word_t pc)
+{
+    prof_page(p, pc)->taken[PAGE_OFF(pc)]++;
+}
+
+void profile_instr(profile_ptr p, word_t pc, itype_t icode)
+{
+    if (pc >= 0 && pc < p->len)
+	count_instr(p, pc, icode);
+}
+
+void profile_taken(profile_ptr p, word_t pc)
+{
+    if (pc >= 0 && pc < p->len)
+	count_taken(p, pc);
+}
+
+static word_t get_count(profile_ptr p, word_t pc, bool_t taken)
+{
+    prof_page_ptr pg;
+    if (pc < 0 || pc >= p->len || !(pg = p->pages[PAGE_NUM(pc)]))
+	return 0;
+    return taken ? pg->taken[PAGE_OFF(pc)] : pg->count[PAGE_OFF(pc)];
+}
+
+/* Print line of .yo file with counts of its instruction */
+static void print_listing_line(profile_ptr p, char *line, FILE *outfile)
+{
+    char *cp = line;
+    word_t addr = 0;
+    word_t count = 0;
+    int icode = -1;
+    while (isspace((int)*cp))
+	cp++;
+    if (cp[0] == '0' && (cp[1] == 'x' || cp[1] == 'X')) {
+	for (cp += 2; isxdigit((int)*cp); cp++)
+	    addr = addr*16 + hex2dig(*cp);
+	while (isspace((int)*cp))
+	    cp++;
+	if (*cp++ == ':') {
+	    while (isspace((int)*cp))
+		cp++;
+	    if (isxdigit((int)*cp)) {
+		icode = hex2dig(*cp);
+		count = get_count(p, addr, FALSE);
+	    }
+	}
+    }
+    if (count == 0)
+	fprintf(outfile, "%10s %17s  ", "", "");
+    else if (icode == I_JMP) {
+	word_t taken = get_count(p, addr, TRUE);
+	fprintf(outfile, "%10lld %8lld/%-8lld  ", count, taken, count - taken);
+    } else
+	fprintf(outfile, "%10lld %17s  ", count, "");
+    fputs(line, outfile);
+}
+
+/* Execution count of one PC */
+typedef struct {
+  word_t pc;
+  word_t count;
+} hot_rec, *hot_ptr;
+
+/* Sort by decreasing count, then increasing address */
+static int cmp_hot(const void *a, const void *b)
+{
+    hot_ptr ha = (hot_ptr) a;
+    hot_ptr hb = (hot_ptr) b;
+    if (ha->count != hb->count)
+	return ha->count > hb->count ? -1 : 1;
+    return ha->pc < hb->pc ? -1 : ha->pc > hb->pc;
+}
+
+void print_profile(profile_ptr p, FILE *infile, FILE *outfile)
+{
+    char line[LINELEN];
+    word_t total = 0;
+    word_t i, nhot = 0, maxhot = 0;
+    hot_ptr hot = NULL;
+    int c;
+
+    for (c = 0; c < 16; c++)
+	total += p->icodes[c];
+    if (infile && fgets(line, LINELEN, infile) &&
+	strncmp(line, OBJ_MAGIC, 4) != 0) {
+	fprintf(outfile, "%10s %17s  %s\n", "Count", "Taken/Not taken",
+		"Source");
+	do {
+	    print_listing_line(p, line, outfile);
+	    if (!strchr(line, '\n'))
+		fputc('\n', outfile);
+	} while (fgets(line, LINELEN, infile));
+	fprintf(outfile, "\n");
+    }
+
+    fprintf(outfile, "Instruction mix: %lld instructions\n", total);
+    for (c = 0; c < 16; c++)
+	if (p->icodes[c] > 0)
+	    fprintf(outfile, "  %-14s %10lld  %5.1f%%\n", icode_names[c],
+		    p->icodes[c], 100.0 * p->icodes[c] / total);
+    fprintf(outfile, "Memory: %lld reads, %lld writes\n",
+	    p->icodes[I_MRMOVQ] + p->icodes[I_POPQ] + p->icodes[I_RET],
+	    p->icodes[I_RMMOVQ] + p->icodes[I_PUSHQ] + p->icodes[I_CALL]);
+
+    for (i = 0; i < p->len; i++) {
+	word_t count;
+	if (!p->pages[PAGE_NUM(i)]) {
+	    i |= PAGE_SIZE-1;
+	    continue;
+	}
+	if ((count = get_count(p, i, FALSE)) == 0)
+	    continue;
+	if (nhot == maxhot) {
+	    maxhot = maxhot ? 2*maxhot : 64;
+	    hot = (hot_ptr) realloc(hot, maxhot * sizeof(hot_rec));
+	}
+	hot[nhot].pc = i;
+	hot[nhot++].count = count;
+    }
+    qsort(hot, nhot, sizeof(hot_rec), cmp_hot);
+    fprintf(outfile, "Hotspots:\n");
+    for (i = 0; i < nhot && i < HOTSPOTS; i++)
+	fprintf(outfile, "  0x%.3llx %10lld  %5.1f%%\n", hot[i].pc,
+		hot[i].count, 100.0 * hot[i].count / total);
+    free((void *) hot);
+}
+
+/**************** Breakpoints and watchpoints ************************/
+
+#define BMAP_WORDS (PAGE_SIZE/64)
+
+watch_ptr new_watch(word_t len)
+{
+    watch_ptr w = (watch_ptr) calloc(1, sizeof(watch_rec));
+    w->len = len;
+    w->bpages = (uword_t **) calloc(PAGE_NUM(len-1) + 1, sizeof(uword_t *));
+    return w;
+}
+
+void free_watch(watch_ptr w)
+{
+    word_t i;
+    for (i = 0; i <= PAGE_NUM(w->len-1); i++)
+	free((void *) w->bpages[i]);
+    free((void *) w->bpages);
+    free((void *) w->brks);
+    free((void *) w->ranges);
+    free((void *) w);
+}
+
+/* Parse condition of form %reg==val into b */
+static bool_t parse_cond(char *cond, brk_ptr b)
+{
+    char name[8];
+    char *cp = cond;
+    int n = 0;
+    char *end;
+    while (*cp && !strchr("=!<>", *cp) && n < 7)
+	name[n++] = *cp++;
+    name[n] = '\0';
+    b->reg = find_register(name);
+    if (b->reg == REG_ERR || b->reg == REG_NONE)
+	return FALSE;
+    if (cp[0] == '=' && cp[1] == '=') {
+	b->cmp = CMP_EQ;
+	cp += 2;
+    } else if (cp[0] == '!' && cp[1] == '=') {
+	b->cmp = CMP_NE;
+	cp += 2;
+    } else if (cp[0] == '<') {
+	b->cmp = CMP_LT;
+	cp++;
+    } else if (cp[0] == '>') {
+	b->cmp = CMP_GT;
+	cp++;
+    } else
+	return FALSE;
+    b->val = strtoll(cp, &end, 0);
+    return end != cp && *end == '\0';
+}
+
+bool_t add_break(watch_ptr w, word_t pc, char *cond)
+{
+    brk_rec b;
+    b.pc = pc;
+    b.has_cond = cond != NULL;
+    if (cond && !parse_cond(cond, &b))
+	return FALSE;
+    if (pc >= w->len || pc < -1)
+	return FALSE;
+    w->brks = (brk_ptr) realloc(w->brks, (w->nbrks+1) * sizeof(brk_rec));
+    w->brks[w->nbrks++] = b;
+    if (pc == -1) {
+	w->nany++;
+    } else {
+	uword_t *bp = w->bpages[PAGE_NUM(pc)];
+	if (!bp) {
+	    bp = (uword_t *) calloc(BMAP_WORDS, sizeof(uword_t));
+	    w->bpages[PAGE_NUM(pc)] = bp;
+	}
+	bp[PAGE_OFF(pc)/64] |= (uword_t) 1 << (PAGE_OFF(pc)%64);
+    }
+    return TRUE;
+}
+
+void add_watch(watch_ptr w, word_t lo, word_t hi, int access)
+{
+    w->ranges = (wrange_ptr)
+	realloc(w->ranges, (w->nranges+1) * sizeof(wrange_rec));
+    w->ranges[w->nranges].lo = lo;
+    w->ranges[w->nranges].hi = hi;
+    w->ranges[w->nranges++].access = access;
+    if (w->nranges == 1 || lo < w->lo)
+	w->lo = lo;
+    if (w->nranges == 1 || hi > w->hi)
+	w->hi = hi;
+}
+
+static char *cmp_names[] = {"==", "!=", "<", ">"};
+
+static bool_t cond_true(brk_ptr b, mem_t r)
+{
+    word_t val = get_reg_val(r, b->reg);
+    switch (b->cmp) {
+    case CMP_EQ:
+	return val == b->val;
+    case CMP_NE:
+	return val != b->val;
+    case CMP_LT:
+	return val < b->val;
+    default:
+	return val > b->val;
+    }
+}
+
+/* Check access to word at addr by instruction at pc */
+static inline void watch_access(watch_ptr w, word_t pc, word_t addr,
+				int access, word_t val)
+{
+    int i;
+    if (addr + 8 <= w->lo || addr >= w->hi || w->hit != WATCH_NONE)
+	return;
+    for (i = 0; i < w->nranges; i++) {
+	wrange_ptr r = &w->ranges[i];
+	if ((r->access & access) && addr + 8 > r->lo && addr < r->hi) {
+	    w->hit = access == ACC_READ ? WATCH_READ : WATCH_WRITE;
+	    w->hit_pc = pc;
+	    w->hit_addr = addr;
+	    w->hit_val = val;
+	    w->hit_index = i;
+	    return;
+	}
+    }
+}
+
+/* Check breakpoints before executing instruction at s->pc */
+static void watch_step(watch_ptr w, state_ptr s)
+{
+    word_t pc = s->pc;
+    uword_t *bp;
+    int i;
+    bool_t at_pc;
+    if (w->hit != WATCH_NONE)
+	return;
+    bp = pc >= 0 && pc < w->len ? w->bpages[PAGE_NUM(pc)] : NULL;
+    at_pc = bp && (bp[PAGE_OFF(pc)/64] >> (PAGE_OFF(pc)%64)) & 1;
+    if (!at_pc && w->nany == 0)
+	return;
+    for (i = 0; i < w->nbrks; i++) {
+	brk_ptr b = &w->brks[i];
+	if ((b->pc == pc || b->pc == -1) &&
+	    (!b->has_cond || cond_true(b, s->r))) {
+	    w->hit = b->pc == -1 ? WATCH_COND : WATCH_BREAK;
+	    w->hit_pc = pc;
+	    w->hit_index = i;
+	    return;
+	}
+    }
+}
+
+void print_hit(watch_ptr w, FILE *outfile)
+{
+    brk_ptr b = &w->brks[w->hit_index];
+    switch (w->hit) {
+    case WATCH_BREAK:
+	fprintf(outfile, "Breakpoint at PC = 0x%llx", w->hit_pc);
+	break;
+    case WATCH_COND:
+	fprintf(outfile, "Condition holds at PC = 0x%llx", w->hit_pc);
+	break;
+    case WATCH_READ:
+    case WATCH_WRITE:
+	fprintf(outfile, "Watchpoint: PC = 0x%llx %s 0x%llx %s 0x%llx\n",
+		w->hit_pc, w->hit == WATCH_READ ? "read" : "wrote",
+		w->hit_val, w->hit == WATCH_READ ? "from" : "to",
+		w->hit_addr);
+	return;
+    default:
+	return;
+    }
+    if (b->has_cond)
+	fprintf(outfile, ": %s%s0x%llx", reg_name(b->reg), cmp_names[b->cmp],
+		b->val);
+    fprintf(outfile, "\n");
+}
+
 /**************** Implementation of ISA model ************************/
 
-state_ptr new_state(int memlen)
+state_ptr new_state(word_t memlen)
 {
     state_ptr result = (state_ptr) malloc(sizeof(state_rec));
     result->pc = 0;
     result->r = init_reg();
     result->m = init_mem(memlen);
-    result->cc = DEFAULT_CC;
+    set_cc(&result->cc, DEFAULT_CC);
+    result->prof = NULL;
+    result->watch = NULL;
     return result;
 }
 
@@ -560,6 +1695,8 @@ state_ptr copy_state(state_ptr s) {
     result->r = copy_reg(s->r);
     result->m = copy_mem(s->m);
     result->cc = s->cc;
+    result->prof = NULL;
+    result->watch = NULL;
     return result;
 }
 
@@ -572,10 +1709,11 @@ bool_t diff_state(state_ptr olds, state_ptr news, FILE *outfile) {
 	    fprintf(outfile, "pc:\t0x%.16llx\t0x%.16llx\n", olds->pc, news->pc);
 	}
     }
-    if (olds->cc != news->cc) {
+    if (get_cc(&olds->cc) != get_cc(&news->cc)) {
 	diff = TRUE;
 	if (outfile) {
-	    fprintf(outfile, "cc:\t%s\t%s\n", cc_name(olds->cc), cc_name(news->cc));
+	    fprintf(outfile, "cc:\t%s\t%s\n",
+		    cc_name(get_cc(&olds->cc)), cc_name(get_cc(&news->cc)));
 	}
     }
     if (diff_reg(olds->r, news->r, outfile))
@@ -624,11 +1762,10 @@ bool_t cond_holds(cc_t cc, cond_t bcond) {
 
 
 /* Execute single instruction.  Return status. */
-stat_t step_state(state_ptr s, FILE *error_file)
+static stat_t step_state_cb(state_ptr s, error_fn_t error, void *error_arg)
 {
     word_t argA, argB;
     byte_t byte0 = 0;
-    byte_t byte1 = 0;
     itype_t hi0;
     alu_t  lo0;
     reg_id_t hi1 = REG_NONE;
@@ -637,41 +1774,27 @@ stat_t step_state(state_ptr s, FILE *error_file)
     word_t cval = 0;
     word_t okc = TRUE;
     word_t val, dval;
-    bool_t need_regids;
-    bool_t need_imm;
-    word_t ftpc = s->pc;  /* Fall-through PC */
-
-    if (!get_byte_val(s->m, ftpc, &byte0)) {
-	if (error_file)
-	    fprintf(error_file,
-		    "PC = 0x%llx, Invalid instruction address\n", s->pc);
-	return STAT_ADR;
-    }
-    ftpc++;
-
-    hi0 = HI4(byte0);
-    lo0 = LO4(byte0);
+    word_t ftpc;  /* Fall-through PC */
+    decode_ptr d = get_decoded(s->m, s->pc);
 
-    need_regids =
-	(hi0 == I_RRMOVQ || hi0 == I_ALU || hi0 == I_PUSHQ ||
-	 hi0 == I_POPQ || hi0 == I_IRMOVQ || hi0 == I_RMMOVQ ||
-	 hi0 == I_MRMOVQ || hi0 == I_IADDQ);
-
-    if (need_regids) {
-	ok1 = get_byte_val(s->m, ftpc, &byte1);
-	ftpc++;
-	hi1 = HI4(byte1);
-	lo1 = LO4(byte1);
+    if (!d) {
+	report(error, error_arg,
+	       "PC = 0x%llx, Invalid instruction address\n", s->pc);
+	return STAT_ADR;
     }
 
-    need_imm =
-	(hi0 == I_IRMOVQ || hi0 == I_RMMOVQ || hi0 == I_MRMOVQ ||
-	 hi0 == I_JMP || hi0 == I_CALL || hi0 == I_IADDQ);
+    byte0 = d->instr;
+    hi0 = d->icode;
+    lo0 = d->ifun;
+    hi1 = d->ra;
+    lo1 = d->rb;
+    ok1 = d->ok1;
+    okc = d->okc;
+    cval = d->valc;
+    ftpc = d->valp;
 
-    if (need_imm) {
-	okc = get_word_val(s->m, ftpc, &cval);
-	ftpc += 8;
-    }
+    if (s->prof)
+	count_instr(s->prof, s->pc, hi0);
 
     switch (hi0) {
     case I_NOP:
@@ -682,49 +1805,43 @@ stat_t step_state(state_ptr s, FILE *error_file)
 	break;
     case I_RRMOVQ:  /* Both unconditional and conditional moves */
 	if (!ok1) {
-	    if (error_file)
-		fprintf(error_file,
-			"PC = 0x%llx, Invalid instruction address\n", s->pc);
+	    report(error, error_arg,
+		   "PC = 0x%llx, Invalid instruction address\n", s->pc);
 	    return STAT_ADR;
 	}
 	if (!reg_valid(hi1)) {
-	    if (error_file)
-		fprintf(error_file,
-			"PC = 0x%llx, Invalid register ID 0x%.1x\n",
-			s->pc, hi1);
+	    report(error, error_arg,
+		   "PC = 0x%llx, Invalid register ID 0x%.1x\n",
+		   s->pc, hi1);
 	    return STAT_INS;
 	}
 	if (!reg_valid(lo1)) {
-	    if (error_file)
-		fprintf(error_file,
-			"PC = 0x%llx, Invalid register ID 0x%.1x\n",
-			s->pc, lo1);
+	    report(error, error_arg,
+		   "PC = 0x%llx, Invalid register ID 0x%.1x\n",
+		   s->pc, lo1);
 	    return STAT_INS;
 	}
 	val = get_reg_val(s->r, hi1);
-	if (cond_holds(s->cc, lo0))
+	if (cond_holds(get_cc(&s->cc), lo0))
 	  set_reg_val(s->r, lo1, val);
 	s->pc = ftpc;
 	break;
     case I_IRMOVQ:
 	if (!ok1) {
-	    if (error_file)
-		fprintf(error_file,
-			"PC = 0x%llx, Invalid instruction address\n", s->pc);
+	    report(error, error_arg,
+		   "PC = 0x%llx, Invalid instruction address\n", s->pc);
 	    return STAT_ADR;
 	}
 	if (!okc) {
-	    if (error_file)
-		fprintf(error_file,
-			"PC = 0x%llx, Invalid instruction address",
-			s->pc);
+	    report(error, error_arg,
+		   "PC = 0x%llx, Invalid instruction address",
+		   s->pc);
 	    return STAT_INS;
 	}
 	if (!reg_valid(lo1)) {
-	    if (error_file)
-		fprintf(error_file,
-			"PC = 0x%llx, Invalid register ID 0x%.1x\n",
-			s->pc, lo1);
+	    report(error, error_arg,
+		   "PC = 0x%llx, Invalid register ID 0x%.1x\n",
+		   s->pc, lo1);
 	    return STAT_INS;
 	}
 	set_reg_val(s->r, lo1, cval);
@@ -732,212 +1849,711 @@ stat_t step_state(state_ptr s, FILE *error_file)
 	break;
     case I_RMMOVQ:
 	if (!ok1) {
-	    if (error_file)
-		fprintf(error_file,
-			"PC = 0x%llx, Invalid instruction address\n", s->pc);
+	    report(error, error_arg,
+		   "PC = 0x%llx, Invalid instruction address\n", s->pc);
 	    return STAT_ADR;
 	}
 	if (!okc) {
-	    if (error_file)
-		fprintf(error_file,
-			"PC = 0x%llx, Invalid instruction address\n", s->pc);
+	    report(error, error_arg,
+		   "PC = 0x%llx, Invalid instruction address\n", s->pc);
 	    return STAT_INS;
 	}
 	if (!reg_valid(hi1)) {
-	    if (error_file)
-		fprintf(error_file,
-			"PC = 0x%llx, Invalid register ID 0x%.1x\n",
-			s->pc, hi1);
+	    report(error, error_arg,
+		   "PC = 0x%llx, Invalid register ID 0x%.1x\n",
+		   s->pc, hi1);
 	    return STAT_INS;
 	}
 	if (reg_valid(lo1)) 
 	    cval += get_reg_val(s->r, lo1);
 	val = get_reg_val(s->r, hi1);
 	if (!set_word_val(s->m, cval, val)) {
-	    if (error_file)
-		fprintf(error_file,
-			"PC = 0x%llx, Invalid data address 0x%llx\n",
-			s->pc, cval);
+	    report(error, error_arg,
+		   "PC = 0x%llx, Invalid data address 0x%llx\n",
+		   s->pc, cval);
 	    return STAT_ADR;
 	}
+	if (s->watch)
+	    watch_access(s->watch, s->pc, cval, ACC_WRITE, val);
 	s->pc = ftpc;
 	break;
     case I_MRMOVQ:
 	if (!ok1) {
-	    if (error_file)
-		fprintf(error_file,
-			"PC = 0x%llx, Invalid instruction address\n", s->pc);
+	    report(error, error_arg,
+		   "PC = 0x%llx, Invalid instruction address\n", s->pc);
 	    return STAT_ADR;
 	}
 	if (!okc) {
-	    if (error_file)
-		fprintf(error_file,
-			"PC = 0x%llx, Invalid instruction addres\n", s->pc);
+	    report(error, error_arg,
+		   "PC = 0x%llx, Invalid instruction addres\n", s->pc);
 	    return STAT_INS;
 	}
 	if (!reg_valid(hi1)) {
-	    if (error_file)
-		fprintf(error_file,
-			"PC = 0x%llx, Invalid register ID 0x%.1x\n",
-			s->pc, hi1);
+	    report(error, error_arg,
+		   "PC = 0x%llx, Invalid register ID 0x%.1x\n",
+		   s->pc, hi1);
 	    return STAT_INS;
 	}
 	if (reg_valid(lo1)) 
 	    cval += get_reg_val(s->r, lo1);
 	if (!get_word_val(s->m, cval, &val))
 	    return STAT_ADR;
+	if (s->watch)
+	    watch_access(s->watch, s->pc, cval, ACC_READ, val);
 	set_reg_val(s->r, hi1, val);
 	s->pc = ftpc;
 	break;
     case I_ALU:
 	if (!ok1) {
-	    if (error_file)
-		fprintf(error_file,
-			"PC = 0x%llx, Invalid instruction address\n", s->pc);
+	    report(error, error_arg,
+		   "PC = 0x%llx, Invalid instruction address\n", s->pc);
 	    return STAT_ADR;
 	}
 	argA = get_reg_val(s->r, hi1);
 	argB = get_reg_val(s->r, lo1);
 	val = compute_alu(lo0, argA, argB);
 	set_reg_val(s->r, lo1, val);
-	s->cc = compute_cc(lo0, argA, argB);
+	set_cc_op(&s->cc, lo0, argA, argB);
 	s->pc = ftpc;
 	break;
     case I_JMP:
 	if (!ok1) {
-	    if (error_file)
-		fprintf(error_file,
-			"PC = 0x%llx, Invalid instruction address\n", s->pc);
+	    report(error, error_arg,
+		   "PC = 0x%llx, Invalid instruction address\n", s->pc);
 	    return STAT_ADR;
 	}
 	if (!okc) {
-	    if (error_file)
-		fprintf(error_file,
-			"PC = 0x%llx, Invalid instruction address\n", s->pc);
+	    report(error, error_arg,
+		   "PC = 0x%llx, Invalid instruction address\n", s->pc);
 	    return STAT_ADR;
 	}
-	if (cond_holds(s->cc, lo0))
+	if (cond_holds(get_cc(&s->cc), lo0)) {
+	    if (s->prof)
+		count_taken(s->prof, s->pc);
 	    s->pc = cval;
-	else
+	} else
 	    s->pc = ftpc;
 	break;
     case I_CALL:
 	if (!ok1) {
-	    if (error_file)
-		fprintf(error_file,
-			"PC = 0x%llx, Invalid instruction address\n", s->pc);
+	    report(error, error_arg,
+		   "PC = 0x%llx, Invalid instruction address\n", s->pc);
 	    return STAT_ADR;
 	}
 	if (!okc) {
-	    if (error_file)
-		fprintf(error_file,
-			"PC = 0x%llx, Invalid instruction address\n", s->pc);
+	    report(error, error_arg,
+		   "PC = 0x%llx, Invalid instruction address\n", s->pc);
 	    return STAT_ADR;
 	}
 	val = get_reg_val(s->r, REG_RSP) - 8;
 	set_reg_val(s->r, REG_RSP, val);
 	if (!set_word_val(s->m, val, ftpc)) {
-	    if (error_file)
-		fprintf(error_file,
-			"PC = 0x%llx, Invalid stack address 0x%llx\n", s->pc, val);
+	    report(error, error_arg,
+		   "PC = 0x%llx, Invalid stack address 0x%llx\n", s->pc, val);
 	    return STAT_ADR;
 	}
+	if (s->watch)
+	    watch_access(s->watch, s->pc, val, ACC_WRITE, ftpc);
 	s->pc = cval;
 	break;
     case I_RET:
 	/* Return Instruction.  Pop address from stack */
 	dval = get_reg_val(s->r, REG_RSP);
 	if (!get_word_val(s->m, dval, &val)) {
-	    if (error_file)
-		fprintf(error_file,
-			"PC = 0x%llx, Invalid stack address 0x%llx\n",
-			s->pc, dval);
+	    report(error, error_arg,
+		   "PC = 0x%llx, Invalid stack address 0x%llx\n",
+		   s->pc, dval);
 	    return STAT_ADR;
 	}
+	if (s->watch)
+	    watch_access(s->watch, s->pc, dval, ACC_READ, val);
 	set_reg_val(s->r, REG_RSP, dval + 8);
 	s->pc = val;
 	break;
     case I_PUSHQ:
 	if (!ok1) {
-	    if (error_file)
-		fprintf(error_file,
-			"PC = 0x%llx, Invalid instruction address\n", s->pc);
+	    report(error, error_arg,
+		   "PC = 0x%llx, Invalid instruction address\n", s->pc);
 	    return STAT_ADR;
 	}
 	if (!reg_valid(hi1)) {
-	    if (error_file)
-		fprintf(error_file,
-			"PC = 0x%llx, Invalid register ID 0x%.1x\n", s->pc, hi1);
+	    report(error, error_arg,
+		   "PC = 0x%llx, Invalid register ID 0x%.1x\n", s->pc, hi1);
 	    return STAT_INS;
 	}
 	val = get_reg_val(s->r, hi1);
 	dval = get_reg_val(s->r, REG_RSP) - 8;
 	set_reg_val(s->r, REG_RSP, dval);
 	if  (!set_word_val(s->m, dval, val)) {
-	    if (error_file)
-		fprintf(error_file,
-			"PC = 0x%llx, Invalid stack address 0x%llx\n", s->pc, dval);
+	    report(error, error_arg,
+		   "PC = 0x%llx, Invalid stack address 0x%llx\n", s->pc, dval);
 	    return STAT_ADR;
 	}
+	if (s->watch)
+	    watch_access(s->watch, s->pc, dval, ACC_WRITE, val);
 	s->pc = ftpc;
 	break;
     case I_POPQ:
 	if (!ok1) {
-	    if (error_file)
-		fprintf(error_file,
-			"PC = 0x%llx, Invalid instruction address\n", s->pc);
+	    report(error, error_arg,
+		   "PC = 0x%llx, Invalid instruction address\n", s->pc);
 	    return STAT_ADR;
 	}
 	if (!reg_valid(hi1)) {
-	    if (error_file)
-		fprintf(error_file,
-			"PC = 0x%llx, Invalid register ID 0x%.1x\n", s->pc, hi1);
+	    report(error, error_arg,
+		   "PC = 0x%llx, Invalid register ID 0x%.1x\n", s->pc, hi1);
 	    return STAT_INS;
 	}
 	dval = get_reg_val(s->r, REG_RSP);
 	set_reg_val(s->r, REG_RSP, dval+8);
 	if (!get_word_val(s->m, dval, &val)) {
-	    if (error_file)
-		fprintf(error_file,
-			"PC = 0x%llx, Invalid stack address 0x%llx\n",
-			s->pc, dval);
+	    report(error, error_arg,
+		   "PC = 0x%llx, Invalid stack address 0x%llx\n",
+		   s->pc, dval);
 	    return STAT_ADR;
 	}
+	if (s->watch)
+	    watch_access(s->watch, s->pc, dval, ACC_READ, val);
 	set_reg_val(s->r, hi1, val);
 	s->pc = ftpc;
 	break;
     case I_IADDQ:
 	if (!ok1) {
-	    if (error_file)
-		fprintf(error_file,
-			"PC = 0x%llx, Invalid instruction address\n", s->pc);
+	    report(error, error_arg,
+		   "PC = 0x%llx, Invalid instruction address\n", s->pc);
 	    return STAT_ADR;
 	}
 	if (!okc) {
-	    if (error_file)
-		fprintf(error_file,
-			"PC = 0x%llx, Invalid instruction address",
-			s->pc);
+	    report(error, error_arg,
+		   "PC = 0x%llx, Invalid instruction address",
+		   s->pc);
 	    return STAT_INS;
 	}
 	if (!reg_valid(lo1)) {
-	    if (error_file)
-		fprintf(error_file,
-			"PC = 0x%llx, Invalid register ID 0x%.1x\n",
-			s->pc, lo1);
+	    report(error, error_arg,
+		   "PC = 0x%llx, Invalid register ID 0x%.1x\n",
+		   s->pc, lo1);
 	    return STAT_INS;
 	}
 	argB = get_reg_val(s->r, lo1);
 	val = argB + cval;
 	set_reg_val(s->r, lo1, val);
-	s->cc = compute_cc(A_ADD, cval, argB);
+	set_cc_op(&s->cc, A_ADD, cval, argB);
 	s->pc = ftpc;
 	break;
     default:
-	if (error_file)
-	    fprintf(error_file,
-		    "PC = 0x%llx, Invalid instruction %.2x\n", s->pc, byte0);
+	report(error, error_arg,
+	       "PC = 0x%llx, Invalid instruction %.2x\n", s->pc, byte0);
 	return STAT_INS;
     }
+    if (s->watch)
+	watch_step(s->watch, s);
     return STAT_AOK;
 }
+
+stat_t step_state(state_ptr s, FILE *error_file)
+{
+    return step_state_cb(s, error_file ? error_to_file : NULL, error_file);
+}
+
+
+/*
+ * run_state - Threaded version of the step_state loop.  Registers,
+ * condition codes, and PC are kept in locals, and each handler ends by
+ * dispatching directly to the handler of the next decoded instruction.
+ * Anything that could fail is passed to step_state, after making the
+ * state in s current, so errors are reported exactly as step_state does.
+ */
+static stat_t run_state_cb(state_ptr s, word_t max_steps, word_t *stepsp,
+			   error_fn_t error, void *error_arg)
+{
+#ifdef __GNUC__
+    static void * const handlers[H_SLOW+1] = {
+	[I_HALT] = &&h_halt,
+	[I_NOP] = &&h_nop,
+	[I_RRMOVQ] = &&h_rrmovq,
+	[I_IRMOVQ] = &&h_irmovq,
+	[I_RMMOVQ] = &&h_rmmovq,
+	[I_MRMOVQ] = &&h_mrmovq,
+	[I_ALU] = &&h_alu,
+	[I_JMP] = &&h_jmp,
+	[I_CALL] = &&h_call,
+	[I_RET] = &&h_ret,
+	[I_PUSHQ] = &&h_pushq,
+	[I_POPQ] = &&h_popq,
+	[I_IADDQ] = &&h_iaddq,
+	[I_POP2 ... H_SLOW] = &&h_slow
+    };
+#define DISPATCH(h) goto *handlers[h]
+#else
+#define DISPATCH(h) \
+    switch (h) { \
+    case I_HALT: goto h_halt; \
+    case I_NOP: goto h_nop; \
+    case I_RRMOVQ: goto h_rrmovq; \
+    case I_IRMOVQ: goto h_irmovq; \
+    case I_RMMOVQ: goto h_rmmovq; \
+    case I_MRMOVQ: goto h_mrmovq; \
+    case I_ALU: goto h_alu; \
+    case I_JMP: goto h_jmp; \
+    case I_CALL: goto h_call; \
+    case I_RET: goto h_ret; \
+    case I_PUSHQ: goto h_pushq; \
+    case I_POPQ: goto h_popq; \
+    case I_IADDQ: goto h_iaddq; \
+    default: goto h_slow; \
+    }
+#endif
+/* Fetch and dispatch next instruction */
+#define NEXT \
+    do { \
+	if (steps >= max_steps) \
+	    goto done; \
+	steps++; \
+	d = get_decoded(m, pc); \
+	if (!d) \
+	    goto h_slow; \
+	DISPATCH(d->handler); \
+    } while (0)
+
+    mem_t m = s->m;
+    word_t regs[REG_NONE+1];  /* regs[REG_NONE] stays 0 */
+    word_t pc = s->pc;
+    lazy_cc_rec cc = s->cc;
+    word_t steps = 0;
+    stat_t status = STAT_AOK;
+    decode_ptr d = NULL;
+    word_t valp, addr, val, argA, argB;
+    reg_id_t id;
+
+    for (id = REG_RAX; id < REG_NONE; id++)
+	regs[id] = get_reg_val(s->r, id);
+    regs[REG_NONE] = 0;
+
+    NEXT;
+
+ h_nop:
+    pc = d->valp;
+    NEXT;
+ h_halt:
+    status = STAT_HLT;
+    goto done;
+ h_rrmovq:
+    if (cond_holds(get_cc(&cc), d->ifun))
+	regs[d->rb] = regs[d->ra];
+    pc = d->valp;
+    NEXT;
+ h_irmovq:
+    regs[d->rb] = d->valc;
+    pc = d->valp;
+    NEXT;
+ h_rmmovq:
+    /* Store may invalidate d */
+    valp = d->valp;
+    if (!set_word_val(m, d->valc + regs[d->rb], regs[d->ra]))
+	goto h_slow;
+    pc = valp;
+    NEXT;
+ h_mrmovq:
+    if (!get_word_val(m, d->valc + regs[d->rb], &val))
+	goto h_slow;
+    regs[d->ra] = val;
+    pc = d->valp;
+    NEXT;
+ h_alu:
+    argA = regs[d->ra];
+    argB = regs[d->rb];
+    regs[d->rb] = compute_alu(d->ifun, argA, argB);
+    set_cc_op(&cc, d->ifun, argA, argB);
+    pc = d->valp;
+    NEXT;
+ h_jmp:
+    pc = cond_holds(get_cc(&cc), d->ifun) ? d->valc : d->valp;
+    NEXT;
+ h_call:
+    valp = d->valp;
+    val = d->valc;
+    addr = regs[REG_RSP] - 8;
+    if (!set_word_val(m, addr, valp))
+	goto h_slow;
+    regs[REG_RSP] = addr;
+    pc = val;
+    NEXT;
+ h_ret:
+    addr = regs[REG_RSP];
+    if (!get_word_val(m, addr, &val))
+	goto h_slow;
+    regs[REG_RSP] = addr + 8;
+    pc = val;
+    NEXT;
+ h_pushq:
+    valp = d->valp;
+    addr = regs[REG_RSP] - 8;
+    if (!set_word_val(m, addr, regs[d->ra]))
+	goto h_slow;
+    regs[REG_RSP] = addr;
+    pc = valp;
+    NEXT;
+ h_popq:
+    addr = regs[REG_RSP];
+    if (!get_word_val(m, addr, &val))
+	goto h_slow;
+    regs[REG_RSP] = addr + 8;
+    regs[d->ra] = val;
+    pc = d->valp;
+    NEXT;
+ h_iaddq:
+    argB = regs[d->rb];
+    regs[d->rb] = argB + d->valc;
+    set_cc_op(&cc, A_ADD, d->valc, argB);
+    pc = d->valp;
+    NEXT;
+ h_slow:
+    /* Nothing has been modified for this instruction yet */
+    for (id = REG_RAX; id < REG_NONE; id++)
+	if (regs[id] != get_reg_val(s->r, id))
+	    set_reg_val(s->r, id, regs[id]);
+    s->pc = pc;
+    s->cc = cc;
+    status = step_state_cb(s, error, error_arg);
+    for (id = REG_RAX; id < REG_NONE; id++)
+	regs[id] = get_reg_val(s->r, id);
+    pc = s->pc;
+    cc = s->cc;
+    if (status != STAT_AOK)
+	goto done;
+    NEXT;
+
+ done:
+    for (id = REG_RAX; id < REG_NONE; id++)
+	if (regs[id] != get_reg_val(s->r, id))
+	    set_reg_val(s->r, id, regs[id]);
+    s->pc = pc;
+    s->cc = cc;
+    if (stepsp)
+	*stepsp = steps;
+    return status;
+#undef NEXT
+#undef DISPATCH
+}
+
+stat_t run_state(state_ptr s, word_t max_steps, word_t *stepsp,
+		 FILE *error_file)
+{
+    return run_state_cb(s, max_steps, stepsp,
+			error_file ? error_to_file : NULL, error_file);
+}
+
+
+/**************** Basic block translation ************************/
+
+/* Micro-operation: one instruction with all checks done at translation */
+typedef struct {
+    byte_t handler;
+    byte_t ifun;
+    byte_t ra;
+    byte_t rb;
+    word_t valc;
+    word_t pc;
+    word_t valp;
+} uop_rec, *uop_ptr;
+
+/* Straight-line code ending with jXX, call, ret, or halt, or just
+   before an instruction that needs step_state */
+struct block_rec {
+    word_t pc;    /* Entry PC */
+    word_t gen;   /* Value of bgen when translated */
+    int n;        /* Number of uops.  0 if entry unused */
+    uop_ptr ops;
+};
+
+static void free_blocks(mem_t m)
+{
+    int i;
+    if (!m->bcache)
+	return;
+    for (i = 0; i < BCACHE_SIZE; i++)
+	free((void *) m->bcache[i].ops);
+    free((void *) m->bcache);
+    m->bcache = NULL;
+}
+
+/* Does instruction end a basic block? */
+static bool_t ends_block(byte_t handler)
+{
+    return handler == I_JMP || handler == I_CALL || handler == I_RET ||
+	handler == I_HALT;
+}
+
+/* Translate block starting at pc into b.  Return FALSE if the first
+   instruction must be executed by step_state */
+static bool_t translate_block(mem_t m, word_t pc, struct block_rec *b)
+{
+    uop_rec ops[BLOCK_MAX];
+    int n = 0;
+    decode_ptr d;
+
+    while (n < BLOCK_MAX && (d = get_decoded(m, pc)) != NULL &&
+	   d->handler != H_SLOW) {
+	ops[n].handler = d->handler;
+	ops[n].ifun = d->ifun;
+	ops[n].ra = d->ra;
+	ops[n].rb = d->rb;
+	ops[n].valc = d->valc;
+	ops[n].pc = pc;
+	ops[n].valp = d->valp;
+	d->translated = TRUE;
+	n++;
+	if (ends_block(d->handler))
+	    break;
+	pc = d->valp;
+    }
+    if (n == 0)
+	return FALSE;
+    free((void *) b->ops);
+    b->ops = (uop_ptr) malloc(n * sizeof(uop_rec));
+    memcpy(b->ops, ops, n * sizeof(uop_rec));
+    b->pc = ops[0].pc;
+    b->gen = m->bgen;
+    b->n = n;
+    return TRUE;
+}
+
+/* Get current translation of block at pc, or NULL if there is none */
+static struct block_rec *get_block(mem_t m, word_t pc)
+{
+    struct block_rec *b;
+    if (!m->bcache)
+	m->bcache = (struct block_rec *)
+	    calloc(BCACHE_SIZE, sizeof(struct block_rec));
+    b = &m->bcache[(uword_t) pc % BCACHE_SIZE];
+    if (b->n > 0 && b->pc == pc && b->gen == m->bgen)
+	return b;
+    return translate_block(m, pc, b) ? b : NULL;
+}
+
+/*
+ * run_blocks - Execute translated basic blocks.  Within a block no
+ * fetch, decode, validity, or step limit checks are made, and condition
+ * codes are kept as the operands of the last ALU operation until a
+ * conditional move or jump reads them.  Memory faults end the block and
+ * rerun the faulting instruction through step_state.
+ */
+static stat_t run_blocks_cb(state_ptr s, word_t max_steps, word_t *stepsp,
+			    error_fn_t error, void *error_arg)
+{
+    mem_t m = s->m;
+    word_t regs[REG_NONE+1];  /* regs[REG_NONE] stays 0 */
+    word_t pc = s->pc;
+    lazy_cc_rec cc = s->cc;
+    word_t steps = 0;
+    stat_t status = STAT_AOK;
+    word_t addr, val, argA, argB;
+    reg_id_t id;
+
+    for (id = REG_RAX; id < REG_NONE; id++)
+	regs[id] = get_reg_val(s->r, id);
+    regs[REG_NONE] = 0;
+
+    while (status == STAT_AOK && steps < max_steps) {
+	struct block_rec *b = get_block(m, pc);
+	uop_ptr op, end;
+	word_t gen = m->bgen;
+
+	if (!b || b->n > max_steps - steps)
+	    goto slow;
+	op = b->ops;
+	end = op + b->n;
+	for (; op < end; op++) {
+	    switch (op->handler) {
+	    case I_NOP:
+		break;
+	    case I_HALT:
+		steps += op - b->ops + 1;
+		pc = op->pc;
+		status = STAT_HLT;
+		goto next_block;
+	    case I_RRMOVQ:
+		if (op->ifun == C_YES || cond_holds(get_cc(&cc), op->ifun))
+		    regs[op->rb] = regs[op->ra];
+		break;
+	    case I_IRMOVQ:
+		regs[op->rb] = op->valc;
+		break;
+	    case I_RMMOVQ:
+		if (!set_word_val(m, op->valc + regs[op->rb], regs[op->ra]))
+		    goto fault;
+		if (m->bgen != gen) {
+		    /* Rest of this block may have changed */
+		    steps += op - b->ops + 1;
+		    pc = op->valp;
+		    goto next_block;
+		}
+		break;
+	    case I_MRMOVQ:
+		if (!get_word_val(m, op->valc + regs[op->rb], &val))
+		    goto fault;
+		regs[op->ra] = val;
+		break;
+	    case I_ALU:
+		argA = regs[op->ra];
+		argB = regs[op->rb];
+		regs[op->rb] = compute_alu(op->ifun, argA, argB);
+		set_cc_op(&cc, op->ifun, argA, argB);
+		break;
+	    case I_JMP:
+		steps += b->n;
+		if (op->ifun == C_YES || cond_holds(get_cc(&cc), op->ifun))
+		    pc = op->valc;
+		else
+		    pc = op->valp;
+		goto next_block;
+	    case I_CALL:
+		addr = regs[REG_RSP] - 8;
+		if (!set_word_val(m, addr, op->valp))
+		    goto fault;
+		regs[REG_RSP] = addr;
+		steps += b->n;
+		pc = op->valc;
+		goto next_block;
+	    case I_RET:
+		addr = regs[REG_RSP];
+		if (!get_word_val(m, addr, &val))
+		    goto fault;
+		regs[REG_RSP] = addr + 8;
+		steps += b->n;
+		pc = val;
+		goto next_block;
+	    case I_PUSHQ:
+		addr = regs[REG_RSP] - 8;
+		if (!set_word_val(m, addr, regs[op->ra]))
+		    goto fault;
+		regs[REG_RSP] = addr;
+		if (m->bgen != gen) {
+		    steps += op - b->ops + 1;
+		    pc = op->valp;
+		    goto next_block;
+		}
+		break;
+	    case I_POPQ:
+		addr = regs[REG_RSP];
+		if (!get_word_val(m, addr, &val))
+		    goto fault;
+		regs[REG_RSP] = addr + 8;
+		regs[op->ra] = val;
+		break;
+	    case I_IADDQ:
+		argB = regs[op->rb];
+		regs[op->rb] = argB + op->valc;
+		set_cc_op(&cc, A_ADD, op->valc, argB);
+		break;
+	    }
+	}
+	/* Fell off end of block without a control transfer */
+	steps += b->n;
+	pc = end[-1].valp;
+	continue;
+
+    fault:
+	/* Nothing has been modified for the faulting instruction */
+	steps += op - b->ops;
+	pc = op->pc;
+    slow:
+	for (id = REG_RAX; id < REG_NONE; id++)
+	    if (regs[id] != get_reg_val(s->r, id))
+		set_reg_val(s->r, id, regs[id]);
+	s->pc = pc;
+	s->cc = cc;
+	status = step_state_cb(s, error, error_arg);
+	steps++;
+	for (id = REG_RAX; id < REG_NONE; id++)
+	    regs[id] = get_reg_val(s->r, id);
+	pc = s->pc;
+	cc = s->cc;
+    next_block:
+	;
+    }
+
+    for (id = REG_RAX; id < REG_NONE; id++)
+	if (regs[id] != get_reg_val(s->r, id))
+	    set_reg_val(s->r, id, regs[id]);
+    s->pc = pc;
+    s->cc = cc;
+    if (stepsp)
+	*stepsp = steps;
+    return status;
+}
+
+stat_t run_blocks(state_ptr s, word_t max_steps, word_t *stepsp,
+		  FILE *error_file)
+{
+    return run_blocks_cb(s, max_steps, stepsp,
+			 error_file ? error_to_file : NULL, error_file);
+}
+
+/**************** Machine interface ************************/
+
+machine_ptr new_machine(word_t memlen, error_fn_t error, void *error_arg)
+{
+    machine_ptr mach = (machine_ptr) malloc(sizeof(machine_rec));
+    mach->s = new_state(memlen);
+    mach->engine = ENGINE_BLOCKS;
+    mach->error = error;
+    mach->error_arg = error_arg;
+    return mach;
+}
+
+void free_machine(machine_ptr mach)
+{
+    free_state(mach->s);
+    free((void *) mach);
+}
+
+void reset_machine(machine_ptr mach)
+{
+    state_ptr s = mach->s;
+    clear_mem(s->m);
+    clear_mem(s->r);
+    s->pc = 0;
+    set_cc(&s->cc, DEFAULT_CC);
+}
+
+int load_machine(machine_ptr mach, FILE *infile)
+{
+    reset_machine(mach);
+    return load_mem_cb(mach->s->m, infile, mach->error, mach->error_arg);
+}
+
+stat_t step_machine(machine_ptr mach)
+{
+    return step_state_cb(mach->s, mach->error, mach->error_arg);
+}
+
+stat_t run_machine(machine_ptr mach, word_t max_steps, word_t *stepsp)
+{
+    word_t steps = 0;
+    stat_t e = STAT_AOK;
+    /* Only step_state keeps a profile and checks watchpoints */
+    engine_t engine = mach->s->prof || mach->s->watch ?
+	ENGINE_STEP : mach->engine;
+    if (mach->s->watch)
+	mach->s->watch->hit = WATCH_NONE;
+    switch (engine) {
+    case ENGINE_THREADED:
+	return run_state_cb(mach->s, max_steps, stepsp,
+			    mach->error, mach->error_arg);
+    case ENGINE_BLOCKS:
+	return run_blocks_cb(mach->s, max_steps, stepsp,
+			     mach->error, mach->error_arg);
+    default:
+	while (steps < max_steps && e == STAT_AOK) {
+	    e = step_machine(mach);
+	    steps++;
+	    if (mach->s->watch && mach->s->watch->hit != WATCH_NONE)
+		break;
+	}
+	if (stepsp)
+	    *stepsp = steps;
+	return e;
+    }
+}
@@ -88,52 +88,159 @@ typedef unsigned char byte_t;
 typedef long long int word_t;
 typedef long long unsigned uword_t;
 
-/* Represent a memory as an array of bytes */
+/* Predecoded form of the instruction starting at some address */
 typedef struct {
-  int len;
+  byte_t valid;  /* Does entry hold a decoded instruction? */
+  byte_t instr;  /* Instruction byte (icode:ifun) */
+  byte_t icode;
+  byte_t ifun;
+  byte_t ra;     /* REG_NONE if instruction has no register byte */
+  byte_t rb;
+  byte_t ok1;    /* Register byte was in bounds */
+  byte_t okc;    /* Constant word was in bounds */
+  byte_t len;    /* Number of instruction bytes */
+  byte_t handler; /* Which run_state handler executes it */
+  byte_t translated; /* Part of a run_blocks translation? */
+  word_t valc;
+  word_t valp;   /* Address of following instruction */
+} decode_rec, *decode_ptr;
+
+/* Decode cache tracks code in blocks of this many bytes */
+#define DBLOCK 64
+
+/* Memory is allocated in pages of PAGE_SIZE bytes, found through
+   a two-level table: each second-level table maps PTAB_SIZE pages */
+#define PAGE_BITS 12
+#define PAGE_SIZE (1<<PAGE_BITS)
+#define PTAB_BITS 9
+#define PTAB_SIZE (1<<PTAB_BITS)
+
+/* Page, page table, and page of decode entries (private to isa.c) */
+struct page_rec;
+struct ptab_rec;
+struct dpage_rec;
+
+/* Translated basic block (private to isa.c) */
+struct block_rec;
+
+struct mem_rec;
+
+/* Function called just before each write of len bytes (1 or 8) of val
+   at pos, with the argument given when it was installed.  Lets
+   tools observe writes without changing the simulators */
+typedef void (*write_hook_t)(void *arg, struct mem_rec *m,
+			     word_t pos, int len, word_t val);
+
+/* Represent a memory as a sparse array of bytes.  Pages are
+   allocated when first written; untouched pages read as 0 */
+typedef struct mem_rec {
+  word_t len;
   word_t maxaddr;
-  byte_t *contents;
+  /* First-level page table, with ndir entries.  NULL entries map
+     no pages */
+  struct ptab_rec **dir;
+  word_t ndir;
+  /* Number of pages allocated, including those shared */
+  word_t npages;
+  /* Predecoded instructions, one dpage per page of memory.  Allocated
+     on first fetch, so data-only memories (e.g., register files)
+     have none */
+  struct dpage_rec **dpages;
+  /* Basic blocks translated by run_blocks, indexed by entry PC.
+     Entries from before the latest change to translated code
+     have generation number less than bgen */
+  struct block_rec *bcache;
+  word_t bgen;
+  /* Write hook, or NULL.  Not inherited by copies */
+  write_hook_t hook;
+  void *hook_arg;
 } mem_rec, *mem_t;
 
 /* Create a memory with len bytes */
-mem_t init_mem(int len);
+mem_t init_mem(word_t len);
 void free_mem(mem_t m);
 
-/* Set contents of memory to 0 */
+/* Set contents of memory to 0, releasing its pages */
 void clear_mem(mem_t m);
 
-/* Make a copy of a memory */
+/* Make a copy of a memory.  Copying is lazy, so that this takes time
+   proportional to the size of the first-level page table, and
+   diff_mem between the two visits only pages written since */
 mem_t copy_mem(mem_t oldm);
+/* Make contents of m those of src, sharing pages as does copy_mem.
+   m keeps its length and write hook */
+void restore_mem(mem_t m, mem_t src);
+/* Make a copy of a memory sharing nothing with it, so that the two
+   can be used by different threads.  Takes time proportional to the
+   number of pages */
+mem_t clone_mem(mem_t oldm);
 /* Print the differences between two memories */
 bool_t diff_mem(mem_t oldm, mem_t newm, FILE *outfile);
 
-/* How big should the memory be? */
+/* Find first 8-byte word at or after pos where the memories differ.
+   pos should be a multiple of 8.  Return -1 if there is none */
+word_t next_diff(mem_t oldm, mem_t newm, word_t pos);
+
+/* How big should the memory be?  Can be set with -DMEM_SIZE=... */
+#ifndef MEM_SIZE
 #ifdef BIG_MEM
 #define MEM_SIZE (1<<16)
 #else
 #define MEM_SIZE (1<<13)
 #endif
+#endif
 
 /*** In the following functions, a return value of 1 means success ***/
 
-/* Load memory from .yo file.  Return number of bytes read */
+/* Called with the text of each error message, ending in newline */
+typedef void (*error_fn_t)(void *arg, char *msg);
+
+/* Error function that writes messages to FILE * arg */
+void error_to_file(void *arg, char *msg);
+
+/* Load memory from .yo file, or from object file in the format below.
+   Return number of bytes read.  Errors are reported on stderr */
 int load_mem(mem_t m, FILE *infile, int report_error);
 
+/* Object file: OBJ_MAGIC, version byte, segment count (4 bytes), then
+   for each segment its address (8), byte count (4), and bytes.
+   Integers are little-endian */
+#define OBJ_MAGIC "Y86O"
+#define OBJ_VERSION 1
+#define OBJ_HDR_LEN 9
+
 /* Get byte from memory */
 bool_t get_byte_val(mem_t m, word_t pos, byte_t *dest);
 
 /* Get 8 bytes from memory */
 bool_t get_word_val(mem_t m, word_t pos, word_t *dest);
 
+/* Get up to cnt consecutive words starting at pos.
+   Return number of words within memory */
+int get_words(mem_t m, word_t pos, word_t *dest, int cnt);
+
 /* Set byte in memory */
 bool_t set_byte_val(mem_t m, word_t pos, byte_t val);
 
 /* Set 8 bytes in memory */
 bool_t set_word_val(mem_t m, word_t pos, word_t val);
 
+/* Set cnt bytes in memory, copying from src */
+bool_t set_bytes(mem_t m, word_t pos, byte_t *src, int cnt);
+
+/* Install write hook (NULL to remove) */
+void set_write_hook(mem_t m, write_hook_t hook, void *arg);
+
 /* Print contents of memory */
 void dump_memory(FILE *outfile, mem_t m, word_t pos, int cnt);
 
+/* Get decoded instruction at pos, using cached decoding when possible.
+   Return NULL if pos is not a valid address */
+decode_ptr get_decoded(mem_t m, word_t pos);
+
+/* Discard all cached decodings */
+void flush_decoded(mem_t m);
+
 /********** Implementation of Register File *************/
 
 mem_t init_reg();
@@ -172,6 +279,25 @@ cc_t compute_cc(alu_t op, word_t arg1, word_t arg2);
 /* Generated printed form of condition code */
 char *cc_name(cc_t c);
 
+/* Condition codes whose computation is put off until they are read.
+   Holds either computed codes, or the ALU operation that set them */
+typedef struct {
+  cc_t cc;       /* Condition codes, when not pending */
+  bool_t pending;
+  alu_t op;
+  word_t argA;
+  word_t argB;
+} lazy_cc_rec, *lazy_cc_ptr;
+
+/* Get condition codes, computing them if necessary */
+cc_t get_cc(lazy_cc_ptr l);
+
+/* Set condition codes to known value */
+void set_cc(lazy_cc_ptr l, cc_t cc);
+
+/* Record ALU operation as the source of the condition codes */
+void set_cc_op(lazy_cc_ptr l, alu_t op, word_t argA, word_t argB);
+
 /* **************** Status types *******************/
 
 typedef enum 
@@ -180,16 +306,115 @@ typedef enum
 /* Describe Status */
 char *stat_name(stat_t e);
 
+/* **************** Profiling *******************/
+
+/* Execution counts of a program.  Counts for each PC are kept in
+   pages allocated when first executed */
+typedef struct {
+  word_t len;
+  struct prof_page_rec **pages;
+  /* Executions by instruction code */
+  word_t icodes[16];
+} profile_rec, *profile_ptr;
+
+/* Create profile of memory with len bytes */
+profile_ptr new_profile(word_t len);
+void free_profile(profile_ptr p);
+
+/* Count execution of instruction with code icode at pc */
+void profile_instr(profile_ptr p, word_t pc, itype_t icode);
+
+/* Count jump at pc as taken */
+void profile_taken(profile_ptr p, word_t pc);
+
+/* Print listing of .yo file infile, each line with the execution count
+   of its instruction, and for jumps, the taken and not-taken counts.
+   Then print instruction mix, memory reads and writes, and the most
+   executed PCs.  Listing is omitted if infile is NULL or an object
+   file */
+void print_profile(profile_ptr p, FILE *infile, FILE *outfile);
+
+/* **************** Breakpoints and watchpoints *******/
+
+/* Memory accesses watched */
+#define ACC_READ  1
+#define ACC_WRITE 2
+
+/* Why step_state asked to stop */
+typedef enum { WATCH_NONE, WATCH_BREAK, WATCH_READ, WATCH_WRITE,
+	       WATCH_COND } watch_hit_t;
+
+/* Comparison of a register value */
+typedef enum { CMP_EQ, CMP_NE, CMP_LT, CMP_GT } cmp_t;
+
+/* Breakpoint at pc (or -1 for any PC) with optional condition */
+typedef struct {
+  word_t pc;
+  bool_t has_cond;
+  reg_id_t reg;
+  cmp_t cmp;
+  word_t val;
+} brk_rec, *brk_ptr;
+
+/* Watched accesses to addresses [lo, hi) */
+typedef struct {
+  word_t lo;
+  word_t hi;
+  int access;
+} wrange_rec, *wrange_ptr;
+
+typedef struct {
+  word_t len;
+  /* Bitmap of breakpoint PCs, per page, allocated when armed */
+  uword_t **bpages;
+  brk_ptr brks;
+  int nbrks;
+  /* Number of breakpoints with pc -1, checked after every step */
+  int nany;
+  wrange_ptr ranges;
+  int nranges;
+  /* Bounds of all ranges, for quick rejection */
+  word_t lo;
+  word_t hi;
+  /* First reason to stop since cleared, and where */
+  watch_hit_t hit;
+  word_t hit_pc;
+  word_t hit_addr;
+  word_t hit_val;
+  int hit_index;
+} watch_rec, *watch_ptr;
+
+/* Create set of breakpoints and watchpoints for memory of len bytes */
+watch_ptr new_watch(word_t len);
+void free_watch(watch_ptr w);
+
+/* Stop before executing instruction at pc, reached by a step, if cond
+   holds.  cond is NULL, or has form %reg==val (also !=, <, >), and is
+   checked before every instruction if pc is -1.  Return FALSE if
+   cond is malformed */
+bool_t add_break(watch_ptr w, word_t pc, char *cond);
+
+/* Stop after an access of type access (ACC_READ | ACC_WRITE)
+   to an 8-byte word overlapping [lo, hi) */
+void add_watch(watch_ptr w, word_t lo, word_t hi, int access);
+
+/* Describe why execution stopped */
+void print_hit(watch_ptr w, FILE *outfile);
+
 /* **************** ISA level implementation *********/
 
 typedef struct {
   word_t pc;
   mem_t r;
   mem_t m;
-  cc_t cc;
+  lazy_cc_rec cc;
+  /* Profile updated by step_state, or NULL */
+  profile_ptr prof;
+  /* Breakpoints and watchpoints checked by step_state, or NULL */
+  watch_ptr watch;
 } state_rec, *state_ptr;
 
-state_ptr new_state(int memlen);
+state_ptr new_state(word_t memlen);
 void free_state(state_ptr s);
 
 state_ptr copy_state(state_ptr s);
@@ -198,9 +423,60 @@ bool_t diff_state(state_ptr olds, state_ptr news, FILE *outfile);
 /* Determine if condition satisified */
 bool_t cond_holds(cc_t cc, cond_t bcond);
 
-/* Execute single instruction.  Return status. */
+/* Execute single instruction.  Return status.  If s->watch is set,
+   and a breakpoint or watchpoint is hit, s->watch->hit tells why */
 stat_t step_state(state_ptr s, FILE *error_file);
 
+/* Execute instructions until one returns a status other than STAT_AOK
+   or max_steps have executed.  Final state matches repeated calls to
+   step_state.  Return status of final instruction.
+   if stepsp nonnull, then will be set to number of steps executed.
+   Registers are held locally, so s->r sees register writes (and
+   its write hook is called) only when the run ends.  s->prof and
+   s->watch are ignored */
+stat_t run_state(state_ptr s, word_t max_steps, word_t *stepsp,
+		 FILE *error_file);
+
+/* Same as run_state, but executes whole basic blocks translated into
+   micro-operations, evaluating condition codes only when read */
+stat_t run_blocks(state_ptr s, word_t max_steps, word_t *stepsp,
+		  FILE *error_file);
+
+/**************** Machine interface *********************/
+
+/* A complete Y86-64 machine.  Machines share no mutable state, so
+   separate machines can run at once in different threads, and
+   report errors through their own callback rather than a file */
+
+typedef enum { ENGINE_STEP, ENGINE_THREADED, ENGINE_BLOCKS } engine_t;
+
+typedef struct {
+  state_ptr s;
+  /* How run_machine executes: step_state, run_state, or run_blocks */
+  engine_t engine;
+  /* Error callback and its argument.  Errors are discarded if NULL */
+  error_fn_t error;
+  void *error_arg;
+} machine_rec, *machine_ptr;
+
+/* Create machine with memlen bytes of memory, using ENGINE_BLOCKS */
+machine_ptr new_machine(word_t memlen, error_fn_t error, void *error_arg);
+void free_machine(machine_ptr mach);
+
+/* Clear memory and registers, and set PC and CC to initial values */
+void reset_machine(machine_ptr mach);
+
+/* Reset machine, then load code.  Return number of bytes read */
+int load_machine(machine_ptr mach, FILE *infile);
+
+/* Execute single instruction.  Return status */
+stat_t step_machine(machine_ptr mach);
+
+/* Execute up to max_steps instructions, as does run_state.
+   Uses step_state regardless of engine when profiling or watching.
+   Also stops when a breakpoint or watchpoint is hit */
+stat_t run_machine(machine_ptr mach, word_t max_steps, word_t *stepsp);
+
 /************************ Interface Functions *************/
 
 #ifdef HAS_GUI
@@ -0,0 +1,71 @@
+/* Check that copies of memory made by copy_mem and clone_mem compare
+   the same way under diff_mem */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "isa.h"
+
+/* MEMTEST never runs in GUI mode */
+int gui_mode = 0;
+
+static int checks = 0;
+static int failures = 0;
+
+/* Do memories a and b differ as expected? */
+static void check_diff(char *what, mem_t a, mem_t b, bool_t expect)
+{
+    bool_t diff = diff_mem(a, b, NULL);
+    checks++;
+    if (diff != expect) {
+	printf("%s: diff_mem reports %s, expected %s\n", what,
+	       diff ? "differences" : "none", expect ? "differences" : "none");
+	failures++;
+    }
+}
+
+/* Compare a copy c of m, made by name, with m and with empty memory */
+static void check_copy(char *name, mem_t m, mem_t c, mem_t empty)
+{
+    char what[80];
+    sprintf(what, "empty vs %s", name);
+    check_diff(what, empty, c, TRUE);
+    sprintf(what, "%s vs empty", name);
+    check_diff(what, c, empty, TRUE);
+    sprintf(what, "original vs %s", name);
+    check_diff(what, m, c, FALSE);
+    /* Writing the same value leaves the copy equal */
+    set_word_val(c, 0x108, 0x1234);
+    sprintf(what, "original vs %s rewritten", name);
+    check_diff(what, m, c, FALSE);
+    set_word_val(c, 0x208, 1);
+    sprintf(what, "original vs %s written", name);
+    check_diff(what, m, c, TRUE);
+    sprintf(what, "%s written vs original", name);
+    check_diff(what, c, m, TRUE);
+}
+
+int main(int argc, char *argv[])
+{
+    mem_t m = init_mem(MEM_SIZE);
+    mem_t empty = init_mem(MEM_SIZE);
+    mem_t c;
+
+    set_word_val(m, 0x108, 0x1234);
+    check_diff("empty vs original", empty, m, TRUE);
+
+    c = copy_mem(m);
+    check_copy("copy_mem", m, c, empty);
+    free_mem(c);
+    c = clone_mem(m);
+    check_copy("clone_mem", m, c, empty);
+    free_mem(c);
+
+    free_mem(m);
+    free_mem(empty);
+    if (failures == 0)
+	printf("  All %d memory checks succeed\n", checks);
+    else
+	printf("  %d/%d memory checks failed\n", failures, checks);
+    return failures != 0;
+}
@@ -0,0 +1,248 @@
+/* Binary execution traces for Y86-64 Instruction Set Simulator */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "isa.h"
+#include "trace.h"
+
+/* Most bytes in one TR_IMAGE record */
+#define IMAGE_MAX 4096
+
+static void flush_buf(trace_ptr t)
+{
+    fwrite(t->buf, 1, t->cnt, t->out);
+    t->cnt = 0;
+}
+
+static void put_bytes(trace_ptr t, byte_t *bytes, int len)
+{
+    while (len > 0) {
+	int cnt = TRACE_BUF - t->cnt;
+	if (cnt == 0) {
+	    flush_buf(t);
+	    continue;
+	}
+	if (cnt > len)
+	    cnt = len;
+	memcpy(t->buf + t->cnt, bytes, cnt);
+	t->cnt += cnt;
+	bytes += cnt;
+	len -= cnt;
+    }
+}
+
+static void put_byte(trace_ptr t, byte_t b)
+{
+    if (t->cnt == TRACE_BUF)
+	flush_buf(t);
+    t->buf[t->cnt++] = b;
+}
+
+/* Put low n bytes of val, least significant first */
+static void put_int(trace_ptr t, word_t val, int n)
+{
+    byte_t bytes[8];
+    int i;
+    for (i = 0; i < n; i++)
+	bytes[i] = (byte_t) ((uword_t) val >> (8*i));
+    put_bytes(t, bytes, n);
+}
+
+static void reg_hook(void *arg, mem_t m, word_t pos, int len, word_t val)
+{
+    trace_ptr t = (trace_ptr) arg;
+    put_byte(t, TR_REG);
+    put_byte(t, pos/8);
+    put_int(t, val, 8);
+}
+
+static void mem_hook(void *arg, mem_t m, word_t pos, int len, word_t val)
+{
+    trace_ptr t = (trace_ptr) arg;
+    put_byte(t, TR_MEM);
+    put_int(t, pos, 8);
+    put_byte(t, len);
+    put_int(t, val, len);
+}
+
+/* Record bytes [pos, pos+len) of memory m */
+static void put_image(trace_ptr t, mem_t m, word_t pos, word_t len)
+{
+    byte_t bytes[IMAGE_MAX];
+    while (len > 0) {
+	int i, cnt = len > IMAGE_MAX ? IMAGE_MAX : len;
+	for (i = 0; i < cnt; i++)
+	    get_byte_val(m, pos+i, &bytes[i]);
+	put_byte(t, TR_IMAGE);
+	put_int(t, pos, 8);
+	put_int(t, cnt, 4);
+	put_bytes(t, bytes, cnt);
+	pos += cnt;
+	len -= cnt;
+    }
+}
+
+trace_ptr open_trace(FILE *out, state_ptr s)
+{
+    trace_ptr t = (trace_ptr) malloc(sizeof(trace_rec));
+    mem_t empty = init_mem(s->m->len);
+    word_t start, pos;
+    t->out = out;
+    t->buf = (byte_t *) malloc(TRACE_BUF);
+    t->cnt = 0;
+    t->ncode = 0;
+    put_bytes(t, (byte_t *) TRACE_MAGIC, 4);
+    put_byte(t, TRACE_VERSION);
+    put_int(t, s->m->len, 8);
+
+    /* Record runs of nonzero words */
+    start = next_diff(empty, s->m, 0);
+    while (start >= 0) {
+	word_t end = start + 8;
+	while ((pos = next_diff(empty, s->m, end)) == end)
+	    end += 8;
+	put_image(t, s->m, start, end - start);
+	start = pos;
+    }
+    free_mem(empty);
+
+    set_write_hook(s->r, reg_hook, t);
+    set_write_hook(s->m, mem_hook, t);
+    return t;
+}
+
+void trace_begin(trace_ptr t, state_ptr s)
+{
+    decode_ptr d = get_decoded(s->m, s->pc);
+    int n = d ? d->len : 0;
+    t->pc = s->pc;
+    for (t->ncode = 0; t->ncode < n; t->ncode++)
+	if (!get_byte_val(s->m, s->pc + t->ncode, &t->code[t->ncode]))
+	    break;
+}
+
+void trace_end(trace_ptr t, state_ptr s, stat_t e, char *msg, int len)
+{
+    if (len > 0) {
+	put_byte(t, TR_MSG);
+	put_int(t, len, 4);
+	put_bytes(t, (byte_t *) msg, len);
+    }
+    put_byte(t, TR_STEP);
+    put_int(t, t->pc, 8);
+    put_byte(t, t->ncode);
+    put_bytes(t, t->code, t->ncode);
+    put_int(t, s->pc, 8);
+    put_byte(t, e);
+    put_byte(t, get_cc(&s->cc));
+}
+
+void close_trace(trace_ptr t, state_ptr s, word_t steps, stat_t e)
+{
+    put_byte(t, TR_END);
+    put_int(t, steps, 8);
+    put_int(t, s->pc, 8);
+    put_byte(t, e);
+    put_byte(t, get_cc(&s->cc));
+    flush_buf(t);
+    fflush(t->out);
+    set_write_hook(s->r, NULL, NULL);
+    set_write_hook(s->m, NULL, NULL);
+    free((void *) t->buf);
+    free((void *) t);
+}
+
+/* Get n-byte little-endian value.  Return FALSE at end of file */
+static bool_t get_int(FILE *in, word_t *valp, int n)
+{
+    uword_t val = 0;
+    int i;
+    for (i = 0; i < n; i++) {
+	int c = getc(in);
+	if (c == EOF)
+	    return FALSE;
+	val |= (uword_t) c << (8*i);
+    }
+    *valp = val;
+    return TRUE;
+}
+
+/* Get count bytes into *bufp, growing it as needed */
+static bool_t get_bytes(FILE *in, word_t count, byte_t **bufp,
+			int *buflenp)
+{
+    if (count > *buflenp) {
+	*buflenp = count;
+	*bufp = (byte_t *) realloc(*bufp, count);
+    }
+    return fread(*bufp, 1, count, in) == count;
+}
+
+word_t read_trace_header(FILE *in)
+{
+    char magic[4];
+    word_t version, len;
+    if (fread(magic, 1, 4, in) != 4 || memcmp(magic, TRACE_MAGIC, 4) != 0)
+	return -1;
+    if (!get_int(in, &version, 1) || version != TRACE_VERSION)
+	return -1;
+    if (!get_int(in, &len, 8))
+	return -1;
+    return len;
+}
+
+bool_t read_trace_entry(FILE *in, trace_entry_ptr e, byte_t **bufp,
+			int *buflenp)
+{
+    word_t tag, v1, v2;
+    if (!get_int(in, &tag, 1))
+	return FALSE;
+    e->tag = tag;
+    switch (tag) {
+    case TR_IMAGE:
+	if (!get_int(in, &e->addr, 8) || !get_int(in, &v1, 4) ||
+	    !get_bytes(in, v1, bufp, buflenp))
+	    return FALSE;
+	e->len = v1;
+	e->bytes = *bufp;
+	return TRUE;
+    case TR_REG:
+	e->len = 8;
+	return get_int(in, &e->addr, 1) && get_int(in, &e->val, 8);
+    case TR_MEM:
+	if (!get_int(in, &e->addr, 8) || !get_int(in, &v1, 1) ||
+	    (v1 != 1 && v1 != 8))
+	    return FALSE;
+	e->len = v1;
+	return get_int(in, &e->val, v1);
+    case TR_MSG:
+	if (!get_int(in, &v1, 4) || !get_bytes(in, v1, bufp, buflenp))
+	    return FALSE;
+	e->len = v1;
+	e->bytes = *bufp;
+	return TRUE;
+    case TR_STEP:
+	if (!get_int(in, &e->addr, 8) || !get_int(in, &v1, 1) ||
+	    !get_bytes(in, v1, bufp, buflenp))
+	    return FALSE;
+	e->len = v1;
+	e->bytes = *bufp;
+	if (!get_int(in, &e->val, 8) || !get_int(in, &v1, 1) ||
+	    !get_int(in, &v2, 1))
+	    return FALSE;
+	e->stat = v1;
+	e->cc = v2;
+	return TRUE;
+    case TR_END:
+	if (!get_int(in, &e->steps, 8) || !get_int(in, &e->val, 8) ||
+	    !get_int(in, &v1, 1) || !get_int(in, &v2, 1))
+	    return FALSE;
+	e->stat = v1;
+	e->cc = v2;
+	return TRUE;
+    default:
+	return FALSE;
+    }
+}
@@ -0,0 +1,72 @@
+/* Binary execution traces for Y86-64 Instruction Set Simulator */
+
+/* A trace is a header followed by a stream of tagged records.  All
+   multi-byte fields are little-endian.
+
+   Header:   "Y86T", version byte, memory length (8 bytes)
+   TR_IMAGE: address (8), count (4), count bytes of initial memory
+   TR_REG:   register ID (1), new value (8)
+   TR_MEM:   address (8), length (1), new value (8)
+   TR_MSG:   count (4), count bytes of error message text
+   TR_STEP:  PC (8), encoding length (1), encoding bytes,
+             new PC (8), status (1), condition codes (1)
+   TR_END:   steps (8), PC (8), status (1), condition codes (1)
+
+   The TR_REG, TR_MEM, and TR_MSG records for an instruction
+   precede its TR_STEP record. */
+
+#define TRACE_MAGIC "Y86T"
+#define TRACE_VERSION 1
+
+typedef enum { TR_IMAGE = 'I', TR_REG = 'R', TR_MEM = 'M',
+	       TR_MSG = 'E', TR_STEP = 'S', TR_END = 'X' } trace_tag_t;
+
+/* Trace output buffer is flushed when this full */
+#define TRACE_BUF (1<<20)
+
+typedef struct {
+  FILE *out;
+  byte_t *buf;
+  int cnt;
+  /* Instruction being executed */
+  word_t pc;
+  byte_t code[10];
+  int ncode;
+} trace_rec, *trace_ptr;
+
+/* Begin tracing execution from state s to out.  Records the initial
+   memory, and installs write hooks on registers and memory */
+trace_ptr open_trace(FILE *out, state_ptr s);
+
+/* Record the instruction about to be executed */
+void trace_begin(trace_ptr t, state_ptr s);
+
+/* Record the completion of the instruction with status e.  Text of
+   any error message is given by msg and len */
+void trace_end(trace_ptr t, state_ptr s, stat_t e, char *msg, int len);
+
+/* Record final state, remove hooks, and flush trace */
+void close_trace(trace_ptr t, state_ptr s, word_t steps, stat_t e);
+
+/* Reading a trace */
+
+/* Check header.  Return memory length, or -1 if not a trace */
+word_t read_trace_header(FILE *in);
+
+/* Contents of one record.  bytes points into buffer owned by caller */
+typedef struct {
+  trace_tag_t tag;
+  word_t addr;     /* Image, memory address; register ID; step PC */
+  word_t val;      /* New value; step new PC */
+  int len;         /* Length of bytes, or of memory write */
+  byte_t *bytes;   /* Image, message, or instruction bytes */
+  stat_t stat;
+  cc_t cc;
+  word_t steps;
+} trace_entry_rec, *trace_entry_ptr;
+
+/* Read next record into e, using buf (of size *buflenp, grown as
+   needed with realloc) for its bytes.  Return FALSE at end of file
+   or on a malformed record */
+bool_t read_trace_entry(FILE *in, trace_entry_ptr e, byte_t **bufp,
+			int *buflenp);
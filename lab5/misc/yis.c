@@ -2,74 +2,467 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
 
 #include "isa.h"
+#include "trace.h"
+#include "history.h"
 
 /* YIS never runs in GUI mode */
 int gui_mode = 0;
 
 void usage(char *pname)
 {
-    printf("Usage: %s code_file [max_steps]\n", pname);
+    printf("Usage: %s [-fbrp] [-m bytes] [-t trace_file] [-a addr[:cond]] [-c cond]\n"
+	   "           [-w addr[,len]] [-W addr[,len]] code_file [max_steps]\n",
+	   pname);
+    printf("   -f     Use threaded engine and report final state only\n");
+    printf("   -b     Use basic block engine and report final state only\n");
+    printf("   -m n   Set memory size to n bytes (default %d)\n", MEM_SIZE);
+    printf("   -t f   Write binary trace to file f instead of text (see yisdump)\n");
+    printf("   -r     Debug with reverse execution, reading commands from stdin\n");
+    printf("   -p     Profile, printing execution counts with code listing\n");
+    printf("   -a a   Stop before instruction at address a, if condition holds\n");
+    printf("   -c c   Stop before any instruction when condition holds\n");
+    printf("          Conditions have form %%reg==val (also !=, <, >)\n");
+    printf("   -w a   Stop after write to len bytes (default 8) at address a\n");
+    printf("   -W a   Stop after read or write to len bytes at address a\n");
+    printf("       %s [-m bytes] [-j threads] -B manifest\n", pname);
+    printf("   -B f   Run each 'code_file [max_steps]' line of f and summarize\n");
+    printf("   -j n   Run batch with n threads (default one per processor)\n");
     exit(0);
 }
 
+/**************** Batch mode ****************/
+
+/* Longest line of manifest */
+#define MAXLINE 1024
+
+/* Result line for a program is at most this long */
+#define RESULT_LEN (MAXLINE + 128)
+
+/* One program of the manifest */
+typedef struct {
+  char *name;
+  int max_steps;
+  char result[RESULT_LEN];
+} job_rec, *job_ptr;
+
+static job_ptr jobs = NULL;
+static int njobs = 0;
+/* Next job to be claimed by a worker */
+static int next_job = 0;
+static pthread_mutex_t job_lock = PTHREAD_MUTEX_INITIALIZER;
+static word_t batch_memlen;
+
+/* Hash words where memories differ, using 64-bit FNV-1a */
+static uword_t hash_diff(mem_t oldm, mem_t newm)
+{
+    uword_t h = 0xcbf29ce484222325ULL;
+    word_t pos, vals[3];
+    int i, j;
+    for (pos = next_diff(oldm, newm, 0); pos >= 0;
+	 pos = next_diff(oldm, newm, pos+8)) {
+	vals[0] = pos;
+	get_word_val(oldm, pos, &vals[1]);
+	get_word_val(newm, pos, &vals[2]);
+	for (i = 0; i < 3; i++)
+	    for (j = 0; j < 8; j++) {
+		h ^= (vals[i] >> (8*j)) & 0xFF;
+		h *= 0x100000001b3ULL;
+	    }
+    }
+    return h;
+}
+
+/* Run program of job j using machine mach, which is reused */
+static void run_job(job_ptr j, machine_ptr mach, mem_t zero_reg)
+{
+    FILE *code_file = fopen(j->name, "r");
+    state_ptr s = mach->s;
+    mem_t savem;
+    word_t steps = 0;
+    stat_t e;
+    if (!code_file) {
+	snprintf(j->result, RESULT_LEN, "%s: Can't open code file", j->name);
+	return;
+    }
+    if (!load_machine(mach, code_file)) {
+	fclose(code_file);
+	snprintf(j->result, RESULT_LEN, "%s: Can't load code file", j->name);
+	return;
+    }
+    fclose(code_file);
+    savem = copy_mem(s->m);
+    e = run_machine(mach, j->max_steps, &steps);
+    snprintf(j->result, RESULT_LEN,
+	     "%s: Status '%s', %lld steps, PC = 0x%llx, CC %s, "
+	     "regs %.16llx, mem %.16llx",
+	     j->name, stat_name(e), steps, s->pc, cc_name(get_cc(&s->cc)),
+	     hash_diff(zero_reg, s->r), hash_diff(savem, s->m));
+    free_mem(savem);
+}
+
+/* Worker thread.  Claims jobs until none are left */
+static void *batch_worker(void *arg)
+{
+    /* Errors are reported through the status only */
+    machine_ptr mach = new_machine(batch_memlen, NULL, NULL);
+    mem_t zero_reg = init_reg();
+    while (1) {
+	int j;
+	pthread_mutex_lock(&job_lock);
+	j = next_job++;
+	pthread_mutex_unlock(&job_lock);
+	if (j >= njobs)
+	    break;
+	run_job(&jobs[j], mach, zero_reg);
+    }
+    free_reg(zero_reg);
+    free_machine(mach);
+    return NULL;
+}
+
+/* Run programs listed in manifest, printing results in manifest order */
+static int run_batch(char *manifest, int nthreads, word_t memlen)
+{
+    FILE *mfile = fopen(manifest, "r");
+    char line[MAXLINE];
+    pthread_t *threads;
+    int maxjobs = 0;
+    int i;
+    if (!mfile) {
+	fprintf(stderr, "Can't open manifest '%s'\n", manifest);
+	return 1;
+    }
+    while (fgets(line, MAXLINE, mfile)) {
+	char name[MAXLINE];
+	int max_steps = 10000;
+	/* Skip blank lines and comments */
+	if (sscanf(line, "%s %d", name, &max_steps) < 1 || name[0] == '#')
+	    continue;
+	if (njobs == maxjobs) {
+	    maxjobs = maxjobs ? 2*maxjobs : 64;
+	    jobs = (job_ptr) realloc(jobs, maxjobs * sizeof(job_rec));
+	}
+	jobs[njobs].name = strdup(name);
+	jobs[njobs].max_steps = max_steps;
+	njobs++;
+    }
+    fclose(mfile);
+
+    batch_memlen = memlen;
+    if (nthreads > njobs)
+	nthreads = njobs;
+    threads = (pthread_t *) malloc(nthreads * sizeof(pthread_t));
+    for (i = 0; i < nthreads; i++)
+	pthread_create(&threads[i], NULL, batch_worker, NULL);
+    for (i = 0; i < nthreads; i++)
+	pthread_join(threads[i], NULL);
+    free((void *) threads);
+
+    for (i = 0; i < njobs; i++) {
+	printf("%s\n", jobs[i].result);
+	free((void *) jobs[i].name);
+    }
+    free((void *) jobs);
+    return 0;
+}
+
+/**************** Debugging ****************/
+
+/* Simulator state seen by hist_debug */
+typedef struct {
+  machine_ptr mach;
+  mem_t saver;
+  mem_t savem;
+} debug_rec, *debug_ptr;
+
+static stat_t debug_step(void *arg)
+{
+    return step_machine(((debug_ptr) arg)->mach);
+}
+
+static word_t debug_pc(void *arg)
+{
+    return ((debug_ptr) arg)->mach->s->pc;
+}
+
+static void debug_show(void *arg, word_t step, stat_t e, bool_t full)
+{
+    debug_ptr d = (debug_ptr) arg;
+    state_ptr s = d->mach->s;
+    printf("Step %lld: PC = 0x%llx, Status '%s', CC %s\n",
+	   step, s->pc, stat_name(e), cc_name(get_cc(&s->cc)));
+    if (full) {
+	printf("Changes to registers:\n");
+	diff_reg(d->saver, s->r, stdout);
+	printf("\nChanges to memory:\n");
+	diff_mem(d->savem, s->m, stdout);
+    }
+}
+
+/* Run debugger on machine.  Return number of steps at end */
+static word_t debug_machine(machine_ptr mach, mem_t saver, mem_t savem,
+			    int max_steps, stat_t *ep)
+{
+    hist_ptr h = new_history(HIST_WINDOW);
+    debug_rec d = {mach, saver, savem};
+    hist_sim_rec sim = {debug_step, debug_pc, debug_show, &d};
+    word_t step;
+    hist_add_mem(h, mach->s->r);
+    hist_add_mem(h, mach->s->m);
+    hist_add_area(h, &mach->s->pc, sizeof(word_t));
+    hist_add_area(h, &mach->s->cc, sizeof(lazy_cc_rec));
+    hist_start(h);
+    hist_debug(h, &sim, stdin, max_steps);
+    step = h->cur;
+    *ep = hist_stat(h);
+    free_history(h);
+    return step;
+}
+
+/**************** Breakpoints and watchpoints ****************/
+
+/* Add breakpoint or watchpoint given by option c with argument arg */
+static bool_t add_watch_arg(watch_ptr w, int c, char *arg)
+{
+    char *end;
+    word_t addr, len = 8;
+    if (c == 'c')
+	return add_break(w, -1, arg);
+    addr = strtoll(arg, &end, 0);
+    if (end == arg || addr < 0)
+	return FALSE;
+    if (c == 'a')
+	return (*end == ':' || *end == '\0') &&
+	    add_break(w, addr, *end == ':' ? end+1 : NULL);
+    if (*end == ',') {
+	char *lend;
+	len = strtoll(end+1, &lend, 0);
+	if (lend == end+1 || *lend != '\0' || len <= 0)
+	    return FALSE;
+    } else if (*end != '\0')
+	return FALSE;
+    add_watch(w, addr, addr+len, c == 'w' ? ACC_WRITE : ACC_READ|ACC_WRITE);
+    return TRUE;
+}
+
+/* Error message of traced instruction */
+typedef struct {
+  char text[MAXLINE];
+  int len;
+} msg_rec, *msg_ptr;
+
+static void save_error(void *arg, char *msg)
+{
+    msg_ptr m = (msg_ptr) arg;
+    int n = snprintf(m->text + m->len, MAXLINE - m->len, "%s", msg);
+    m->len += n < MAXLINE - m->len ? n : MAXLINE - 1 - m->len;
+}
+
 int main(int argc, char *argv[])
 {
     FILE *code_file;
     int max_steps = 10000;
+    /* Run whole program with engine, rather than report each step */
+    bool_t final_only = FALSE;
+    bool_t debug = FALSE;
+    bool_t profile = FALSE;
+    /* Breakpoint and watchpoint options, added once memory is created */
+    int nwatch = 0;
+    int *watch_opts = (int *) malloc(argc * sizeof(int));
+    char **watch_args = (char **) malloc(argc * sizeof(char *));
+    watch_ptr watch = NULL;
+    engine_t engine = ENGINE_STEP;
+    int c;
+    word_t memlen = MEM_SIZE;
+    char *trace_name = NULL;
+    trace_ptr trace = NULL;
+    char *manifest = NULL;
+    int nthreads = sysconf(_SC_NPROCESSORS_ONLN);
 
-    state_ptr s = new_state(MEM_SIZE);
-    mem_t saver = copy_reg(s->r);
+    machine_ptr mach;
+    state_ptr s;
+    mem_t saver;
     mem_t savem;
     int step = 0;
 
     stat_t e = STAT_AOK;
 
-    if (argc < 2 || argc > 3)
+    while ((c = getopt(argc, argv, "fbrpm:t:B:j:a:c:w:W:")) != -1) {
+	switch(c) {
+	case 'f':
+	    final_only = TRUE;
+	    engine = ENGINE_THREADED;
+	    break;
+	case 'b':
+	    final_only = TRUE;
+	    engine = ENGINE_BLOCKS;
+	    break;
+	case 'r':
+	    debug = TRUE;
+	    break;
+	case 'p':
+	    profile = TRUE;
+	    break;
+	case 'a':
+	case 'c':
+	case 'w':
+	case 'W':
+	    watch_opts[nwatch] = c;
+	    watch_args[nwatch++] = optarg;
+	    break;
+	case 'm':
+	    memlen = strtoll(optarg, NULL, 0);
+	    if (memlen <= 0)
+		usage(argv[0]);
+	    break;
+	case 't':
+	    trace_name = optarg;
+	    break;
+	case 'B':
+	    manifest = optarg;
+	    break;
+	case 'j':
+	    nthreads = atoi(optarg);
+	    if (nthreads < 1)
+		usage(argv[0]);
+	    break;
+	default:
+	    usage(argv[0]);
+	}
+    }
+
+    if (manifest) {
+	if (argc != optind || trace_name || final_only || debug || profile ||
+	    nwatch > 0)
+	    usage(argv[0]);
+	return run_batch(manifest, nthreads, memlen);
+    }
+
+    if (argc - optind < 1 || argc - optind > 2 ||
+	(trace_name != NULL) + final_only + debug > 1 || (debug && nwatch > 0))
 	usage(argv[0]);
-    code_file = fopen(argv[1], "r");
+    /* Load errors go to stderr, and execution errors to stdout */
+    mach = new_machine(memlen, error_to_file, stderr);
+    mach->engine = engine;
+    s = mach->s;
+    if (profile)
+	s->prof = new_profile(memlen);
+    if (nwatch > 0) {
+	int i;
+	watch = new_watch(memlen);
+	for (i = 0; i < nwatch; i++)
+	    if (!add_watch_arg(watch, watch_opts[i], watch_args[i])) {
+		fprintf(stderr, "Invalid argument '%s' of option -%c\n",
+			watch_args[i], watch_opts[i]);
+		exit(1);
+	    }
+	s->watch = watch;
+    }
+    free((void *) watch_opts);
+    free((void *) watch_args);
+    saver = copy_reg(s->r);
+    code_file = fopen(argv[optind], "r");
     if (!code_file) {
-	fprintf(stderr, "Can't open code file '%s'\n", argv[1]);
+	fprintf(stderr, "Can't open code file '%s'\n", argv[optind]);
 	exit(1);
     }
 
-    if (!load_mem(s->m, code_file, 1)) {
+    if (!load_machine(mach, code_file)) {
 	printf("Exiting\n");
 	return 1;
     }
+    mach->error_arg = stdout;
 
     savem = copy_mem(s->m);
   
-    if (argc > 2)
-	max_steps = atoi(argv[2]);
+    if (argc - optind > 1)
+	max_steps = atoi(argv[optind+1]);
 
-    for (step = 0; step < max_steps && e == STAT_AOK; step++) {
-        /* Execute one instruction at a time */
-        e = step_state(s, stdout);
+    if (trace_name) {
+	FILE *trace_file = fopen(trace_name, "wb");
+	msg_rec msg;
+	if (!trace_file) {
+	    fprintf(stderr, "Can't open trace file '%s'\n", trace_name);
+	    exit(1);
+	}
+	/* Error messages are recorded in the trace */
+	mach->error = save_error;
+	mach->error_arg = &msg;
+	trace = open_trace(trace_file, s);
+        for (step = 0; step < max_steps && e == STAT_AOK; step++) {
+	    msg.len = 0;
+	    trace_begin(trace, s);
+            e = step_machine(mach);
+	    trace_end(trace, s, e, msg.text, msg.len);
+	    if (watch && watch->hit != WATCH_NONE) {
+		step++;
+		break;
+	    }
+        }
+	close_trace(trace, s, step, e);
+	fclose(trace_file);
+    } else if (debug) {
+	step = debug_machine(mach, saver, savem, max_steps, &e);
+    } else if (final_only) {
+	word_t steps = 0;
+	e = run_machine(mach, max_steps, &steps);
+	step = steps;
+    } else {
+        for (step = 0; step < max_steps && e == STAT_AOK; step++) {
+            /* Execute one instruction at a time */
+            e = step_machine(mach);
 
-        printf("-------- Step %d --------\n", step + 1);
-        printf("PC = 0x%llx, Status '%s', CC %s\n",
-	        s->pc, stat_name(e), cc_name(s->cc));
-        printf("Changes to registers:\n");
-        diff_reg(saver, s->r, stdout);
+            printf("-------- Step %d --------\n", step + 1);
+            printf("PC = 0x%llx, Status '%s', CC %s\n",
+		   s->pc, stat_name(e), cc_name(get_cc(&s->cc)));
+            printf("Changes to registers:\n");
+            diff_reg(saver, s->r, stdout);
 
-        printf("\nChanges to memory:\n");
-        diff_mem(savem, s->m, stdout);
-        printf("\n");
+            printf("\nChanges to memory:\n");
+            diff_mem(savem, s->m, stdout);
+            printf("\n");
+	    if (watch && watch->hit != WATCH_NONE) {
+		step++;
+		break;
+	    }
+        }
     }
-	
 
-    printf("Stopped in %d steps at PC = 0x%llx.  Status '%s', CC %s\n",
-	   step, s->pc, stat_name(e), cc_name(s->cc));
+    if (watch && watch->hit != WATCH_NONE)
+	print_hit(watch, trace ? stderr : stdout);
+
+    if (!trace) {
+	printf("Stopped in %d steps at PC = 0x%llx.  Status '%s', CC %s\n",
+	       step, s->pc, stat_name(e), cc_name(get_cc(&s->cc)));
 
-    printf("Changes to registers:\n");
-    diff_reg(saver, s->r, stdout);
+	printf("Changes to registers:\n");
+	diff_reg(saver, s->r, stdout);
 
-    printf("\nChanges to memory:\n");
-    diff_mem(savem, s->m, stdout);
+	printf("\nChanges to memory:\n");
+	diff_mem(savem, s->m, stdout);
+    }
+
+    if (profile) {
+	/* Listing comes from the code file */
+	code_file = fopen(argv[optind], "r");
+	printf("\n");
+	print_profile(s->prof, code_file, stdout);
+	if (code_file)
+	    fclose(code_file);
+	free_profile(s->prof);
+	s->prof = NULL;
+    }
 
-    free_state(s);
+    if (watch) {
+	s->watch = NULL;
+	free_watch(watch);
+    }
+    free_machine(mach);
     free_reg(saver);
     free_mem(savem);
 
@@ -0,0 +1,103 @@
+/* Render binary trace from yis -t as the text yis prints */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "isa.h"
+#include "trace.h"
+
+/* YISDUMP never runs in GUI mode */
+int gui_mode = 0;
+
+void usage(char *pname)
+{
+    printf("Usage: %s trace_file\n", pname);
+    exit(0);
+}
+
+int main(int argc, char *argv[])
+{
+    FILE *trace_file;
+    word_t memlen;
+    state_ptr s;
+    mem_t saver;
+    mem_t savem = NULL;
+    trace_entry_rec e;
+    byte_t *buf = NULL;
+    int buflen = 0;
+    int step = 0;
+    bool_t done = FALSE;
+
+    if (argc != 2)
+	usage(argv[0]);
+    trace_file = fopen(argv[1], "rb");
+    if (!trace_file) {
+	fprintf(stderr, "Can't open trace file '%s'\n", argv[1]);
+	exit(1);
+    }
+    memlen = read_trace_header(trace_file);
+    if (memlen <= 0) {
+	fprintf(stderr, "'%s' is not a yis trace\n", argv[1]);
+	exit(1);
+    }
+    s = new_state(memlen);
+    saver = copy_reg(s->r);
+
+    while (!done && read_trace_entry(trace_file, &e, &buf, &buflen)) {
+	int i;
+	/* Initial memory ends at first other record */
+	if (!savem && e.tag != TR_IMAGE)
+	    savem = copy_mem(s->m);
+	switch (e.tag) {
+	case TR_IMAGE:
+	    for (i = 0; i < e.len; i++)
+		set_byte_val(s->m, e.addr+i, e.bytes[i]);
+	    break;
+	case TR_REG:
+	    set_reg_val(s->r, e.addr, e.val);
+	    break;
+	case TR_MEM:
+	    if (e.len == 8)
+		set_word_val(s->m, e.addr, e.val);
+	    else
+		set_byte_val(s->m, e.addr, e.val);
+	    break;
+	case TR_MSG:
+	    fwrite(e.bytes, 1, e.len, stdout);
+	    break;
+	case TR_STEP:
+	    printf("-------- Step %d --------\n", ++step);
+	    printf("PC = 0x%llx, Status '%s', CC %s\n",
+		   e.val, stat_name(e.stat), cc_name(e.cc));
+	    printf("Changes to registers:\n");
+	    diff_reg(saver, s->r, stdout);
+
+	    printf("\nChanges to memory:\n");
+	    diff_mem(savem, s->m, stdout);
+	    printf("\n");
+	    break;
+	case TR_END:
+	    printf("Stopped in %lld steps at PC = 0x%llx.  Status '%s', CC %s\n",
+		   e.steps, e.val, stat_name(e.stat), cc_name(e.cc));
+
+	    printf("Changes to registers:\n");
+	    diff_reg(saver, s->r, stdout);
+
+	    printf("\nChanges to memory:\n");
+	    diff_mem(savem, s->m, stdout);
+	    done = TRUE;
+	    break;
+	}
+    }
+    if (!done) {
+	fprintf(stderr, "Trace '%s' is truncated or corrupt\n", argv[1]);
+	exit(1);
+    }
+
+    free_state(s);
+    free_reg(saver);
+    free_mem(savem);
+    free(buf);
+    fclose(trace_file);
+    return 0;
+}
@@ -0,0 +1,98 @@
+/* Convert .yo file into object file that loads without parsing */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "isa.h"
+
+/* YO2BIN never runs in GUI mode */
+int gui_mode = 0;
+
+/* Memory is sparse, so allow any address a simulator might use.
+   Addresses are checked when the object file is loaded */
+#define CONV_MEM_SIZE ((word_t) 1 << 36)
+
+/* Segments of memory written by load_mem */
+typedef struct {
+  word_t addr;
+  word_t len;
+} seg_rec, *seg_ptr;
+
+static seg_ptr segs = NULL;
+static int nseg = 0;
+static int maxseg = 0;
+
+/* Record write of one byte, extending the last segment when
+   contiguous */
+static void load_hook(void *arg, mem_t m, word_t pos, int len, word_t val)
+{
+    if (nseg > 0 && segs[nseg-1].addr + segs[nseg-1].len == pos) {
+	segs[nseg-1].len += len;
+	return;
+    }
+    if (nseg == maxseg) {
+	maxseg = maxseg ? 2*maxseg : 16;
+	segs = (seg_ptr) realloc(segs, maxseg * sizeof(seg_rec));
+    }
+    segs[nseg].addr = pos;
+    segs[nseg].len = len;
+    nseg++;
+}
+
+static void put_int(FILE *out, word_t val, int n)
+{
+    int i;
+    for (i = 0; i < n; i++)
+	putc((int) ((uword_t) val >> (8*i)) & 0xFF, out);
+}
+
+void usage(char *pname)
+{
+    printf("Usage: %s code_file.yo object_file\n", pname);
+    exit(0);
+}
+
+int main(int argc, char *argv[])
+{
+    FILE *code_file, *obj_file;
+    mem_t m;
+    int i;
+    word_t pos;
+
+    if (argc != 3)
+	usage(argv[0]);
+    code_file = fopen(argv[1], "r");
+    if (!code_file) {
+	fprintf(stderr, "Can't open code file '%s'\n", argv[1]);
+	exit(1);
+    }
+    m = init_mem(CONV_MEM_SIZE);
+    set_write_hook(m, load_hook, NULL);
+    if (!load_mem(m, code_file, 1)) {
+	printf("Exiting\n");
+	return 1;
+    }
+    fclose(code_file);
+
+    obj_file = fopen(argv[2], "wb");
+    if (!obj_file) {
+	fprintf(stderr, "Can't open object file '%s'\n", argv[2]);
+	exit(1);
+    }
+    fwrite(OBJ_MAGIC, 1, 4, obj_file);
+    put_int(obj_file, OBJ_VERSION, 1);
+    put_int(obj_file, nseg, 4);
+    for (i = 0; i < nseg; i++) {
+	put_int(obj_file, segs[i].addr, 8);
+	put_int(obj_file, segs[i].len, 4);
+	for (pos = segs[i].addr; pos < segs[i].addr + segs[i].len; pos++) {
+	    byte_t b = 0;
+	    get_byte_val(m, pos, &b);
+	    putc(b, obj_file);
+	}
+    }
+    fclose(obj_file);
+    free_mem(m);
+    free(segs);
+    return 0;
+}
@@ -18,7 +18,7 @@
  ******************************************************************************/
 
 /* Different control operations for pipeline register */
-/* LOAD:   Copy next state to current   */
+/* LOAD:   Make next state current      */
 /* STALL:  Keep current state unchanged */
 /* BUBBLE: Set current state to nop     */
 /* ERROR:  Occurs when both stall & load signals set */
@@ -26,7 +26,9 @@
 typedef enum { P_LOAD, P_STALL, P_BUBBLE, P_ERROR } p_stat_t;
 
 typedef struct {
-    /* Current and next register state */
+    /* Current and next register state.  Loading the register exchanges
+       these pointers, so the stage feeding it must set every field of
+       next in each cycle */
     void *current;
     void *next;
     /* Contents of register when bubble occurs */
@@ -43,7 +45,8 @@ typedef struct {
 
 /* Create new pipe with count bytes of state */
 /* bubble_val indicates state corresponding to pipeline bubble */
-pipe_ptr new_pipe(int count, void *bubble_val);
+/* copies holds the 2*count bytes of current and next state */
+pipe_ptr new_pipe(int count, void *bubble_val, void *copies);
 
 /* Update all pipes */
 void update_pipes();
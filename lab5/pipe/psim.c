@@ -14,7 +14,11 @@
 #include "isa.h"
 #include "pipeline.h"
 #include "stages.h"
+#include "check.h"
+#include "bpred.h"
+#include "cache.h"
 #include "sim.h"
+#include "history.h"
 
 #define MAXBUF 1024
 #define DEFAULTNAME "Y86-64 Simulator: "
@@ -43,6 +47,28 @@ FILE *object_file;       /* Input file handle */
 bool_t verbosity = 2;    /* Verbosity level [TTY only] (-v) */ 
 word_t instr_limit = 10000; /* Instruction limit [TTY only] (-l) */
 bool_t do_check = FALSE; /* Test with ISA simulator? [TTY only] (-t) */
+bool_t check_thread = FALSE; /* Test on a second thread? [TTY only] (-T) */
+bool_t do_debug = FALSE; /* Debug with reverse execution? [TTY only] (-r) */
+bool_t do_profile = FALSE; /* Profile instructions? [TTY only] (-p) */
+bp_kind_t bp_kind = BP_TAKEN; /* Jump predictor (-b) */
+int bp_bits = BP_BITS;   /* Log2 of predictor table entries (-b) */
+int ras_size = 0;        /* Return-address stack entries (-R) */
+bool_t show_bpred = FALSE; /* Print predictor statistics? */
+int pipe_width = 1;      /* Instructions per stage per cycle [TTY only] (-w) */
+int ooo_rob = 0;         /* Reorder-buffer entries, 0 for in order (-o) */
+int ooo_rs = OOO_RS;     /* Reservation stations per unit (-o) */
+int ooo_lsq = OOO_LSQ;   /* Load/store queue entries (-o) */
+/* Operation latencies in cycles [not with -w alone] (-L) */
+int op_lat[LAT_COUNT] = {1, 1, 1, 1, 1, 1};
+/* Latency of ALU function f.  OPq with an invalid function takes one cycle */
+#define ALU_LAT(f) ((f) <= A_XOR ? op_lat[f] : 1)
+/* Cycles taken by fetch and memory [scalar pipeline, TTY only] (-S) */
+int fetch_depth = 1, mem_depth = 1;
+bool_t show_stalls = FALSE; /* Print stall cycles? */
+/* Caches, and which are present [scalar pipeline only] (-C) */
+cache_cfg_rec cache_cfg[CACHE_LEVELS];
+bool_t cache_on[CACHE_LEVELS];
+int mem_latency = MEM_LATENCY; /* Cycles to access memory (-C) */
 
 /************* 
  * End Globals 
@@ -56,6 +82,12 @@ bool_t do_check = FALSE; /* Test with ISA simulator? [TTY only] (-t) */
 word_t sim_run_pipe(word_t max_instr, word_t max_cycle, byte_t *statusp, cc_t *ccp);
 static void usage(char *name);           /* Print helpful usage message */
 static void run_tty_sim();               /* Run simulator in TTY mode */
+static void clear_wide();                /* Reset wide pipeline (-w) */
+static void clear_ooo();                 /* Reset out-of-order core (-o) */
+static bool_t parse_ooo(char *arg);      /* Parse -o argument */
+static bool_t parse_latencies(char *arg); /* Parse -L argument */
+static bool_t parse_caches(char *arg);   /* Parse -C argument */
+static bool_t parse_depths(char *arg);   /* Parse -S argument */
 
 #ifdef HAS_GUI
 void addAppCommands(Tcl_Interp *interp); /* Add application-dependent commands */
@@ -82,10 +114,11 @@ int sim_main(int argc, char **argv)
 {
     int i;
     int c;
+    bool_t set_lat = FALSE;
     char *myargv[MAXARGS];
     
     /* Parse the command line arguments */
-    while ((c = getopt(argc, argv, "htgl:v:")) != -1) {
+    while ((c = getopt(argc, argv, "htTrpgl:v:b:R:w:o:L:C:S:")) != -1) {
 	switch(c) {
 	case 'h':
 	    usage(argv[0]);
@@ -103,9 +136,68 @@ int sim_main(int argc, char **argv)
 	case 't':
 	    do_check = TRUE;
 	    break;
+	case 'T':
+	    do_check = TRUE;
+	    check_thread = TRUE;
+	    break;
+	case 'r':
+	    do_debug = TRUE;
+	    break;
+	case 'p':
+	    do_profile = TRUE;
+	    break;
 	case 'g':
 	    gui_mode = TRUE;
 	    break;
+	case 'b':
+	    if (!parse_bpred(optarg, &bp_kind, &bp_bits)) {
+		printf("Invalid predictor '%s'\n", optarg);
+		usage(argv[0]);
+	    }
+	    show_bpred = TRUE;
+	    break;
+	case 'R':
+	    ras_size = atoi(optarg);
+	    if (ras_size < 0) {
+		printf("Invalid return-address stack size %d\n", ras_size);
+		usage(argv[0]);
+	    }
+	    show_bpred = TRUE;
+	    break;
+	case 'w':
+	    pipe_width = atoi(optarg);
+	    if (pipe_width < 1 || pipe_width > MAX_WIDTH) {
+		printf("Invalid width %d\n", pipe_width);
+		usage(argv[0]);
+	    }
+	    break;
+	case 'o':
+	    if (!parse_ooo(optarg)) {
+		printf("Invalid out-of-order configuration '%s'\n", optarg);
+		usage(argv[0]);
+	    }
+	    break;
+	case 'L':
+	    if (!parse_latencies(optarg)) {
+		printf("Invalid latencies '%s'\n", optarg);
+		usage(argv[0]);
+	    }
+	    set_lat = show_stalls = TRUE;
+	    break;
+	case 'C':
+	    if (!parse_caches(optarg)) {
+		printf("Invalid caches '%s'\n", optarg);
+		usage(argv[0]);
+	    }
+	    show_stalls = TRUE;
+	    break;
+	case 'S':
+	    if (!parse_depths(optarg)) {
+		printf("Invalid stage depths '%s'\n", optarg);
+		usage(argv[0]);
+	    }
+	    show_stalls = TRUE;
+	    break;
 	default:
 	    printf("Invalid option '%c'\n", c);
 	    usage(argv[0]);
@@ -114,6 +206,29 @@ int sim_main(int argc, char **argv)
     }
 
 
+    if (do_check && do_debug) {
+	printf("Options -t/-T and -r cannot be combined\n");
+	usage(argv[0]);
+    }
+    if ((pipe_width > 1 || ooo_rob > 0) && (do_debug || gui_mode)) {
+	printf("Options -w and -o cannot be combined with -r or -g\n");
+	usage(argv[0]);
+    }
+    if ((pipe_width > 1 || ooo_rob > 0) &&
+	(cache_on[L1I] || cache_on[L1D] || cache_on[L2])) {
+	printf("Option -C cannot be combined with -w or -o\n");
+	usage(argv[0]);
+    }
+    if ((fetch_depth > 1 || mem_depth > 1) &&
+	(pipe_width > 1 || ooo_rob > 0 || gui_mode)) {
+	printf("Option -S cannot be combined with -w, -o or -g\n");
+	usage(argv[0]);
+    }
+    if (set_lat && pipe_width > 1 && ooo_rob == 0) {
+	printf("Option -L cannot be combined with -w, unless with -o\n");
+	usage(argv[0]);
+    }
+
     /* Do we have too many arguments? */
     if (optind < argc - 1) {
 	printf("Too many command line arguments:");
@@ -178,6 +293,23 @@ int sim_main(int argc, char **argv)
 
 int main(int argc, char *argv[]){return sim_main(argc,argv);}
 
+/*
+ * cycle_limit - bound on cycles for instr_limit instructions.  Each
+ * waits at most for its slowest operation and for misses in both
+ * first-level caches
+ */
+static word_t cycle_limit()
+{
+    word_t per_instr = 5;
+    int k;
+    for (k = 0; k < LAT_COUNT; k++)
+	per_instr += op_lat[k] - 1;
+    if (cache_on[L1I] || cache_on[L1D])
+	per_instr += 16 * (cache_cfg[L2].latency + 4 * mem_latency);
+    per_instr += 2 * (fetch_depth + mem_depth);
+    return per_instr * instr_limit;
+}
+
 /* 
  * run_tty_sim - Run the simulator in TTY mode
  */
@@ -193,6 +325,10 @@ static void run_tty_sim()
 
     /* In TTY mode, the default object file comes from stdin */
     if (!object_file) {
+	if (do_debug) {
+	    fprintf(stderr, "Debugging requires an object file argument\n");
+	    exit(1);
+	}
 	object_file = stdin;
     }
 
@@ -213,18 +349,20 @@ static void run_tty_sim()
     }
     fclose(object_file);
     if (do_check) {
-	isa_state = new_state(0);
-	free_mem(isa_state->r);
-	free_mem(isa_state->m);
-	isa_state->m = copy_mem(mem);
-	isa_state->r = copy_mem(reg);
-	isa_state->cc = cc;
+	/* Each instruction is checked as it completes */
+	checker = new_checker(reg, mem, cc, check_thread);
+	isa_state = checker->isa->s;
     }
 
     mem0 = copy_mem(mem);
     reg0 = copy_mem(reg);
+    if (do_profile)
+	prof = new_profile(mem->len);
     
-    icount = sim_run_pipe(instr_limit, 5*instr_limit, &run_status, &result_cc);
+    if (do_debug)
+	icount = sim_debug(stdin, cycle_limit(), &run_status, &result_cc);
+    else
+	icount = sim_run_pipe(instr_limit, cycle_limit(), &run_status, &result_cc);
     if (verbosity > 0) {
 	printf("%lld instructions executed\n", icount);
 	printf("Status = %s\n", stat_name(run_status));
@@ -235,33 +373,42 @@ static void run_tty_sim()
 	diff_mem(mem0, mem, stdout);
     }
     if (do_check) {
-	byte_t e = STAT_AOK;
-	word_t step;
 	bool_t match = TRUE;
+	bool_t diverged;
 
-	for (step = 0; step < instr_limit && e == STAT_AOK; step++) {
-	    e = step_state(isa_state, stdout);
+	finish_checker(checker);
+	diverged = check_failed(checker);
+	if (diverged) {
+	    match = FALSE;
+	    if (verbosity > 0)
+		printf("%s", checker->msg);
+	} else if (checker->isa_stat == STAT_AOK &&
+		   checker->checked < instr_limit) {
+	    /* Pipeline stopped early.  ISA simulator runs on */
+	    checker->isa->error = error_to_file;
+	    checker->isa->error_arg = stdout;
+	    run_machine(checker->isa, instr_limit - checker->checked, NULL);
 	}
 
-	if (diff_reg(isa_state->r, reg, NULL)) {
+	if (!diverged && diff_reg(isa_state->r, reg, NULL)) {
 	    match = FALSE;
 	    if (verbosity > 0) {
 		printf("ISA Register != Pipeline Register File\n");
 		diff_reg(isa_state->r, reg, stdout);
 	    }
 	}
-	if (diff_mem(isa_state->m, mem, NULL)) {
+	if (!diverged && diff_mem(isa_state->m, mem, NULL)) {
 	    match = FALSE;
 	    if (verbosity > 0) {
 		printf("ISA Memory != Pipeline Memory\n");
 		diff_mem(isa_state->m, mem, stdout);
 	    }
 	}
-	if (isa_state->cc != result_cc) {
+	if (!diverged && get_cc(&isa_state->cc) != result_cc) {
 	    match = FALSE;
 	    if (verbosity > 0) {
 		printf("ISA Cond. Codes (%s) != Pipeline Cond. Codes (%s)\n",
-		       cc_name(isa_state->cc), cc_name(result_cc));
+		       cc_name(get_cc(&isa_state->cc)), cc_name(result_cc));
 	    }
 	}
 	if (match) {
@@ -269,6 +416,8 @@ static void run_tty_sim()
 	} else {
 	    printf("ISA Check Fails\n");
 	}
+	free_checker(checker);
+	checker = NULL;
     }
 
     /* Emit CPI statistics */
@@ -277,6 +426,50 @@ static void run_tty_sim()
 	printf("CPI: %lld cycles/%lld instructions = %.2f\n",
 	       cycles, instructions, cpi);
     }
+    if (pipe_width > 1 || ooo_rob > 0) {
+	double ipc = cycles > 0 ? (double) instructions/cycles : 0.0;
+	int n;
+	printf("IPC: %lld instructions/%lld cycles = %.2f, width %d\n",
+	       instructions, cycles, ipc, pipe_width);
+	printf("Cycles completing 0..%d instructions:", pipe_width);
+	for (n = 0; n <= pipe_width; n++)
+	    printf(" %lld", wide_done[n]);
+	printf("\n");
+    }
+    if (ooo_rob > 0) {
+	double occ = cycles > 0 ? (double) rob_occupancy/cycles : 0.0;
+	printf("Out of order: ROB %d, %d stations per unit, LSQ %d\n",
+	       ooo_rob, ooo_rs, ooo_lsq);
+	printf("Rename stalls: ROB %lld, ALU %lld, jump %lld, memory %lld, LSQ %lld\n",
+	       rob_full, rs_full[FU_ALU], rs_full[FU_BRANCH],
+	       rs_full[FU_MEM], lsq_full);
+	printf("Loads: %lld, %lld forwarded from stores.  Average ROB occupancy %.2f\n",
+	       o_loads, o_forwarded, occ);
+    }
+    if (show_stalls && pipe_width == 1 && ooo_rob == 0)
+	printf("Stall cycles: instruction cache %lld, data memory %lld, execute %lld\n",
+	       icache_stalls, dmem_stalls, ex_stalls);
+    if (icache || dcache) {
+	if (icache)
+	    print_cache(icache, stdout);
+	if (dcache)
+	    print_cache(dcache, stdout);
+	if (l2cache)
+	    print_cache(l2cache, stdout);
+    }
+    if (show_bpred)
+	print_bpred(bpred, stdout);
+
+    if (do_profile) {
+	/* Listing comes from the object file, unless read from stdin */
+	FILE *listing = object_filename ? fopen(object_filename, "r") : NULL;
+	printf("\n");
+	print_profile(prof, listing, stdout);
+	if (listing)
+	    fclose(listing);
+	free_profile(prof);
+	prof = NULL;
+    }
 
 }
 
@@ -285,16 +478,116 @@ static void run_tty_sim()
  */
 static void usage(char *name)
 {
-    printf("Usage: %s [-htg] [-l m] [-v n] file.yo\n", name);
+    printf("Usage: %s [-htTrpg] [-l m] [-v n] [-b pred] [-R n] [-w n] [-o r] [-L l] [-C c] [-S s] file.yo\n", name);
     printf("file.yo arg required in GUI mode, optional in TTY mode (default stdin)\n");
     printf("   -h     Print this message\n");
     printf("   -g     Run in GUI mode instead of TTY mode (default TTY)\n");  
     printf("   -l m   Set instruction limit to m [TTY mode only] (default %lld)\n", instr_limit);
     printf("   -v n   Set verbosity level to 0 <= n <= 2 [TTY mode only] (default %d)\n", verbosity);
-    printf("   -t     Test result against ISA simulator [TTY mode only]\n");
+    printf("   -t     Test each instruction against ISA simulator [TTY mode only]\n");
+    printf("   -T     Like -t, running ISA simulator on a second thread [TTY mode only]\n");
+    printf("   -r     Debug with reverse execution, reading commands from stdin [TTY mode only]\n");
+    printf("   -p     Profile instructions completing, with code listing [TTY mode only]\n");
+    printf("   -b p   Predict jumps with p[:bits] = taken, btfnt, bimodal or gshare (default taken:%d)\n", BP_BITS);
+    printf("   -R n   Predict returns with n-entry return-address stack (default %d)\n", ras_size);
+    printf("   -w n   Issue up to n <= %d instructions per cycle, in order [TTY mode only] (default 1)\n", MAX_WIDTH);
+    printf("   -o r   Execute out of order with r = rob[:rs[:lsq]] entries [TTY mode only] (default in order, :%d:%d)\n", OOO_RS, OOO_LSQ);
+    printf("   -L l   Set latencies with l = op=n,... for op in %s [not -w alone] (default 1)\n", "add,sub,and,xor,load,store");
+    printf("   -C c   Add caches with c = l1i|l1d|l2=size:assoc:block[:lru|fifo|random][:wb|wt][:wa|nwa][:lat=n],...\n");
+    printf("          and mem=n for memory latency, lat=n for l2 only (default none, lat=%d, mem=%d)\n", CACHE_LATENCY, MEM_LATENCY);
+    printf("   -S s   Split fetch and memory into s = f=n,m=n cycles, n <= %d [TTY mode only] (default 1)\n", MAX_SPLIT);
     exit(0);
 }
 
+/*
+ * parse_ooo - set reorder buffer, reservation station and load/store
+ * queue sizes from rob[:rs[:lsq]]
+ */
+static bool_t parse_ooo(char *arg)
+{
+    int n = sscanf(arg, "%d:%d:%d", &ooo_rob, &ooo_rs, &ooo_lsq);
+    return n >= 1 && ooo_rob > 0 && ooo_rs > 0 && ooo_lsq > 0;
+}
+
+static char *cache_names[CACHE_LEVELS] = {"l1i", "l1d", "l2"};
+
+/*
+ * parse_caches - configure caches from name=spec,... and memory
+ * latency from mem=n
+ */
+static bool_t parse_caches(char *arg)
+{
+    char *s;
+    for (s = strtok(arg, ","); s; s = strtok(NULL, ",")) {
+	int k, len;
+	if (sscanf(s, "mem=%d", &mem_latency) == 1) {
+	    if (mem_latency < 0)
+		return FALSE;
+	    continue;
+	}
+	for (k = 0; k < CACHE_LEVELS; k++) {
+	    len = strlen(cache_names[k]);
+	    if (strncmp(s, cache_names[k], len) == 0 && s[len] == '=')
+		break;
+	}
+	if (k == CACHE_LEVELS || !parse_cache(s+len+1, &cache_cfg[k]))
+	    return FALSE;
+	/* A hit in a first-level cache takes the load or store latency */
+	if (k != L2 && strstr(s+len+1, ":lat="))
+	    return FALSE;
+	cache_on[k] = TRUE;
+    }
+    return TRUE;
+}
+
+/*
+ * parse_depths - set cycles taken by fetch and memory from f=n,m=n
+ */
+static bool_t parse_depths(char *arg)
+{
+    char *s;
+    for (s = strtok(arg, ","); s; s = strtok(NULL, ",")) {
+	int n;
+	if (sscanf(s+2, "%d", &n) != 1 || s[1] != '=' ||
+	    n < 1 || n > MAX_SPLIT)
+	    return FALSE;
+	if (s[0] == 'f')
+	    fetch_depth = n;
+	else if (s[0] == 'm')
+	    mem_depth = n;
+	else
+	    return FALSE;
+    }
+    return TRUE;
+}
+
+static char *lat_names[LAT_COUNT] =
+    {"add", "sub", "and", "xor", "load", "store"};
+
+/*
+ * parse_latencies - set operation latencies from op=n,...
+ */
+static bool_t parse_latencies(char *arg)
+{
+    char *s = arg;
+    while (*s) {
+	int k, n, len;
+	for (k = 0; k < LAT_COUNT; k++) {
+	    len = strlen(lat_names[k]);
+	    if (strncmp(s, lat_names[k], len) == 0 && s[len] == '=')
+		break;
+	}
+	if (k == LAT_COUNT || sscanf(s+len+1, "%d", &n) != 1 || n < 1)
+	    return FALSE;
+	op_lat[k] = n;
+	s = strchr(s, ',');
+	if (!s)
+	    break;
+	s++;
+    }
+    return TRUE;
+}
+
 
 /*********************************************************
  * Part 2: This part contains the core simulator routines.
@@ -309,6 +602,16 @@ static void usage(char *name)
 /* Performance monitoring */
 /* How many cycles have been simulated? */
 word_t cycles = 0;
+/* Counts of instructions completing, when profiling (-p) */
+profile_ptr prof = NULL;
+/* Lock-step comparison with ISA simulator (-t, -T) */
+check_ptr checker = NULL;
+/* Branch predictor, chosen with -b and -R */
+bpred_ptr bpred = NULL;
+/* Caches, chosen with -C, or NULL */
+cache_ptr icache = NULL, dcache = NULL, l2cache = NULL;
+/* Cycles the pipeline waited for each of the first-level caches */
+word_t icache_stalls = 0, dmem_stalls = 0;
 /* How many instructions have passed through the WB stage? */
 word_t instructions = 0;
 
@@ -325,13 +628,13 @@ word_t memCnt = 0;
 /* Register file */
 mem_t reg;
 /* Condition code register */
-cc_t cc;
+lazy_cc_rec cc;
 /* Status code */
 stat_t status;
 
 
 /* Pending updates to state */
-word_t cc_in = DEFAULT_CC;
+lazy_cc_rec cc_in = {DEFAULT_CC};
 word_t wb_destE = REG_NONE;
 word_t wb_valE = 0;
 word_t wb_destM = REG_NONE;
@@ -369,10 +672,45 @@ word_t e_vala;
 word_t e_valb;
 bool_t e_bcond;
 bool_t dmem_error;
+bool_t imem_miss;
+bool_t dmem_busy;
+
+/* Address of the fetch waiting for the instruction cache, or -1, and
+   cycles it has left */
+static word_t icache_pc = -1;
+static int icache_wait = 0;
+/* Cycles left for the data cache access of the instruction in M, or
+   -1 if not yet made */
+static int dmem_wait = -1;
+
+/* Cycles left for the operation in EX, or -1 if it has just entered */
+static int ex_wait = -1;
+bool_t ex_busy;
+/* Cycles the pipeline waited for multi-cycle operations in EX */
+word_t ex_stalls = 0;
 
 /* The pipeline state */
 pipe_ptr pc_state, if_id_state, id_ex_state, ex_mem_state, mem_wb_state;
 
+/* Extra pipe registers of split stages (-S): fetch_q[0] is loaded by
+   fetch and the last feeds D, and mem_q[0] is loaded by the first
+   cycle of M and the last feeds its last cycle */
+static pipe_ptr fetch_q_state[MAX_SPLIT-1], mem_q_state[MAX_SPLIT-1];
+static if_id_ptr fetch_q_curr[MAX_SPLIT-1], fetch_q_next[MAX_SPLIT-1];
+static ex_mem_ptr mem_q_curr[MAX_SPLIT-1], mem_q_next[MAX_SPLIT-1];
+/* Register loaded by fetch, and register read by the last cycle of M */
+static pipe_ptr f_out_state, m_in_state;
+static if_id_ptr f_out_next;
+static ex_mem_ptr m_in_curr;
+
+/* Storage of pipe registers.  Aligned so that it spans as few cache
+   lines as possible */
+#ifdef __GNUC__
+static pipe_regs_rec pipe_regs __attribute__((aligned(64)));
+#else
+static pipe_regs_rec pipe_regs;
+#endif
+
 /* Simulator operating mode */
 sim_mode_t sim_mode = S_FORWARD;
 /* Log file */
@@ -489,7 +827,7 @@ static void sim_report()
 	report_state("W", 0, format_mem_wb(mem_wb_next));
 	report_state("W", 1, format_mem_wb(mem_wb_curr));
 	/* signal_sources(); */
-	show_cc(cc);
+	show_cc(get_cc(&cc));
 	show_stat(status);
 	show_cpi();
     }
@@ -528,23 +866,12 @@ void sim_stall_stage(stage_id_t stage) {
 }
 
 
-static int initialized = 0;
-
-void sim_init()
+/* Connect pipe registers to the pipeline stages.  Needed whenever
+   update_pipes may have exchanged current and next states */
+static inline void connect_pipes()
 {
-    /* Create memory and register files */
-    initialized = 1;
-    mem = init_mem(MEM_SIZE);
-    reg = init_reg();
-    
-    /* create 5 pipe registers */
-    pc_state     = new_pipe(sizeof(pc_ele), (void *) &bubble_pc);
-    if_id_state  = new_pipe(sizeof(if_id_ele), (void *) &bubble_if_id);
-    id_ex_state  = new_pipe(sizeof(id_ex_ele), (void *) &bubble_id_ex);
-    ex_mem_state = new_pipe(sizeof(ex_mem_ele), (void *) &bubble_ex_mem);
-    mem_wb_state = new_pipe(sizeof(mem_wb_ele), (void *) &bubble_mem_wb);
-  
-    /* connect them to the pipeline stages */
+    int i;
+
     pc_next   = pc_state->next;
     pc_curr   = pc_state->current;
   
@@ -560,10 +887,79 @@ void sim_init()
     mem_wb_next = mem_wb_state->next;
     mem_wb_curr = mem_wb_state->current;
 
+    for (i = 0; i < fetch_depth-1; i++) {
+	fetch_q_next[i] = fetch_q_state[i]->next;
+	fetch_q_curr[i] = fetch_q_state[i]->current;
+    }
+    for (i = 0; i < mem_depth-1; i++) {
+	mem_q_next[i] = mem_q_state[i]->next;
+	mem_q_curr[i] = mem_q_state[i]->current;
+    }
+    f_out_next = f_out_state->next;
+    m_in_curr = m_in_state->current;
+}
+
+static int initialized = 0;
+
+void sim_init()
+{
+    int i;
+
+    /* Create memory and register files */
+    initialized = 1;
+    mem = init_mem(MEM_SIZE);
+    reg = init_reg();
+    
+    /* create 5 pipe registers */
+    pc_state     = new_pipe(sizeof(pc_ele), (void *) &bubble_pc,
+			    (void *) pipe_regs.pc);
+    if_id_state  = new_pipe(sizeof(if_id_ele), (void *) &bubble_if_id,
+			    (void *) pipe_regs.if_id);
+    id_ex_state  = new_pipe(sizeof(id_ex_ele), (void *) &bubble_id_ex,
+			    (void *) pipe_regs.id_ex);
+    ex_mem_state = new_pipe(sizeof(ex_mem_ele), (void *) &bubble_ex_mem,
+			    (void *) pipe_regs.ex_mem);
+    mem_wb_state = new_pipe(sizeof(mem_wb_ele), (void *) &bubble_mem_wb,
+			    (void *) pipe_regs.mem_wb);
+    /* and those of split stages */
+    for (i = 0; i < fetch_depth-1; i++)
+	fetch_q_state[i] = new_pipe(sizeof(if_id_ele), (void *) &bubble_if_id,
+				    (void *) pipe_regs.fetch_q[i]);
+    for (i = 0; i < mem_depth-1; i++)
+	mem_q_state[i] = new_pipe(sizeof(ex_mem_ele), (void *) &bubble_ex_mem,
+				  (void *) pipe_regs.mem_q[i]);
+    f_out_state = fetch_depth > 1 ? fetch_q_state[0] : if_id_state;
+    m_in_state = mem_depth > 1 ? mem_q_state[mem_depth-2] : ex_mem_state;
+  
+    connect_pipes();
+
     sim_reset();
     clear_mem(mem);
 }
 
+/* Create empty caches as configured, missing to L2 if present */
+static void clear_caches()
+{
+    if (icache)
+	free_cache(icache);
+    if (dcache)
+	free_cache(dcache);
+    if (l2cache)
+	free_cache(l2cache);
+    icache = dcache = l2cache = NULL;
+    if (cache_on[L2])
+	l2cache = new_cache("L2", &cache_cfg[L2], NULL, mem_latency);
+    if (cache_on[L1I])
+	icache = new_cache("L1I", &cache_cfg[L1I], l2cache, mem_latency);
+    if (cache_on[L1D])
+	dcache = new_cache("L1D", &cache_cfg[L1D], l2cache, mem_latency);
+    icache_stalls = dmem_stalls = ex_stalls = 0;
+    icache_pc = -1;
+    icache_wait = 0;
+    dmem_wait = ex_wait = -1;
+    imem_miss = dmem_busy = ex_busy = FALSE;
+}
+
 void sim_reset()
 {
     if (!initialized)
@@ -574,8 +970,14 @@ void sim_reset()
     memCnt = 0;
     starting_up = 1;
     cycles = instructions = 0;
-    cc = DEFAULT_CC;
+    set_cc(&cc, DEFAULT_CC);
     status = STAT_AOK;
+    if (bpred)
+	free_bpred(bpred);
+    bpred = new_bpred(bp_kind, bp_bits, ras_size);
+    clear_caches();
+    clear_wide();
+    clear_ooo();
 
 #ifdef HAS_GUI
     if (gui_mode) {
@@ -585,7 +987,8 @@ void sim_reset()
 #endif
 
     amux = bmux = MUX_NONE;
-    cc = cc_in = DEFAULT_CC;
+    set_cc(&cc, DEFAULT_CC);
+    set_cc(&cc_in, DEFAULT_CC);
     wb_destE = REG_NONE;
     wb_valE = 0;
     wb_destM = REG_NONE;
@@ -654,10 +1057,19 @@ static void update_state(bool_t update_mem, bool_t update_cc)
 
 /* Text representation of status */
 void tty_report(word_t cyc) {
-  sim_log("\nCycle %lld. CC=%s, Stat=%s\n", cyc, cc_name(cc), stat_name(status));
+  int i;
+  if (dumpfile)
+      sim_log("\nCycle %lld. CC=%s, Stat=%s\n", cyc, cc_name(get_cc(&cc)), stat_name(status));
 
   sim_log("F: predPC = 0x%llx\n", pc_curr->pc);
 
+  for (i = 0; i < fetch_depth-1; i++)
+    sim_log("F%d: instr = %s, rA = %s, rB = %s, valC = 0x%llx, valP = 0x%llx, Stat = %s\n",
+	    i+1, iname(HPACK(fetch_q_curr[i]->icode, fetch_q_curr[i]->ifun)),
+	    reg_name(fetch_q_curr[i]->ra), reg_name(fetch_q_curr[i]->rb),
+	    fetch_q_curr[i]->valc, fetch_q_curr[i]->valp,
+	    stat_name(fetch_q_curr[i]->status));
+
   sim_log("D: instr = %s, rA = %s, rB = %s, valC = 0x%llx, valP = 0x%llx, Stat = %s\n",
 	  iname(HPACK(if_id_curr->icode, if_id_curr->ifun)),
 	  reg_name(if_id_curr->ra), reg_name(if_id_curr->rb),
@@ -671,6 +1083,14 @@ void tty_report(word_t cyc) {
 	  reg_name(id_ex_curr->deste), reg_name(id_ex_curr->destm),
 	  stat_name(id_ex_curr->status));
 
+  for (i = 0; i < mem_depth-1; i++)
+    sim_log("M%d: instr = %s, Cnd = %d, valE = 0x%llx, valA = 0x%llx\n   dstE = %s, dstM = %s, Stat = %s\n",
+	    i+1, iname(HPACK(mem_q_curr[i]->icode, mem_q_curr[i]->ifun)),
+	    mem_q_curr[i]->takebranch,
+	    mem_q_curr[i]->vale, mem_q_curr[i]->vala,
+	    reg_name(mem_q_curr[i]->deste), reg_name(mem_q_curr[i]->destm),
+	    stat_name(mem_q_curr[i]->status));
+
   sim_log("M: instr = %s, Cnd = %d, valE = 0x%llx, valA = 0x%llx\n   dstE = %s, dstM = %s, Stat = %s\n",
 	  iname(HPACK(ex_mem_curr->icode, ex_mem_curr->ifun)),
 	  ex_mem_curr->takebranch,
@@ -685,6 +1105,24 @@ void tty_report(word_t cyc) {
 	  stat_name(mem_wb_curr->status));
 }
 
+/* Was the return in MEM/WB register w mispredicted?  Everything
+   after it in the pipeline is then on the wrong path */
+static inline bool_t ret_missed(mem_wb_ptr w)
+{
+    return w->icode == I_RET && w->status == STAT_AOK &&
+	w->predpc != BP_NONE && w->valm != w->predpc;
+}
+
+/* Was the return in WB mispredicted? */
+#define ret_mispredict() ret_missed(mem_wb_curr)
+
+/* Is there a return without predicted target in register p?  Fetch
+   waits for it to reach WB */
+#define RET_UNPREDICTED(p) ((p)->icode == I_RET && (p)->predpc == BP_NONE)
+
+/* Address a jump leaving EX or MEM actually goes to */
+#define JUMP_TARGET(p) ((p)->takebranch ? (p)->vale : (p)->vala)
+
 /******************************************************************
  * This is the only function you need to modify for PIPE simulator.
  * It runs the pipeline for one cycle. max_instr indicates maximum 
@@ -706,13 +1144,22 @@ static byte_t sim_step_pipe(word_t max_instr, word_t ccount)
     /* How many instructions are ahead of one in wb / ex? */
     int ahead_mem = (wb_status != STAT_BUB);
     int ahead_ex = ahead_mem + (mem_status != STAT_BUB);
-    bool_t update_mem = ahead_mem < max_instr;
-    bool_t update_cc = ahead_ex < max_instr;
+    /* Does M get a new instruction, rather than hold one for a
+       data access in a later memory stage? */
+    bool_t m_loaded = ex_mem_state->op == P_LOAD;
+    bool_t update_mem, update_cc;
+    int i;
+
+    for (i = 0; i < mem_depth-1; i++)
+	ahead_ex += mem_q_next[i]->status != STAT_BUB;
+    update_mem = ahead_mem < max_instr;
+    update_cc = ahead_ex < max_instr;
 
     /* Update program-visible state */
     update_state(update_mem, update_cc);
     /* Update pipe registers */
     update_pipes();
+    connect_pipes();
     /* print status report in TTY mode */
     tty_report(ccount);
     /* error checking */
@@ -728,18 +1175,13 @@ static byte_t sim_step_pipe(word_t max_instr, word_t ccount)
 	mem_wb_curr->status = STAT_PIP;
     
     /****************** Stage implementations ******************
-     * TODO: implement the following functions to simulate the 
-     * executations in each stage. 
-     * You should also implement stalling, forwarding and branch 
-     * prediction to handle data hazards and control hazards.
-     * 
-     * Since C code is executed sequencially, you need to do 
-     * decode stage after execute & memory stages, and memory 
-     * stage before execute, in order to propagate forwarding
-     * values properly.
+     * Since C code is executed sequencially, decode comes after
+     * execute & memory stages, and memory stage before execute,
+     * in order to propagate forwarding values properly.
      ***********************************************************/
 
     do_if_stage();
+    do_split_stages();
     do_mem_stage();
     do_ex_stage();
     do_id_wb_stages();
@@ -751,100 +1193,506 @@ static byte_t sim_step_pipe(word_t max_instr, word_t ccount)
 	starting_up = 0;
 	instructions++;
 	cycles++;
+	if (prof)
+	    profile_instr(prof, mem_wb_curr->stage_pc, mem_wb_curr->icode);
     } else {
 	if (!starting_up)
 	    cycles++;
     }
+    /* Jumps are resolved on entering memory stage.  Instructions
+       behind a mispredicted return in WB are on the wrong path */
+    if (m_loaded && ex_mem_curr->icode == I_JMP &&
+	ex_mem_curr->status != STAT_BUB && !ret_mispredict()) {
+	if (ex_mem_curr->ifun != C_YES) {
+	    bpred->jumps++;
+	    if (JUMP_TARGET(ex_mem_curr) != ex_mem_curr->predpc)
+		bpred->jump_misses++;
+	}
+	if (prof && ex_mem_curr->takebranch)
+	    profile_taken(prof, ex_mem_curr->stage_pc);
+    }
+    if (mem_wb_curr->icode == I_RET && mem_wb_curr->status != STAT_BUB) {
+	bpred->rets++;
+	if (mem_wb_curr->predpc == BP_NONE)
+	    bpred->ret_stalls++;
+	else if (ret_mispredict())
+	    bpred->ret_misses++;
+    }
+    /* Instruction in WB completes: its memory write was made at the
+       start of this cycle, and its register writes are pending.  The
+       second half of a split popq is not checked separately */
+    if (checker && mem_wb_curr->status != STAT_BUB &&
+	mem_wb_curr->icode != I_POP2) {
+	check_reg(checker, wb_destE, wb_valE);
+	check_reg(checker, wb_destM, wb_valM);
+	check_retire(checker, mem_wb_curr->stage_pc, mem_wb_curr->status);
+    }
     
     sim_report();
     return status;
 }
 
 /*************************** Fetch stage ***************************
- * TODO: update [*if_id_next, f_pc]
- * you may find these functions useful: 
- * HPACK(), get_byte_val(), get_word_val(), HI4(), LO4()
- * 
- * imem_error is defined for logging purpose, you can use it to help
- * with your design, but it's also fine to neglect it 
+ * Select the PC, fetch the instruction, and predict the next PC.
+ * Fetch is redirected by a return in WB whose target was not
+ * predicted correctly, or else by a mispredicted jump in MEM.
  *******************************************************************/
+
+/* Does instruction use a register specifier byte? */
+static bool_t need_regids(byte_t icode)
+{
+    return icode == I_RRMOVQ || icode == I_ALU || icode == I_PUSHQ ||
+	icode == I_POPQ || icode == I_IRMOVQ || icode == I_RMMOVQ ||
+	icode == I_MRMOVQ || icode == I_IADDQ;
+}
+
+/* Does instruction have a constant word? */
+static bool_t need_valc(byte_t icode)
+{
+    return icode == I_IRMOVQ || icode == I_RMMOVQ || icode == I_MRMOVQ ||
+	icode == I_JMP || icode == I_CALL || icode == I_IADDQ;
+}
+
+/* Fetch instruction at pc into p, setting the imem signals */
+static void fetch_instr(word_t pc, if_id_ptr p)
+{
+    byte_t instr = HPACK(I_NOP, F_NONE);
+    byte_t regids = HPACK(REG_NONE, REG_NONE);
+    word_t valc = 0;
+    word_t valp = pc;
+
+    imem_error = !get_byte_val(mem, valp, &instr);
+    imem_icode = imem_error ? I_NOP : HI4(instr);
+    imem_ifun = imem_error ? F_NONE : LO4(instr);
+    valp++;
+    instr_valid = imem_icode <= I_IADDQ;
+    if (instr_valid && need_regids(imem_icode)) {
+	imem_error |= !get_byte_val(mem, valp, &regids);
+	valp++;
+    }
+    if (instr_valid && need_valc(imem_icode)) {
+	imem_error |= !get_word_val(mem, valp, &valc);
+	valp += 8;
+    }
+
+    p->icode = imem_icode;
+    p->ifun = imem_ifun;
+    p->ra = HI4(regids);
+    p->rb = LO4(regids);
+    p->valc = valc;
+    p->valp = valp;
+    if (imem_error)
+	p->status = STAT_ADR;
+    else if (!instr_valid)
+	p->status = STAT_INS;
+    else if (imem_icode == I_HALT)
+	p->status = STAT_HLT;
+    else
+	p->status = STAT_AOK;
+    p->stage_pc = pc;
+}
+
+/* Predict the PC following fetched instruction p, setting its
+   prediction fields.  BP_NONE for a return that cannot be predicted */
+static word_t predict_pc(if_id_ptr p)
+{
+    word_t index = 0;
+    word_t predpc;
+
+    switch (p->icode) {
+    case I_JMP:
+	if (p->ifun != C_YES &&
+	    !bp_predict(bpred, p->stage_pc, p->valc, &index))
+	    predpc = p->valp;
+	else
+	    predpc = p->valc;
+	break;
+    case I_CALL:
+	predpc = p->valc;
+	break;
+    case I_RET:
+	predpc = bp_ret_target(bpred);
+	break;
+    default:
+	predpc = p->valp;
+	break;
+    }
+    p->predpc = predpc;
+    p->bp_index = index;
+    return predpc;
+}
+
 void do_if_stage()
 {
-    /* dummy placeholders, replace them with your implementation */
-    f_pc = 0; /* should not overwrite original pc */
-    /* useful variable for logging purpose */
-    imem_error = FALSE;
+    word_t predpc;
+
+    if (mem_wb_curr->icode == I_RET &&
+	(mem_wb_curr->predpc == BP_NONE || ret_mispredict()))
+	f_pc = mem_wb_curr->valm;
+    else if (ex_mem_curr->icode == I_JMP &&
+	     JUMP_TARGET(ex_mem_curr) != ex_mem_curr->predpc)
+	f_pc = JUMP_TARGET(ex_mem_curr);
+    else
+	f_pc = pc_curr->pc;
+
+    fetch_instr(f_pc, f_out_next);
+    predpc = predict_pc(f_out_next);
+
+    /* A fetch that misses in the instruction cache is repeated until
+       the block arrives */
+    imem_miss = FALSE;
+    if (icache && !imem_error) {
+	if (f_pc != icache_pc) {
+	    icache_pc = f_pc;
+	    icache_wait = cache_access(icache, f_pc,
+				       f_out_next->valp - f_pc, FALSE);
+	} else if (icache_wait > 0)
+	    icache_wait--;
+	imem_miss = icache_wait > 0;
+    }
+
+    /* Unpredicted return stalls fetch, so its PC does not matter */
+    if (imem_miss)
+	pc_next->pc = f_pc;
+    else
+	pc_next->pc = predpc == BP_NONE ? f_out_next->valp : predpc;
+    pc_next->status = f_out_next->status == STAT_AOK || imem_miss ?
+	STAT_AOK : STAT_BUB;
 
     /* logging function, do not change this */
     if (!imem_error) {
         sim_log("\tFetch: f_pc = 0x%llx, f_instr = %s\n",
-            f_pc, iname(HPACK(if_id_next->icode, if_id_next->ifun)));
+            f_pc, iname(HPACK(f_out_next->icode, f_out_next->ifun)));
     }
 }
 
 /******************** Decode & Writeback stage *********************
- * TODO: update [*id_ex_next, wb_destE, wb_valE, wb_destM, wb_valM]
- * you may find these functions useful: 
- * get_reg_val()
- * 
- * you don't perform the operation to really write to memory here
- * the pending writeback updates will occur in update_state()
+ * Read operands, forwarding them from later stages, and write back
+ * the instruction in WB.  The writes occur in update_state()
  *******************************************************************/
-void do_id_wb_stages()
+
+/* Value of register src in decode, forwarded from the latest
+   instruction that writes it */
+static word_t forward(byte_t src, word_t regval)
 {
-    /* dummy placeholders, replace them with your implementation */
-    wb_destE = REG_NONE;
-    wb_valE = 0;
-    wb_destM = REG_NONE;
-    wb_valM = 0;
+    int i;
+    if (src == REG_NONE)
+	return regval;
+    if (src == ex_mem_next->deste)
+	return ex_mem_next->vale;
+    /* Through M, latest first.  Loaded values come from its last cycle */
+    for (i = -1; i < mem_depth-1; i++) {
+	ex_mem_ptr p = i < 0 ? ex_mem_curr : mem_q_curr[i];
+	if (src == p->destm && p == m_in_curr)
+	    return mem_wb_next->valm;
+	if (src == p->deste)
+	    return p->vale;
+    }
+    if (src == mem_wb_curr->destm)
+	return mem_wb_curr->valm;
+    if (src == mem_wb_curr->deste)
+	return mem_wb_curr->vale;
+    return regval;
+}
 
+/* Set register IDs of q for instruction p */
+static void decode_regs(if_id_ptr p, id_ex_ptr q)
+{
+    byte_t srca = REG_NONE, srcb = REG_NONE;
+    byte_t deste = REG_NONE, destm = REG_NONE;
+
+    switch (p->icode) {
+    case I_RRMOVQ:
+	srca = p->ra;
+	deste = p->rb;
+	break;
+    case I_IRMOVQ:
+	deste = p->rb;
+	break;
+    case I_RMMOVQ:
+	srca = p->ra;
+	srcb = p->rb;
+	break;
+    case I_MRMOVQ:
+	srcb = p->rb;
+	destm = p->ra;
+	break;
+    case I_ALU:
+	srca = p->ra;
+	srcb = deste = p->rb;
+	break;
+    case I_IADDQ:
+	srcb = deste = p->rb;
+	break;
+    case I_CALL:
+	srcb = deste = REG_RSP;
+	break;
+    case I_RET:
+	srca = srcb = deste = REG_RSP;
+	break;
+    case I_PUSHQ:
+	srca = p->ra;
+	srcb = deste = REG_RSP;
+	break;
+    case I_POPQ:
+	srca = srcb = deste = REG_RSP;
+	destm = p->ra;
+	break;
+    default:
+	break;
+    }
+    q->srca = srca;
+    q->srcb = srcb;
+    q->deste = deste;
+    q->destm = destm;
+}
+
+void do_id_wb_stages()
+{
+    byte_t icode = if_id_curr->icode;
+
+    decode_regs(if_id_curr, id_ex_next);
+    d_regvala = get_reg_val(reg, id_ex_next->srca);
+    d_regvalb = get_reg_val(reg, id_ex_next->srcb);
+
+    id_ex_next->icode = icode;
+    id_ex_next->ifun = if_id_curr->ifun;
+    id_ex_next->valc = if_id_curr->valc;
+    /* Calls push valP, and jumps keep it in case they are taken */
+    id_ex_next->vala = (icode == I_CALL || icode == I_JMP) ?
+	if_id_curr->valp : forward(id_ex_next->srca, d_regvala);
+    id_ex_next->valb = forward(id_ex_next->srcb, d_regvalb);
+    id_ex_next->status = if_id_curr->status;
+    id_ex_next->stage_pc = if_id_curr->stage_pc;
+    id_ex_next->predpc = if_id_curr->predpc;
+    id_ex_next->bp_index = if_id_curr->bp_index;
+    id_ex_next->bp_ras = if_id_curr->bp_ras;
+
+    wb_destE = mem_wb_curr->deste;
+    wb_valE = mem_wb_curr->vale;
+    wb_destM = mem_wb_curr->destm;
+    wb_valM = mem_wb_curr->valm;
+    status = mem_wb_curr->status;
 }
 
 /************************** Execute stage **************************
- * TODO: update [*ex_mem_next, cc_in]
- * you may find these functions useful: 
- * cond_holds(), compute_alu(), compute_cc()
+ * Compute valE, set the condition codes, and resolve jumps and
+ * conditional moves.  Jumps leave with their target in valE and valP
+ * in valA
  *******************************************************************/
+
+/* Does status stop the pipeline? */
+#define EXCEPTION(s) ((s) == STAT_ADR || (s) == STAT_INS || (s) == STAT_HLT)
+
+/* Does instruction test the condition codes? */
+#define USES_CC(p) (((p)->icode == I_JMP || (p)->icode == I_RRMOVQ) && \
+		    (p)->ifun != C_YES)
+#define SETS_CC(p) ((p)->icode == I_ALU || (p)->icode == I_IADDQ)
+#define USES_MEM(p) ((p)->icode == I_RMMOVQ || (p)->icode == I_MRMOVQ || \
+		     (p)->icode == I_PUSHQ || (p)->icode == I_POPQ ||	\
+		     (p)->icode == I_CALL || (p)->icode == I_RET)
+
+/* Has an instruction in M or WB an exception?  Those behind it must
+   not change the condition codes */
+static bool_t mem_exception()
+{
+    int i;
+    for (i = 0; i < mem_depth-1; i++)
+	if (EXCEPTION(mem_q_next[i]->status) ||
+	    EXCEPTION(mem_q_curr[i]->status))
+	    return TRUE;
+    return EXCEPTION(mem_wb_next->status) || EXCEPTION(mem_wb_curr->status);
+}
+
+/* Is there a predicted return in M that has not yet read its return
+   address?  Only when M takes more than one cycle */
+static bool_t ret_unchecked()
+{
+    int i;
+    if (mem_depth == 1)
+	return FALSE;
+    for (i = 0; i < mem_depth-2; i++)
+	if (mem_q_curr[i]->icode == I_RET && mem_q_curr[i]->predpc != BP_NONE)
+	    return TRUE;
+    return ex_mem_curr->icode == I_RET && ex_mem_curr->predpc != BP_NONE;
+}
+
+/* Set ALU function and inputs for instruction p */
+static void alu_inputs(id_ex_ptr p, alu_t *funp, word_t *ap, word_t *bp)
+{
+    *funp = p->icode == I_ALU ? p->ifun : A_ADD;
+    switch (p->icode) {
+    case I_RRMOVQ:
+    case I_ALU:
+	*ap = p->vala;
+	break;
+    case I_IRMOVQ:
+    case I_RMMOVQ:
+    case I_MRMOVQ:
+    case I_IADDQ:
+    case I_JMP:
+	*ap = p->valc;
+	break;
+    case I_CALL:
+    case I_PUSHQ:
+	*ap = -8;
+	break;
+    case I_RET:
+    case I_POPQ:
+	*ap = 8;
+	break;
+    default:
+	*ap = 0;
+	break;
+    }
+    *bp = (p->icode == I_RRMOVQ || p->icode == I_IRMOVQ ||
+	   p->icode == I_JMP) ? 0 : p->valb;
+}
+
 void do_ex_stage()
 {
-    /* dummy placeholders, replace them with your implementation */
-    cc_in = DEFAULT_CC; /* should not overwrite original cc */
-    /* some useful variables for logging purpose */
+    byte_t icode = id_ex_curr->icode;
     bool_t setcc = FALSE;
-    alu_t alufun = A_NONE;
+    alu_t alufun;
     word_t alua, alub;
-    alua = alub = 0;
+    bool_t cnd = FALSE;
+    /* A mispredicted return is known once it has read memory */
+    bool_t wrong_path = ret_mispredict() || ret_missed(mem_wb_next);
+
+    alu_inputs(id_ex_curr, &alufun, &alua, &alub);
+
+    /* An operation taking more than one cycle holds EX, leaving
+       bubbles behind it, until its last cycle */
+    if (ex_wait < 0)
+	ex_wait = (id_ex_curr->status == STAT_AOK && icode != I_NOP &&
+		   icode != I_HALT && icode != I_JMP) ? ALU_LAT(alufun) - 1 : 0;
+    else if (ex_wait > 0)
+	ex_wait--;
+    /* Condition codes also wait until the return address of a
+       predicted return has been checked */
+    ex_busy = (ex_wait > 0 || (SETS_CC(id_ex_curr) && ret_unchecked())) &&
+	!ret_mispredict();
+
+    /* Condition codes are not changed once an earlier instruction
+       has an exception, or by an instruction on the wrong path */
+    setcc = (icode == I_ALU || icode == I_IADDQ) && !wrong_path &&
+	!ex_busy && !mem_exception();
+    cc_in = cc;
+    if (setcc)
+	set_cc_op(&cc_in, alufun, alua, alub);
+    if (icode == I_JMP || icode == I_RRMOVQ)
+	cnd = cond_holds(get_cc(&cc), id_ex_curr->ifun);
+    /* A jump held in EX by memory is trained once it leaves */
+    if (icode == I_JMP && id_ex_curr->ifun != C_YES && !wrong_path &&
+	!dmem_busy)
+	bp_update(bpred, id_ex_curr->bp_index, cnd);
+
+    ex_mem_next->icode = icode;
+    ex_mem_next->ifun = id_ex_curr->ifun;
+    ex_mem_next->takebranch = cnd;
+    ex_mem_next->vale = compute_alu(alufun, alua, alub);
+    ex_mem_next->vala = id_ex_curr->vala;
+    ex_mem_next->deste = (icode == I_RRMOVQ && !cnd) ?
+	REG_NONE : id_ex_curr->deste;
+    ex_mem_next->destm = id_ex_curr->destm;
+    ex_mem_next->srca = id_ex_curr->srca;
+    ex_mem_next->status = id_ex_curr->status;
+    ex_mem_next->stage_pc = id_ex_curr->stage_pc;
+    ex_mem_next->predpc = id_ex_curr->predpc;
+    ex_mem_next->bp_index = id_ex_curr->bp_index;
+    ex_mem_next->bp_ras = id_ex_curr->bp_ras;
 
     /* logging functions, do not change these */
-    if (id_ex_curr->icode == I_JMP) {
+    if (dumpfile && id_ex_curr->icode == I_JMP) {
         sim_log("\tExecute: instr = %s, cc = %s, branch %staken\n",
             iname(HPACK(id_ex_curr->icode, id_ex_curr->ifun)),
-            cc_name(cc),
+            cc_name(get_cc(&cc)),
             ex_mem_next->takebranch ? "" : "not ");
     }
     sim_log("\tExecute: ALU: %c 0x%llx 0x%llx --> 0x%llx\n",
         op_name(alufun), alua, alub, ex_mem_next->vale);
-    if (setcc) {
-	    sim_log("\tExecute: New cc=%s\n", cc_name(cc_in));
+    if (dumpfile && setcc) {
+	    sim_log("\tExecute: New cc=%s\n", cc_name(get_cc(&cc_in)));
+    }
+}
+
+/************************** Split stages ***************************
+ * With -S, fetch and memory can take more than one cycle each, with
+ * instructions passing through fetch_q and mem_q.  The first cycle of
+ * M checks the address, so that exceptions stop what follows as soon
+ * as possible, and the last reads or writes memory
+ *******************************************************************/
+void do_split_stages()
+{
+    int i;
+    if (fetch_depth > 1) {
+	*if_id_next = *fetch_q_curr[fetch_depth-2];
+	for (i = fetch_depth-2; i > 0; i--)
+	    *fetch_q_next[i] = *fetch_q_curr[i-1];
+    }
+    if (mem_depth > 1) {
+	ex_mem_ptr p = mem_q_next[0];
+	word_t addr, sink;
+	for (i = mem_depth-2; i > 0; i--)
+	    *mem_q_next[i] = *mem_q_curr[i-1];
+	*p = *ex_mem_curr;
+	addr = (p->icode == I_POPQ || p->icode == I_RET) ? p->vala : p->vale;
+	if (USES_MEM(p) && p->status == STAT_AOK &&
+	    !get_word_val(mem, addr, &sink))
+	    p->status = STAT_ADR;
     }
 }
 
 /*************************** Memory stage **************************
- * TODO: update [*mem_wb_next, mem_addr, mem_data, mem_write]
- * you may find these functions useful: 
- * get_word_val()
- * 
- * The pending writeback updates will occur in update_state()
+ * Read or write data memory.  The write occurs in update_state()
  *******************************************************************/
 void do_mem_stage()
 {
-    /* dummy placeholders, replace them with your implementation */
-    mem_addr = 0;
-    mem_data = 0;
-    mem_write = FALSE;
-    /* some useful variables for logging purpose */
-    bool_t read = FALSE;
+    byte_t icode = m_in_curr->icode;
+    bool_t read = icode == I_MRMOVQ || icode == I_POPQ || icode == I_RET;
+    word_t valm = 0;
+
+    /* Writes on the wrong path are suppressed */
+    mem_write = (icode == I_RMMOVQ || icode == I_PUSHQ || icode == I_CALL) &&
+	!ret_mispredict();
+    mem_addr = (icode == I_POPQ || icode == I_RET) ?
+	m_in_curr->vala : m_in_curr->vale;
+    mem_data = m_in_curr->vala;
     dmem_error = FALSE;
+    if (read)
+	dmem_error = !get_word_val(mem, mem_addr, &valm);
+    if (mem_write) {
+	/* Do a read of address just to check validity */
+	word_t sink;
+	dmem_error = !get_word_val(mem, mem_addr, &sink);
+    }
+
+    /* An access taking more than one cycle, or missing in the data
+       cache, holds the instruction in M, and its write, until done */
+    dmem_busy = FALSE;
+    if ((read || mem_write) && !dmem_error &&
+	m_in_curr->status == STAT_AOK && !ret_mispredict()) {
+	if (dmem_wait < 0) {
+	    dmem_wait = op_lat[read ? LAT_LOAD : LAT_STORE] - 1;
+	    if (dcache)
+		dmem_wait += cache_access(dcache, mem_addr, 8, mem_write);
+	} else if (dmem_wait > 0)
+	    dmem_wait--;
+	dmem_busy = dmem_wait > 0;
+	if (dmem_busy)
+	    mem_write = FALSE;
+    }
+
+    mem_wb_next->icode = icode;
+    mem_wb_next->ifun = m_in_curr->ifun;
+    mem_wb_next->vale = m_in_curr->vale;
+    mem_wb_next->valm = valm;
+    mem_wb_next->deste = m_in_curr->deste;
+    mem_wb_next->destm = m_in_curr->destm;
+    mem_wb_next->status = dmem_error ? STAT_ADR : m_in_curr->status;
+    mem_wb_next->stage_pc = m_in_curr->stage_pc;
+    mem_wb_next->predpc = m_in_curr->predpc;
+    mem_wb_next->bp_ras = m_in_curr->bp_ras;
 
     /* logging function, do not change this */
     if (read && !dmem_error) {
@@ -868,25 +1716,992 @@ p_stat_t pipe_cntl(char *name, word_t stall, word_t bubble)
     }
 }
 
+/* Does instruction p, which has not finished reading memory, load a
+   register used by the instruction in decode? */
+#define LOADS_SRC(p) ((p)->destm != REG_NONE &&			\
+		      ((p)->destm == id_ex_next->srca ||		\
+		       (p)->destm == id_ex_next->srcb))
+
+/* Is there a return without prediction between decode and WB? */
+static bool_t ret_pending()
+{
+    int i;
+    for (i = 0; i < fetch_depth-1; i++)
+	if (RET_UNPREDICTED(fetch_q_curr[i]))
+	    return TRUE;
+    for (i = 0; i < mem_depth-1; i++)
+	if (RET_UNPREDICTED(mem_q_curr[i]))
+	    return TRUE;
+    return RET_UNPREDICTED(if_id_curr) || RET_UNPREDICTED(id_ex_curr) ||
+	RET_UNPREDICTED(ex_mem_curr);
+}
+
 /******************** Pipeline Register Control ********************
- * TODO: implement stalling or insert a bubble for different stages
- * by modifying the control operations of the pipeline registers
- * you may find the util function pipe_cntl() useful
- * 
- * update_pipes() will handle the real control behavior later
- * make sure you have a working PIPE before implementing this
+ * Stall for load/use hazards and unpredicted returns, and cancel
+ * instructions after a mispredicted jump or return or an exception.
+ * The return-address stack is updated only by instructions that
+ * leave fetch, and is restored when they are cancelled
  *******************************************************************/
 void do_stall_check()
 {
-    /* dummy placeholders to show the usage of pipe_cntl() */
-    pc_state->op = pipe_cntl("PC", FALSE, FALSE);
-    if_id_state->op = pipe_cntl("ID", FALSE, FALSE);
-    id_ex_state->op = pipe_cntl("EX", FALSE, FALSE);
-    ex_mem_state->op = pipe_cntl("MEM", FALSE, FALSE);
-    mem_wb_state->op = pipe_cntl("WB", FALSE, FALSE);
+    bool_t load_use = LOADS_SRC(id_ex_curr);
+    bool_t ret_stall = ret_pending();
+    bool_t jump_miss = id_ex_curr->icode == I_JMP &&
+	JUMP_TARGET(ex_mem_next) != id_ex_curr->predpc;
+    bool_t exception = mem_exception();
+    int i;
+
+    /* Loaded values can be forwarded only from the last cycle of M */
+    if (mem_depth > 1)
+	load_use |= LOADS_SRC(ex_mem_curr);
+    for (i = 0; i < mem_depth-2; i++)
+	load_use |= LOADS_SRC(mem_q_curr[i]);
+
+    if (ret_mispredict()) {
+	/* Cancel the instructions in D, E and M, which are on the
+	   wrong path, and keep the one fetched from the return address */
+	pc_state->op = P_LOAD;
+	for (i = 0; i < fetch_depth-1; i++)
+	    fetch_q_state[i]->op = P_BUBBLE;
+	if_id_state->op = P_BUBBLE;
+	f_out_state->op = P_LOAD;
+	id_ex_state->op = P_BUBBLE;
+	ex_mem_state->op = P_BUBBLE;
+	for (i = 0; i < mem_depth-1; i++)
+	    mem_q_state[i]->op = P_BUBBLE;
+	mem_wb_state->op = P_BUBBLE;
+	bp_ras_restore(bpred, mem_wb_curr->bp_ras);
+    } else {
+	pc_state->op = pipe_cntl("PC", load_use || ret_stall, FALSE);
+	for (i = 0; i < fetch_depth-1; i++)
+	    fetch_q_state[i]->op = pipe_cntl("F", load_use, jump_miss);
+	if_id_state->op = pipe_cntl("ID", load_use, jump_miss);
+	/* Instructions fetched behind an unpredicted return are discarded */
+	f_out_state->op = pipe_cntl("F", load_use,
+				    jump_miss || (!load_use && ret_stall));
+	id_ex_state->op = pipe_cntl("EX", FALSE, jump_miss || load_use);
+	ex_mem_state->op = pipe_cntl("MEM", FALSE, exception);
+	for (i = 0; i < mem_depth-1; i++)
+	    mem_q_state[i]->op = P_LOAD;
+	mem_wb_state->op = pipe_cntl("WB", EXCEPTION(mem_wb_curr->status),
+				     FALSE);
+	if (jump_miss)
+	    bp_ras_restore(bpred, id_ex_curr->bp_ras);
+    }
+
+    if (dmem_busy) {
+	/* Hold F through M until the data access completes */
+	sim_stall_stage(IF_STAGE);
+	for (i = 0; i < fetch_depth-1; i++)
+	    fetch_q_state[i]->op = P_STALL;
+	sim_stall_stage(ID_STAGE);
+	sim_stall_stage(EX_STAGE);
+	sim_stall_stage(MEM_STAGE);
+	for (i = 0; i < mem_depth-1; i++)
+	    mem_q_state[i]->op = P_STALL;
+	if (!EXCEPTION(mem_wb_curr->status))
+	    sim_bubble_stage(WB_STAGE);
+	dmem_stalls++;
+    } else if (ex_busy) {
+	/* Hold F through E until the operation in EX completes */
+	sim_stall_stage(IF_STAGE);
+	for (i = 0; i < fetch_depth-1; i++)
+	    fetch_q_state[i]->op = P_STALL;
+	sim_stall_stage(ID_STAGE);
+	sim_stall_stage(EX_STAGE);
+	sim_bubble_stage(MEM_STAGE);
+	ex_stalls++;
+    } else if (imem_miss) {
+	/* PC holds the address to fetch again */
+	if (f_out_state->op == P_LOAD)
+	    f_out_state->op = P_BUBBLE;
+	icache_stalls++;
+    }
+    if (m_in_state->op != P_STALL)
+	dmem_wait = -1;
+    if (id_ex_state->op != P_STALL)
+	ex_wait = -1;
+
+    if (f_out_state->op == P_LOAD) {
+	/* The next fetch is a new access, even from the same address */
+	icache_pc = -1;
+	if (f_out_next->icode == I_CALL)
+	    bp_call(bpred, f_out_next->valp);
+	else if (f_out_next->icode == I_RET && f_out_next->predpc != BP_NONE)
+	    bp_ret(bpred);
+	f_out_next->bp_ras = bp_ras_save(bpred);
+    }
+}
+
+
+/************************** Wide pipeline **************************
+ * With -w n, up to n instructions move through each stage per
+ * cycle, in order.  Stages run from WB back to IF, each taking the
+ * group in its pipe register and producing the group for the next
+ * stage.  Completing instructions write the registers and memory as
+ * they leave WB, before decode reads the register file, so operands
+ * are forwarded only from the groups leaving EX and MEM.
+ *
+ * A group in decode issues its longest prefix in which no
+ * instruction uses a register written by an earlier one of the
+ * prefix or an instruction loading it in EX, tests the condition
+ * codes after an earlier one sets them, or accesses memory after an
+ * earlier one does (there is one data memory port).  The rest wait,
+ * and fetch waits for them.  A fetch group ends at an instruction
+ * that changes the flow of control or has an exception.  Mispredicted
+ * jumps are found in EX and returns in MEM, as in the scalar
+ * pipeline, giving the same penalties
+ *******************************************************************/
+
+#ifdef __GNUC__
+static wide_regs_rec wide_regs __attribute__((aligned(64)));
+#else
+static wide_regs_rec wide_regs;
+#endif
+
+static if_id_group *w_if_id_curr, *w_if_id_next;
+static id_ex_group *w_id_ex_curr, *w_id_ex_next;
+static ex_mem_group *w_ex_mem_curr, *w_ex_mem_next;
+static mem_wb_group *w_mem_wb_curr, *w_mem_wb_next;
+/* Address of next fetch */
+static word_t w_pc;
+
+/* Cycles in which each number of instructions completed */
+word_t wide_done[MAX_WIDTH+1];
+
+static void clear_wide()
+{
+    memset(&wide_regs, 0, sizeof(wide_regs));
+    w_if_id_curr = &wide_regs.if_id[0];
+    w_if_id_next = &wide_regs.if_id[1];
+    w_id_ex_curr = &wide_regs.id_ex[0];
+    w_id_ex_next = &wide_regs.id_ex[1];
+    w_ex_mem_curr = &wide_regs.ex_mem[0];
+    w_ex_mem_next = &wide_regs.ex_mem[1];
+    w_mem_wb_curr = &wide_regs.mem_wb[0];
+    w_mem_wb_next = &wide_regs.mem_wb[1];
+    w_mem_wb_curr->store = w_mem_wb_next->store = -1;
+    w_pc = 0;
+    memset(wide_done, 0, sizeof(wide_done));
+}
+
+#define SWAP(a, b) { void *t = (a); (a) = (b); (b) = t; }
+
+/* Fetch group of up to pipe_width instructions from w_pc into g,
+   ending at a change of control flow or an exception */
+static void fetch_group(if_id_group *g)
+{
+    int n = 0;
+    while (n < pipe_width) {
+	if_id_ptr p = &g->slot[n++];
+	word_t predpc;
+	fetch_instr(w_pc, p);
+	predpc = predict_pc(p);
+	sim_log("\tFetch: f_pc = 0x%llx, f_instr = %s\n",
+		w_pc, iname(HPACK(p->icode, p->ifun)));
+	w_pc = predpc == BP_NONE ? p->valp : predpc;
+	if (p->icode == I_CALL)
+	    bp_call(bpred, p->valp);
+	else if (p->icode == I_RET && predpc != BP_NONE)
+	    bp_ret(bpred);
+	p->bp_ras = bp_ras_save(bpred);
+	if (p->status != STAT_AOK || p->icode == I_CALL ||
+	    p->icode == I_RET || predpc != p->valp)
+	    break;
+    }
+    g->count = n;
+}
+
+/* Value of register src for decode, forwarded from the groups leaving
+   EX and MEM.  Return FALSE if it is still being loaded */
+static bool_t wide_forward(byte_t src, word_t *valp)
+{
+    int i;
+    *valp = get_reg_val(reg, src);
+    if (src == REG_NONE)
+	return TRUE;
+    /* Latest writer wins, and for popq %rsp the loaded value */
+    for (i = w_ex_mem_next->count-1; i >= 0; i--) {
+	ex_mem_ptr p = &w_ex_mem_next->slot[i];
+	if (src == p->destm)
+	    return FALSE;
+	if (src == p->deste) {
+	    *valp = p->vale;
+	    return TRUE;
+	}
+    }
+    for (i = w_mem_wb_next->count-1; i >= 0; i--) {
+	mem_wb_ptr p = &w_mem_wb_next->slot[i];
+	if (src == p->destm) {
+	    *valp = p->valm;
+	    return TRUE;
+	}
+	if (src == p->deste) {
+	    *valp = p->vale;
+	    return TRUE;
+	}
+    }
+    return TRUE;
+}
+
+/* Does register r conflict with register written in group g? */
+static bool_t group_writes(id_ex_group *g, byte_t r)
+{
+    int i;
+    if (r == REG_NONE)
+	return FALSE;
+    for (i = 0; i < g->count; i++)
+	if (g->slot[i].deste == r || g->slot[i].destm == r)
+	    return TRUE;
+    return FALSE;
+}
+
+/*
+  Run wide pipeline for one cycle, completing at most max_instr
+  instructions.  Return status of the last one completed, or STAT_BUB
+  if none, and set *donep to the number completed
+*/
+static byte_t wide_step(word_t max_instr, word_t ccount, word_t *donep)
+{
+    byte_t wb_stat = STAT_BUB;
+    word_t done = 0;
+    bool_t redirect = FALSE;
+    bool_t exception = FALSE;
+    bool_t ret_wait = FALSE;
+    word_t redirect_pc = 0;
+    bool_t group_cc = FALSE, group_mem = FALSE;
+    int i, n;
+
+    if (dumpfile) {
+	sim_log("\nCycle %lld. CC=%s, Stat=%s\n", ccount,
+		cc_name(get_cc(&cc)), stat_name(status));
+	sim_log("F: predPC = 0x%llx\n", w_pc);
+	sim_log("D:");
+	for (i = 0; i < w_if_id_curr->count; i++)
+	    sim_log(" %s@0x%llx", iname(HPACK(w_if_id_curr->slot[i].icode,
+					      w_if_id_curr->slot[i].ifun)),
+		    w_if_id_curr->slot[i].stage_pc);
+	sim_log("\nE:");
+	for (i = 0; i < w_id_ex_curr->count; i++)
+	    sim_log(" %s@0x%llx", iname(HPACK(w_id_ex_curr->slot[i].icode,
+					      w_id_ex_curr->slot[i].ifun)),
+		    w_id_ex_curr->slot[i].stage_pc);
+	sim_log("\nM:");
+	for (i = 0; i < w_ex_mem_curr->count; i++)
+	    sim_log(" %s@0x%llx", iname(HPACK(w_ex_mem_curr->slot[i].icode,
+					      w_ex_mem_curr->slot[i].ifun)),
+		    w_ex_mem_curr->slot[i].stage_pc);
+	sim_log("\nW:");
+	for (i = 0; i < w_mem_wb_curr->count; i++)
+	    sim_log(" %s@0x%llx", iname(HPACK(w_mem_wb_curr->slot[i].icode,
+					      w_mem_wb_curr->slot[i].ifun)),
+		    w_mem_wb_curr->slot[i].stage_pc);
+	sim_log("\n");
+    }
+
+    /* Write back: complete instructions in order */
+    for (i = 0; i < w_mem_wb_curr->count && done < max_instr; i++) {
+	mem_wb_ptr p = &w_mem_wb_curr->slot[i];
+	if (p->status == STAT_AOK) {
+	    if (i == w_mem_wb_curr->store) {
+		sim_log("\tWrote 0x%llx to address 0x%llx\n",
+			w_mem_wb_curr->store_data, w_mem_wb_curr->store_addr);
+		set_word_val(mem, w_mem_wb_curr->store_addr,
+			     w_mem_wb_curr->store_data);
+	    }
+	    if (p->deste != REG_NONE) {
+		sim_log("\tWriteback: Wrote 0x%llx to register %s\n",
+			p->vale, reg_name(p->deste));
+		set_reg_val(reg, p->deste, p->vale);
+	    }
+	    if (p->destm != REG_NONE) {
+		sim_log("\tWriteback: Wrote 0x%llx to register %s\n",
+			p->valm, reg_name(p->destm));
+		set_reg_val(reg, p->destm, p->valm);
+	    }
+	}
+	starting_up = 0;
+	instructions++;
+	done++;
+	if (prof)
+	    profile_instr(prof, p->stage_pc, p->icode);
+	if (checker) {
+	    if (p->status == STAT_AOK) {
+		check_reg(checker, p->deste, p->vale);
+		check_reg(checker, p->destm, p->valm);
+	    }
+	    check_retire(checker, p->stage_pc, p->status);
+	}
+	wb_stat = status = p->status;
+	if (p->status != STAT_AOK)
+	    break;
+    }
+    if (done > 0 || !starting_up)
+	cycles++;
+    wide_done[done]++;
+    *donep = done;
+    /* Stop at an exception or the instruction limit */
+    if (done == max_instr || (wb_stat != STAT_AOK && wb_stat != STAT_BUB))
+	return wb_stat;
+    max_instr -= done;
+
+    /* Memory */
+    w_mem_wb_next->count = w_ex_mem_curr->count;
+    w_mem_wb_next->store = -1;
+    for (i = 0; i < w_ex_mem_curr->count; i++) {
+	ex_mem_ptr p = &w_ex_mem_curr->slot[i];
+	mem_wb_ptr q = &w_mem_wb_next->slot[i];
+	bool_t read = p->icode == I_MRMOVQ || p->icode == I_POPQ ||
+	    p->icode == I_RET;
+	bool_t write = p->icode == I_RMMOVQ || p->icode == I_PUSHQ ||
+	    p->icode == I_CALL;
+	word_t addr = (p->icode == I_POPQ || p->icode == I_RET) ?
+	    p->vala : p->vale;
+	bool_t error = FALSE;
+	q->valm = 0;
+	if (read) {
+	    error = !get_word_val(mem, addr, &q->valm);
+	    if (!error)
+		sim_log("\tMemory: Read 0x%llx from 0x%llx\n", q->valm, addr);
+	}
+	if (write) {
+	    /* Do a read of address just to check validity */
+	    word_t sink;
+	    error = !get_word_val(mem, addr, &sink);
+	    w_mem_wb_next->store = i;
+	    w_mem_wb_next->store_addr = addr;
+	    w_mem_wb_next->store_data = p->vala;
+	}
+	q->icode = p->icode;
+	q->ifun = p->ifun;
+	q->vale = p->vale;
+	q->deste = p->deste;
+	q->destm = p->destm;
+	q->status = error ? STAT_ADR : p->status;
+	q->stage_pc = p->stage_pc;
+	q->predpc = p->predpc;
+	q->bp_ras = p->bp_ras;
+	exception |= EXCEPTION(q->status);
+	if (p->icode == I_RET && q->status == STAT_AOK) {
+	    bpred->rets++;
+	    if (p->predpc == BP_NONE)
+		bpred->ret_stalls++;
+	    else if (q->valm != p->predpc) {
+		/* Cancel everything fetched after the return */
+		bpred->ret_misses++;
+		bp_ras_restore(bpred, p->bp_ras);
+	    }
+	    if (q->valm != p->predpc) {
+		redirect = TRUE;
+		redirect_pc = q->valm;
+	    }
+	}
+    }
+
+    /* Execute.  Instructions after an exception do not proceed */
+    w_ex_mem_next->count = 0;
+    for (i = 0; i < w_id_ex_curr->count && !redirect && !exception; i++) {
+	id_ex_ptr p = &w_id_ex_curr->slot[i];
+	ex_mem_ptr q = &w_ex_mem_next->slot[w_ex_mem_next->count++];
+	alu_t alufun;
+	word_t alua, alub;
+	alu_inputs(p, &alufun, &alua, &alub);
+	/* Instructions past the limit do not change the condition codes */
+	if (SETS_CC(p) && w_mem_wb_next->count + i < max_instr) {
+	    set_cc_op(&cc, alufun, alua, alub);
+	    if (dumpfile)
+		sim_log("\tExecute: New cc=%s\n", cc_name(get_cc(&cc)));
+	}
+	q->icode = p->icode;
+	q->ifun = p->ifun;
+	q->takebranch = (p->icode == I_JMP || p->icode == I_RRMOVQ) &&
+	    cond_holds(get_cc(&cc), p->ifun);
+	q->vale = compute_alu(alufun, alua, alub);
+	q->vala = p->vala;
+	q->deste = (p->icode == I_RRMOVQ && !q->takebranch) ?
+	    REG_NONE : p->deste;
+	q->destm = p->destm;
+	q->srca = p->srca;
+	q->status = p->status;
+	q->stage_pc = p->stage_pc;
+	q->predpc = p->predpc;
+	q->bp_index = p->bp_index;
+	q->bp_ras = p->bp_ras;
+	exception |= EXCEPTION(q->status);
+	if (p->icode == I_JMP) {
+	    if (prof && q->takebranch)
+		profile_taken(prof, q->stage_pc);
+	    if (p->ifun != C_YES) {
+		bp_update(bpred, p->bp_index, q->takebranch);
+		bpred->jumps++;
+	    }
+	    if (JUMP_TARGET(q) != p->predpc) {
+		/* Cancel rest of group, and everything fetched after it */
+		bpred->jump_misses++;
+		bp_ras_restore(bpred, p->bp_ras);
+		redirect = TRUE;
+		redirect_pc = JUMP_TARGET(q);
+	    }
+	}
+    }
+
+    /* Decode, issuing the longest prefix of the group that can go */
+    w_id_ex_next->count = 0;
+    w_if_id_next->count = 0;
+    for (i = 0; i < w_if_id_curr->count && !redirect; i++) {
+	if_id_ptr p = &w_if_id_curr->slot[i];
+	id_ex_ptr q = &w_id_ex_next->slot[w_id_ex_next->count];
+	word_t vala, valb;
+	decode_regs(p, q);
+	if (group_writes(w_id_ex_next, q->srca) ||
+	    group_writes(w_id_ex_next, q->srcb) ||
+	    (USES_CC(p) && group_cc) || (USES_MEM(p) && group_mem) ||
+	    !wide_forward(q->srca, &vala) || !wide_forward(q->srcb, &valb))
+	    break;
+	group_cc |= SETS_CC(p);
+	group_mem |= USES_MEM(p);
+	q->icode = p->icode;
+	q->ifun = p->ifun;
+	q->valc = p->valc;
+	q->vala = (p->icode == I_CALL || p->icode == I_JMP) ? p->valp : vala;
+	q->valb = valb;
+	q->status = p->status;
+	q->stage_pc = p->stage_pc;
+	q->predpc = p->predpc;
+	q->bp_index = p->bp_index;
+	q->bp_ras = p->bp_ras;
+	w_id_ex_next->count++;
+    }
+    if (!redirect) {
+	for (n = 0; i < w_if_id_curr->count; i++, n++)
+	    w_if_id_next->slot[n] = w_if_id_curr->slot[i];
+	w_if_id_next->count = n;
+    }
+
+    /* A return without prediction holds up fetch until it leaves MEM */
+    for (i = 0; i < w_if_id_curr->count; i++)
+	ret_wait |= RET_UNPREDICTED(&w_if_id_curr->slot[i]);
+    for (i = 0; i < w_id_ex_curr->count; i++)
+	ret_wait |= RET_UNPREDICTED(&w_id_ex_curr->slot[i]);
+
+    /* Fetch, when decode has issued its whole group */
+    if (redirect)
+	w_pc = redirect_pc;
+    else if (w_if_id_next->count == 0 && !ret_wait)
+	fetch_group(w_if_id_next);
+
+    SWAP(w_if_id_curr, w_if_id_next);
+    SWAP(w_id_ex_curr, w_id_ex_next);
+    SWAP(w_ex_mem_curr, w_ex_mem_next);
+    SWAP(w_mem_wb_curr, w_mem_wb_next);
+    return wb_stat;
+}
+
+/********************** Out-of-order back end **********************
+ * With -o, the groups fetched as in the wide pipeline are renamed
+ * into a reorder buffer, up to pipe_width instructions per cycle.
+ * The register alias table maps each register, and the condition
+ * codes, to the latest instruction in flight that writes it.  Each
+ * cycle the oldest instructions whose operands are ready leave their
+ * reservation stations, up to pipe_width in all with at most one jump
+ * and one memory access, and their results can be used op_lat cycles
+ * later.  A load waits until every earlier store has its address,
+ * then takes the data of the latest earlier store to the same
+ * address, or reads memory; one partly overlapping an earlier store
+ * waits for it to retire.  Jumps and returns are checked as they
+ * complete, cancelling everything after them when mispredicted.
+ * Instructions retire in order, up to pipe_width per cycle, making
+ * their register, memory and condition code writes.  A store that
+ * retires over the bytes of an instruction fetched after it cancels
+ * everything after it, and fetch starts again from its successor
+ *******************************************************************/
+
+static rob_ptr rob = NULL;
+/* Oldest instruction in flight, and next to be renamed */
+static word_t rob_head, rob_tail;
+#define ROB_ENTRY(seq) (&rob[(seq) % ooo_rob])
+
+/* Load/store queue: memory instructions in flight, in program order */
+static word_t *lsq = NULL;
+static word_t lsq_head, lsq_tail;
+
+/* Instructions waiting in the reservation stations of each unit */
+static int rs_used[FU_COUNT];
+
+/* Register alias table */
+static word_t rat_tag[REG_NONE];
+static bool_t rat_m[REG_NONE];
+static word_t rat_cc;
+
+/* Fetched instructions waiting to be renamed */
+static if_id_group o_fetched;
+/* Fetch waits for an unpredicted return or an exception */
+static bool_t fetch_wait;
+/* Current cycle */
+static word_t o_now;
+
+/* Cycles renaming stalled with full ROB, LSQ and stations */
+word_t rob_full, lsq_full, rs_full[FU_COUNT];
+word_t o_loads, o_forwarded;
+/* Sum over cycles of instructions in flight */
+word_t rob_occupancy;
+
+static void clear_ooo()
+{
+    int r;
+    free((void *) rob);
+    free((void *) lsq);
+    rob = NULL;
+    lsq = NULL;
+    if (ooo_rob > 0) {
+	rob = (rob_ptr) calloc(ooo_rob, sizeof(rob_ele));
+	lsq = (word_t *) calloc(ooo_lsq, sizeof(word_t));
+    }
+    rob_head = rob_tail = 0;
+    lsq_head = lsq_tail = 0;
+    memset(rs_used, 0, sizeof(rs_used));
+    for (r = 0; r < REG_NONE; r++)
+	rat_tag[r] = NO_TAG;
+    rat_cc = NO_TAG;
+    o_fetched.count = 0;
+    fetch_wait = FALSE;
+    o_now = 0;
+    rob_full = lsq_full = 0;
+    memset(rs_full, 0, sizeof(rs_full));
+    o_loads = o_forwarded = rob_occupancy = 0;
+}
+
+/* Unit executing decoded instruction d.  FU_NONE if there is nothing
+   to execute */
+static fu_t ooo_unit(id_ex_ptr d)
+{
+    if (d->status != STAT_AOK)
+	return FU_NONE;
+    if (USES_MEM(d))
+	return FU_MEM;
+    if (d->icode == I_JMP)
+	return d->ifun == C_YES ? FU_NONE : FU_BRANCH;
+    if (d->icode == I_RRMOVQ || d->icode == I_IRMOVQ ||
+	d->icode == I_ALU || d->icode == I_IADDQ)
+	return FU_ALU;
+    return FU_NONE;
+}
+
+/* Make instruction e the latest writer of its destinations */
+static void rat_claim(rob_ptr e)
+{
+    if (e->d.deste != REG_NONE) {
+	rat_tag[e->d.deste] = e->seq;
+	rat_m[e->d.deste] = FALSE;
+    }
+    /* For popq %rsp, the loaded value wins */
+    if (e->d.destm != REG_NONE) {
+	rat_tag[e->d.destm] = e->seq;
+	rat_m[e->d.destm] = TRUE;
+    }
+    if (SETS_CC(&e->d) && e->fu != FU_NONE)
+	rat_cc = e->seq;
+}
+
+/* Rename fetched instruction p into the reorder buffer.  Return FALSE
+   if there is no room for it */
+static bool_t ooo_rename(if_id_ptr p)
+{
+    rob_ptr e = ROB_ENTRY(rob_tail);
+    byte_t src[2];
+    int k;
+
+    if (rob_tail - rob_head == ooo_rob) {
+	rob_full++;
+	return FALSE;
+    }
+    decode_regs(p, &e->d);
+    e->d.icode = p->icode;
+    e->d.ifun = p->ifun;
+    e->d.status = p->status;
+    e->fu = ooo_unit(&e->d);
+    if (e->fu != FU_NONE && rs_used[e->fu] == ooo_rs) {
+	rs_full[e->fu]++;
+	return FALSE;
+    }
+    if (e->fu == FU_MEM && lsq_tail - lsq_head == ooo_lsq) {
+	lsq_full++;
+	return FALSE;
+    }
+
+    e->seq = rob_tail++;
+    e->d.valc = p->valc;
+    e->d.stage_pc = p->stage_pc;
+    e->d.predpc = p->predpc;
+    e->d.bp_index = p->bp_index;
+    e->d.bp_ras = p->bp_ras;
+    /* A conditional move that fails leaves its destination as it was,
+       so it also reads the old value, as operand B */
+    src[0] = e->d.srca;
+    src[1] = USES_CC(p) && p->icode == I_RRMOVQ ? p->rb : e->d.srcb;
+    for (k = 0; k < 2; k++) {
+	word_t *valp = k == 0 ? &e->d.vala : &e->d.valb;
+	e->src_tag[k] = src[k] == REG_NONE ? NO_TAG : rat_tag[src[k]];
+	e->src_m[k] = src[k] == REG_NONE ? FALSE : rat_m[src[k]];
+	*valp = e->src_tag[k] == NO_TAG ? get_reg_val(reg, src[k]) : 0;
+    }
+    /* Calls push valP, and jumps keep it in case they are not taken */
+    if (p->icode == I_CALL || p->icode == I_JMP)
+	e->d.vala = p->valp;
+    e->cc_tag = USES_CC(p) ? rat_cc : NO_TAG;
+    e->vale = e->valm = 0;
+    e->cnd = FALSE;
+    e->mispredicted = FALSE;
+    if (e->fu == FU_NONE) {
+	e->issued = e->resolved = TRUE;
+	e->e_ready = e->m_ready = o_now;
+    } else {
+	e->issued = FALSE;
+	e->resolved = p->icode != I_JMP && p->icode != I_RET;
+	rs_used[e->fu]++;
+    }
+    if (e->fu == FU_MEM)
+	lsq[lsq_tail++ % ooo_lsq] = e->seq;
+    rat_claim(e);
+    return TRUE;
+}
+
+/* Capture operand k of e once its producer has it.  Return FALSE if
+   not yet available.  A producer that has retired left it in the
+   register file, as no later instruction before e writes it */
+static bool_t ooo_operand(rob_ptr e, int k)
+{
+    word_t tag = e->src_tag[k];
+    word_t *valp = k == 0 ? &e->d.vala : &e->d.valb;
+    if (tag == NO_TAG)
+	return TRUE;
+    if (tag < rob_head) {
+	byte_t src = k == 0 ? e->d.srca :
+	    (e->d.icode == I_RRMOVQ ? e->d.deste : e->d.srcb);
+	*valp = get_reg_val(reg, src);
+    } else {
+	rob_ptr p = ROB_ENTRY(tag);
+	if (!p->issued || (e->src_m[k] ? p->m_ready : p->e_ready) > o_now)
+	    return FALSE;
+	*valp = e->src_m[k] ? p->valm : p->vale;
+    }
+    e->src_tag[k] = NO_TAG;
+    return TRUE;
+}
 
+/* Set *ccp to the condition codes seen by e.  Return FALSE if not yet
+   available */
+static bool_t ooo_cc(rob_ptr e, cc_t *ccp)
+{
+    rob_ptr p;
+    *ccp = get_cc(&cc);
+    if (e->cc_tag == NO_TAG || e->cc_tag < rob_head)
+	return TRUE;
+    p = ROB_ENTRY(e->cc_tag);
+    if (!p->issued || p->e_ready > o_now)
+	return FALSE;
+    *ccp = p->cc;
+    return TRUE;
 }
 
+/* Check load e reading addr against the earlier stores in flight.
+   Return FALSE if it must wait, else set *fwdp to the store supplying
+   its data, or NULL if it reads memory */
+static bool_t ooo_disambiguate(rob_ptr e, word_t addr, rob_ptr *fwdp)
+{
+    bool_t wait = FALSE;
+    word_t i;
+    *fwdp = NULL;
+    for (i = lsq_head; i < lsq_tail && lsq[i % ooo_lsq] < e->seq; i++) {
+	rob_ptr s = ROB_ENTRY(lsq[i % ooo_lsq]);
+	if (s->d.icode != I_RMMOVQ && s->d.icode != I_PUSHQ &&
+	    s->d.icode != I_CALL)
+	    continue;
+	if (!s->issued)
+	    return FALSE;
+	if (s->addr == addr) {
+	    *fwdp = s;
+	    wait = FALSE;
+	} else if ((uword_t) (s->addr - addr + 7) < 15) {
+	    /* Words overlap in part */
+	    *fwdp = NULL;
+	    wait = TRUE;
+	}
+    }
+    return !wait;
+}
+
+/* Start executing e if it can.  Return FALSE if it must wait */
+static bool_t ooo_issue(rob_ptr e)
+{
+    byte_t icode = e->d.icode;
+    alu_t alufun;
+    word_t alua, alub, vale, addr;
+    cc_t ecc;
+    rob_ptr fwd = NULL;
+    bool_t read = icode == I_MRMOVQ || icode == I_POPQ || icode == I_RET;
+    bool_t error = FALSE;
+
+    if (!ooo_operand(e, 0) | !ooo_operand(e, 1) || !ooo_cc(e, &ecc))
+	return FALSE;
+    alu_inputs(&e->d, &alufun, &alua, &alub);
+    vale = compute_alu(alufun, alua, alub);
+    addr = (icode == I_POPQ || icode == I_RET) ? e->d.vala : vale;
+    if (e->fu == FU_MEM && read && !ooo_disambiguate(e, addr, &fwd))
+	return FALSE;
+
+    e->cnd = USES_CC(&e->d) ? cond_holds(ecc, e->d.ifun) : TRUE;
+    e->vale = (icode == I_RRMOVQ && !e->cnd) ? e->d.valb : vale;
+    if (SETS_CC(&e->d))
+	e->cc = compute_cc(alufun, alua, alub);
+    e->e_ready = o_now + (e->fu == FU_BRANCH ? 1 : ALU_LAT(alufun));
+    e->m_ready = e->e_ready;
+    if (e->fu == FU_MEM) {
+	e->addr = addr;
+	if (!read) {
+	    /* Do a read of address just to check validity */
+	    word_t sink;
+	    error = !get_word_val(mem, addr, &sink);
+	    e->m_ready = o_now + op_lat[LAT_STORE];
+	} else {
+	    o_loads++;
+	    if (fwd) {
+		o_forwarded++;
+		e->valm = fwd->d.vala;
+	    } else
+		error = !get_word_val(mem, addr, &e->valm);
+	    e->m_ready = o_now + op_lat[LAT_LOAD];
+	}
+	if (error)
+	    e->d.status = STAT_ADR;
+    }
+    e->issued = TRUE;
+    rs_used[e->fu]--;
+    sim_log("\tIssue: %s@0x%llx\n", iname(HPACK(icode, e->d.ifun)),
+	    e->d.stage_pc);
+    return TRUE;
+}
+
+/* Length in bytes of instruction icode */
+static word_t instr_len(byte_t icode)
+{
+    return 1 + need_regids(icode) + (need_valc(icode) ? 8 : 0);
+}
+
+/* Does the word written at addr overlap instruction icode fetched
+   from pc? */
+static bool_t store_hits_code(word_t addr, word_t pc, byte_t icode)
+{
+    return pc < addr + 8 && addr < pc + instr_len(icode);
+}
+
+/* Was an instruction after store e fetched from the bytes it wrote? */
+static bool_t ooo_code_written(rob_ptr e)
+{
+    word_t s;
+    int i;
+    for (s = e->seq + 1; s < rob_tail; s++) {
+	rob_ptr p = ROB_ENTRY(s);
+	if (store_hits_code(e->addr, p->d.stage_pc, p->d.icode))
+	    return TRUE;
+    }
+    for (i = 0; i < o_fetched.count; i++)
+	if (store_hits_code(e->addr, o_fetched.slot[i].stage_pc,
+			    o_fetched.slot[i].icode))
+	    return TRUE;
+    return FALSE;
+}
+
+/* Cancel every instruction after seq */
+static void ooo_flush(word_t seq)
+{
+    word_t s;
+    int r;
+    for (s = seq + 1; s < rob_tail; s++) {
+	rob_ptr e = ROB_ENTRY(s);
+	if (!e->issued)
+	    rs_used[e->fu]--;
+    }
+    rob_tail = seq + 1;
+    while (lsq_tail > lsq_head && lsq[(lsq_tail-1) % ooo_lsq] > seq)
+	lsq_tail--;
+    for (r = 0; r < REG_NONE; r++)
+	rat_tag[r] = NO_TAG;
+    rat_cc = NO_TAG;
+    for (s = rob_head; s < rob_tail; s++)
+	rat_claim(ROB_ENTRY(s));
+    o_fetched.count = 0;
+    fetch_wait = FALSE;
+}
+
+/*
+  Run out-of-order core for one cycle, retiring at most max_instr
+  instructions.  Results as for wide_step
+*/
+static byte_t ooo_step(word_t max_instr, word_t ccount, word_t *donep)
+{
+    byte_t wb_stat = STAT_BUB;
+    word_t done = 0;
+    word_t s;
+    int issued[FU_COUNT];
+    int i, n;
+
+    if (dumpfile)
+	sim_log("\nCycle %lld. CC=%s, Stat=%s, ROB %lld, LSQ %lld\n", ccount,
+		cc_name(get_cc(&cc)), stat_name(status),
+		rob_tail - rob_head, lsq_tail - lsq_head);
+    rob_occupancy += rob_tail - rob_head;
+
+    /* Retire completed instructions in order */
+    while (rob_head < rob_tail && done < max_instr && done < pipe_width) {
+	rob_ptr e = ROB_ENTRY(rob_head);
+	id_ex_ptr d = &e->d;
+	byte_t deste = (d->icode == I_RRMOVQ && !e->cnd) ?
+	    REG_NONE : d->deste;
+	bool_t wrote = FALSE;
+	if (!e->issued || !e->resolved ||
+	    e->e_ready > o_now || e->m_ready > o_now)
+	    break;
+	if (d->status == STAT_AOK) {
+	    if (d->icode == I_RMMOVQ || d->icode == I_PUSHQ ||
+		d->icode == I_CALL) {
+		sim_log("\tWrote 0x%llx to address 0x%llx\n",
+			d->vala, e->addr);
+		set_word_val(mem, e->addr, d->vala);
+		wrote = TRUE;
+	    }
+	    if (deste != REG_NONE) {
+		sim_log("\tWriteback: Wrote 0x%llx to register %s\n",
+			e->vale, reg_name(deste));
+		set_reg_val(reg, deste, e->vale);
+	    }
+	    if (d->destm != REG_NONE) {
+		sim_log("\tWriteback: Wrote 0x%llx to register %s\n",
+			e->valm, reg_name(d->destm));
+		set_reg_val(reg, d->destm, e->valm);
+	    }
+	    if (SETS_CC(d)) {
+		set_cc(&cc, e->cc);
+		sim_log("\tRetire: New cc=%s\n", cc_name(e->cc));
+	    }
+	    if (d->icode == I_JMP) {
+		if (prof && e->cnd)
+		    profile_taken(prof, d->stage_pc);
+		if (d->ifun != C_YES) {
+		    bp_update(bpred, d->bp_index, e->cnd);
+		    bpred->jumps++;
+		    bpred->jump_misses += e->mispredicted;
+		}
+	    }
+	    if (d->icode == I_RET) {
+		bpred->rets++;
+		if (d->predpc == BP_NONE)
+		    bpred->ret_stalls++;
+		bpred->ret_misses += e->mispredicted;
+	    }
+	}
+	/* Later readers now find the values in the register file */
+	for (i = 0; i < REG_NONE; i++)
+	    if (rat_tag[i] == e->seq)
+		rat_tag[i] = NO_TAG;
+	if (rat_cc == e->seq)
+	    rat_cc = NO_TAG;
+	if (e->fu == FU_MEM)
+	    lsq_head++;
+	rob_head++;
+
+	starting_up = 0;
+	instructions++;
+	done++;
+	if (prof)
+	    profile_instr(prof, d->stage_pc, d->icode);
+	if (checker) {
+	    if (d->status == STAT_AOK) {
+		check_reg(checker, deste, e->vale);
+		check_reg(checker, d->destm, e->valm);
+	    }
+	    check_retire(checker, d->stage_pc, d->status);
+	}
+	wb_stat = status = d->status;
+	if (d->status != STAT_AOK)
+	    break;
+	/* Instructions fetched from the bytes a store wrote are stale,
+	   so fetch starts again after it */
+	if (wrote && ooo_code_written(e)) {
+	    word_t next = d->icode == I_CALL ?
+		d->valc : d->stage_pc + instr_len(d->icode);
+	    sim_log("\tRefetch from 0x%llx after write to 0x%llx\n",
+		    next, e->addr);
+	    ooo_flush(e->seq);
+	    bp_ras_restore(bpred, d->bp_ras);
+	    w_pc = next;
+	    break;
+	}
+    }
+    if (done > 0 || !starting_up)
+	cycles++;
+    wide_done[done]++;
+    *donep = done;
+    /* Stop at an exception or the instruction limit */
+    if (done == max_instr || (wb_stat != STAT_AOK && wb_stat != STAT_BUB)) {
+	o_now++;
+	return wb_stat;
+    }
+
+    /* Check jumps and returns completing, oldest first */
+    for (s = rob_head; s < rob_tail; s++) {
+	rob_ptr e = ROB_ENTRY(s);
+	word_t target;
+	if (e->resolved || !e->issued ||
+	    (e->d.icode == I_RET ? e->m_ready : e->e_ready) > o_now)
+	    continue;
+	e->resolved = TRUE;
+	if (e->d.status != STAT_AOK)
+	    continue;
+	target = e->d.icode == I_RET ? e->valm :
+	    (e->cnd ? e->d.valc : e->d.vala);
+	if (target == e->d.predpc)
+	    continue;
+	sim_log("\tRedirect to 0x%llx after %s@0x%llx\n", target,
+		iname(HPACK(e->d.icode, e->d.ifun)), e->d.stage_pc);
+	e->mispredicted = e->d.predpc != BP_NONE;
+	ooo_flush(s);
+	bp_ras_restore(bpred, e->d.bp_ras);
+	w_pc = target;
+	break;
+    }
+
+    /* Issue, oldest ready instructions first */
+    memset(issued, 0, sizeof(issued));
+    n = 0;
+    for (s = rob_head; s < rob_tail && n < pipe_width; s++) {
+	rob_ptr e = ROB_ENTRY(s);
+	if (e->issued || (e->fu != FU_ALU && issued[e->fu] > 0))
+	    continue;
+	if (ooo_issue(e)) {
+	    issued[e->fu]++;
+	    n++;
+	}
+    }
+
+    /* Rename, in order */
+    for (n = 0; n < o_fetched.count; n++)
+	if (!ooo_rename(&o_fetched.slot[n]))
+	    break;
+    for (i = n; i < o_fetched.count; i++)
+	o_fetched.slot[i-n] = o_fetched.slot[i];
+    o_fetched.count -= n;
+
+    /* Fetch, once the last group has been renamed */
+    if (o_fetched.count == 0 && !fetch_wait) {
+	if_id_ptr last;
+	fetch_group(&o_fetched);
+	last = &o_fetched.slot[o_fetched.count-1];
+	fetch_wait = RET_UNPREDICTED(last) || last->status != STAT_AOK;
+    }
+    o_now++;
+    return wb_stat;
+}
 
 /*
   Run pipeline until one of following occurs:
@@ -904,20 +2719,171 @@ word_t sim_run_pipe(word_t max_instr, word_t max_cycle, byte_t *statusp, cc_t *c
     word_t ccount = 0;
     byte_t run_status = STAT_AOK;
     while (icount < max_instr && ccount < max_cycle) {
-        run_status = sim_step_pipe(max_instr-icount, ccount);
-	if (run_status != STAT_BUB)
-	    icount++;
+	if (ooo_rob > 0) {
+	    word_t done;
+	    run_status = ooo_step(max_instr-icount, ccount, &done);
+	    icount += done;
+	} else if (pipe_width > 1) {
+	    word_t done;
+	    run_status = wide_step(max_instr-icount, ccount, &done);
+	    icount += done;
+	} else {
+	    run_status = sim_step_pipe(max_instr-icount, ccount);
+	    if (run_status != STAT_BUB)
+		icount++;
+	}
 	if (run_status != STAT_AOK && run_status != STAT_BUB)
 	    break;
+	if (checker && check_failed(checker))
+	    break;
 	ccount++;
     }
     if (statusp)
 	*statusp = run_status;
     if (ccp)
-	*ccp = cc;
+	*ccp = get_cc(&cc);
     return icount;
 }
 
+/* Register file and memory when debugging began */
+static mem_t debug_reg0, debug_mem0;
+
+/* arg is the history, whose last step numbers the cycle */
+static stat_t debug_step(void *arg)
+{
+    byte_t e = sim_step_pipe(instr_limit, ((hist_ptr) arg)->last);
+    /* Bubbles are not stopping points */
+    return e == STAT_BUB ? STAT_AOK : e;
+}
+
+/* PC of instruction completing, or -1 for a bubble */
+static word_t debug_pc(void *arg)
+{
+    return mem_wb_curr->status == STAT_BUB ? -1 : mem_wb_curr->stage_pc;
+}
+
+static void debug_show(void *arg, word_t step, stat_t e, bool_t full)
+{
+    printf("Cycle %lld: %lld instructions, Status '%s', CC %s\n",
+	   step, instructions, stat_name(e), cc_name(get_cc(&cc)));
+    if (full) {
+	FILE *df = dumpfile;
+	dumpfile = stdout;
+	tty_report(step);
+	dumpfile = df;
+	printf("Changed Register State:\n");
+	diff_reg(debug_reg0, reg, stdout);
+	printf("Changed Memory State:\n");
+	diff_mem(debug_mem0, mem, stdout);
+    }
+}
+
+/* Record pipe register p.  Its states are recorded with pipe_regs */
+static void hist_add_pipe(hist_ptr h, pipe_ptr p)
+{
+    hist_add_area(h, p, sizeof(pipe_ele));
+}
+
+static void hist_add_cache(hist_ptr h, cache_ptr c)
+{
+    if (!c)
+	return;
+    hist_add_area(h, c, sizeof(cache_rec));
+    hist_add_area(h, c->lines,
+		  c->sets * c->cfg.assoc * sizeof(cache_line_rec));
+}
+
+word_t sim_debug(FILE *in, word_t max_cycle, byte_t *statusp, cc_t *ccp)
+{
+    hist_ptr h = new_history(HIST_WINDOW);
+    hist_sim_rec sim = {debug_step, debug_pc, debug_show, h};
+    int i;
+    debug_reg0 = copy_reg(reg);
+    debug_mem0 = copy_mem(mem);
+    hist_add_mem(h, reg);
+    hist_add_mem(h, mem);
+    hist_add_pipe(h, pc_state);
+    hist_add_pipe(h, if_id_state);
+    hist_add_pipe(h, id_ex_state);
+    hist_add_pipe(h, ex_mem_state);
+    hist_add_pipe(h, mem_wb_state);
+    for (i = 0; i < fetch_depth-1; i++)
+	hist_add_pipe(h, fetch_q_state[i]);
+    for (i = 0; i < mem_depth-1; i++)
+	hist_add_pipe(h, mem_q_state[i]);
+    HIST_VAR(h, pipe_regs);
+    HIST_VAR(h, pc_curr);
+    HIST_VAR(h, pc_next);
+    HIST_VAR(h, if_id_curr);
+    HIST_VAR(h, if_id_next);
+    HIST_VAR(h, id_ex_curr);
+    HIST_VAR(h, id_ex_next);
+    HIST_VAR(h, ex_mem_curr);
+    HIST_VAR(h, ex_mem_next);
+    HIST_VAR(h, mem_wb_curr);
+    HIST_VAR(h, mem_wb_next);
+    HIST_VAR(h, fetch_q_curr);
+    HIST_VAR(h, fetch_q_next);
+    HIST_VAR(h, mem_q_curr);
+    HIST_VAR(h, mem_q_next);
+    HIST_VAR(h, f_out_next);
+    HIST_VAR(h, m_in_curr);
+    HIST_VAR(h, cycles);
+    HIST_VAR(h, instructions);
+    HIST_VAR(h, starting_up);
+    HIST_VAR(h, cc);
+    HIST_VAR(h, status);
+    HIST_VAR(h, cc_in);
+    HIST_VAR(h, wb_destE);
+    HIST_VAR(h, wb_valE);
+    HIST_VAR(h, wb_destM);
+    HIST_VAR(h, wb_valM);
+    HIST_VAR(h, mem_addr);
+    HIST_VAR(h, mem_data);
+    HIST_VAR(h, mem_write);
+    HIST_VAR(h, amux);
+    HIST_VAR(h, bmux);
+    HIST_VAR(h, f_pc);
+    HIST_VAR(h, imem_icode);
+    HIST_VAR(h, imem_ifun);
+    HIST_VAR(h, imem_error);
+    HIST_VAR(h, instr_valid);
+    HIST_VAR(h, d_regvala);
+    HIST_VAR(h, d_regvalb);
+    HIST_VAR(h, e_vala);
+    HIST_VAR(h, e_valb);
+    HIST_VAR(h, e_bcond);
+    HIST_VAR(h, dmem_error);
+    hist_add_area(h, bpred, sizeof(bpred_rec));
+    if (bpred->pht)
+	hist_add_area(h, bpred->pht, 1 << bpred->bits);
+    if (bpred->ras)
+	hist_add_area(h, bpred->ras, bpred->ras_size * sizeof(word_t));
+    hist_add_cache(h, icache);
+    hist_add_cache(h, dcache);
+    hist_add_cache(h, l2cache);
+    HIST_VAR(h, imem_miss);
+    HIST_VAR(h, dmem_busy);
+    HIST_VAR(h, icache_pc);
+    HIST_VAR(h, icache_wait);
+    HIST_VAR(h, dmem_wait);
+    HIST_VAR(h, icache_stalls);
+    HIST_VAR(h, dmem_stalls);
+    HIST_VAR(h, ex_wait);
+    HIST_VAR(h, ex_busy);
+    HIST_VAR(h, ex_stalls);
+    hist_start(h);
+    hist_debug(h, &sim, in, max_cycle);
+    if (statusp)
+	*statusp = hist_stat(h);
+    if (ccp)
+	*ccp = get_cc(&cc);
+    free_history(h);
+    free_reg(debug_reg0);
+    free_mem(debug_mem0);
+    return instructions;
+}
+
 /* If dumpfile set nonNULL, lots of status info printed out */
 void sim_set_dumpfile(FILE *df)
 {
@@ -1400,7 +3366,7 @@ int Tcl_AppInit(Tcl_Interp *interp)
  *	static variables
  ******************************************************************************/
 
-static pipe_ptr pipes[MAX_STAGE];
+static pipe_ele pipes[MAX_STAGE];
 static int pipe_count = 0;
 
 /******************************************************************************
@@ -1409,17 +3375,17 @@ static int pipe_count = 0;
 
 /* Create new pipe with count bytes of state */
 /* bubble_val indicates state corresponding to pipeline bubble */
-pipe_ptr new_pipe(int count, void *bubble_val)
+/* copies holds the 2*count bytes of current and next state */
+pipe_ptr new_pipe(int count, void *bubble_val, void *copies)
 {
-  pipe_ptr result = (pipe_ptr) malloc(sizeof(pipe_ele));
-  result->current = malloc(count);
-  result->next = malloc(count);
+  pipe_ptr result = &pipes[pipe_count++];
+  result->current = copies;
+  result->next = (byte_t *) copies + count;
   memcpy(result->current, bubble_val, count);
   memcpy(result->next, bubble_val, count);
   result->count = count;
   result->op = P_LOAD;
   result->bubble_val = bubble_val;
-  pipes[pipe_count++] = result; 
   return result;
 }
 
@@ -1428,7 +3394,8 @@ void update_pipes()
 {
   int s;
   for (s = 0; s < pipe_count; s++) {
-    pipe_ptr p = pipes[s];
+    pipe_ptr p = &pipes[s];
+    void *t;
     switch (p->op)
       {
       case P_BUBBLE:
@@ -1437,8 +3404,10 @@ void update_pipes()
       	break;
       
       case P_LOAD:
-      	/* copy calculated state from previous stage */
-      	memcpy(p->current, p->next, p->count);
+      	/* calculated state from previous stage becomes current */
+      	t = p->current;
+      	p->current = p->next;
+      	p->next = t;
       	break;
       case P_ERROR:
 	  /* Like a bubble, but insert error condition */
@@ -1459,7 +3428,7 @@ void clear_pipes()
 {
   int s;
   for (s = 0; s < pipe_count; s++) {
-    pipe_ptr p = pipes[s];
+    pipe_ptr p = &pipes[s];
     memcpy(p->current, p->bubble_val, p->count);
     memcpy(p->next, p->bubble_val, p->count);
     p->op = P_LOAD;
@@ -1504,16 +3473,16 @@ void wstring(uword_t x, int bpd, int bpw, char *str)
 
 pc_ele bubble_pc = {0,STAT_AOK};
 if_id_ele bubble_if_id = { I_NOP, 0, REG_NONE,REG_NONE,
-			   0, 0, STAT_BUB, 0};
+			   0, 0, STAT_BUB, 0, 0, 0, 0};
 id_ex_ele bubble_id_ex = { I_NOP, 0, 0, 0, 0,
 			   REG_NONE, REG_NONE, REG_NONE, REG_NONE,
-			   STAT_BUB, 0};
+			   STAT_BUB, 0, 0, 0, 0};
 
 ex_mem_ele bubble_ex_mem = { I_NOP, 0, FALSE, 0, 0,
-			     REG_NONE, REG_NONE, STAT_BUB, 0};
+			     REG_NONE, REG_NONE, REG_NONE, STAT_BUB, 0, 0, 0, 0};
 
 mem_wb_ele bubble_mem_wb = { I_NOP, 0, 0, 0, REG_NONE, REG_NONE,
-			     STAT_BUB, 0};
+			     STAT_BUB, 0, 0, 0};
 
 
 
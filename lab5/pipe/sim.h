@@ -11,6 +11,9 @@ typedef enum { S_WEDGED, S_STALL, S_FORWARD } sim_mode_t;
 /* Pipeline stage identifiers for stage operation control */
 typedef enum { IF_STAGE, ID_STAGE, EX_STAGE, MEM_STAGE, WB_STAGE } stage_id_t;
 
+/* Caches that can be configured */
+typedef enum { L1I, L1D, L2, CACHE_LEVELS } cache_level_t;
+
 /********** Defines **************/
 
 /* Get ra out of one byte regid field */
@@ -26,6 +29,24 @@ typedef enum { IF_STAGE, ID_STAGE, EX_STAGE, MEM_STAGE, WB_STAGE } stage_id_t;
 extern word_t cycles;
 /* How many instructions have passed through the EX stage? */
 extern word_t instructions;
+/* Counts of instructions completing, when profiling */
+extern profile_ptr prof;
+/* Lock-step comparison with ISA simulator, when testing */
+extern check_ptr checker;
+/* Branch predictor */
+extern bpred_ptr bpred;
+/* Cycles of wide pipeline in which each number of instructions completed */
+extern word_t wide_done[MAX_WIDTH+1];
+/* Out-of-order statistics: cycles renaming stalled with full ROB,
+   LSQ and stations, loads, and instructions in flight over cycles */
+extern word_t rob_full, lsq_full, rs_full[FU_COUNT];
+extern word_t o_loads, o_forwarded, rob_occupancy;
+/* Caches, or NULL, and cycles waited for each first-level cache */
+extern cache_ptr icache, dcache, l2cache;
+extern word_t icache_stalls, dmem_stalls;
+/* Multi-cycle operation in EX, and cycles waited for such operations */
+extern bool_t ex_busy;
+extern word_t ex_stalls;
 
 /* Both instruction and data memory */
 extern mem_t mem;
@@ -36,8 +57,8 @@ extern word_t memCnt;
 
 /* Register file */
 extern mem_t reg;
-/* Condition code register */
-extern cc_t cc;
+/* Condition code register (read with get_cc) */
+extern lazy_cc_rec cc;
 extern stat_t stat;
 
 /* Operand sources in EX (to show forwarding) */
@@ -61,7 +82,7 @@ extern ex_mem_ptr ex_mem_next;
 extern mem_wb_ptr mem_wb_next;
 
 /* Pending updates to state */
-extern word_t cc_in;
+extern lazy_cc_rec cc_in;
 extern word_t wb_destE;
 extern word_t wb_valE;
 extern word_t wb_destM;
@@ -83,6 +104,8 @@ extern word_t e_vala;
 extern word_t e_valb;
 extern bool_t e_bcond;
 extern bool_t dmem_error;
+extern bool_t imem_miss;
+extern bool_t dmem_busy;
 
 /* Simulator operating mode */
 extern sim_mode_t sim_mode;
@@ -118,6 +141,13 @@ void sim_reset();
 */
 word_t sim_run_pipe(word_t max_instr, word_t max_cycle, byte_t *statusp, cc_t *ccp);
 
+/*
+  Run pipeline under control of commands read from in (see hist_debug),
+  recording each cycle so that it can be stepped backward.
+  At most max_cycle cycles are simulated.  Results are as for sim_run_pipe.
+*/
+word_t sim_debug(FILE *in, word_t max_cycle, byte_t *statusp, cc_t *ccp);
+
 /* If dumpfile set nonNULL, lots of status info printed out */
 void sim_set_dumpfile(FILE *file);
 
@@ -22,6 +22,10 @@ typedef struct {
     stat_t status;
     /* The following is included for debugging */
     word_t stage_pc;
+    /* Branch prediction */
+    word_t predpc;   /* Predicted PC of next instruction */
+    word_t bp_index; /* Predictor entry of jump */
+    word_t bp_ras;   /* Return-address stack after fetch */
 } if_id_ele, *if_id_ptr;
 
 /* ID/EX Pipe Register */
@@ -38,6 +42,10 @@ typedef struct {
     stat_t status;
     /* The following is included for debugging */
     word_t stage_pc;
+    /* Branch prediction */
+    word_t predpc;   /* Predicted PC of next instruction */
+    word_t bp_index; /* Predictor entry of jump */
+    word_t bp_ras;   /* Return-address stack after fetch */
 } id_ex_ele, *id_ex_ptr;
 
 /* EX/MEM Pipe Register */
@@ -53,6 +61,10 @@ typedef struct {
     stat_t status;
     /* The following is included for debugging */
     word_t stage_pc;
+    /* Branch prediction */
+    word_t predpc;   /* Predicted PC of next instruction */
+    word_t bp_index; /* Predictor entry of jump */
+    word_t bp_ras;   /* Return-address stack after fetch */
 } ex_mem_ele, *ex_mem_ptr;
 
 /* Mem/WB Pipe Register */
@@ -66,8 +78,102 @@ typedef struct {
     stat_t status;
     /* The following is included for debugging */
     word_t stage_pc;
+    /* Branch prediction */
+    word_t predpc;   /* Predicted PC of next instruction */
+    word_t bp_ras;   /* Return-address stack after fetch */
 } mem_wb_ele, *mem_wb_ptr;
 
+/* Most cycles fetch or memory can be split into (psim -S) */
+#define MAX_SPLIT 3
+
+/* Current and next states of all pipe registers, kept in one block so
+   that a cycle touches few cache lines.  Loading a register exchanges
+   the roles of its two copies rather than copying */
+typedef struct {
+    pc_ele pc[2];
+    if_id_ele if_id[2];
+    id_ex_ele id_ex[2];
+    ex_mem_ele ex_mem[2];
+    mem_wb_ele mem_wb[2];
+    /* Between the cycles of split fetch and memory stages */
+    if_id_ele fetch_q[MAX_SPLIT-1][2];
+    ex_mem_ele mem_q[MAX_SPLIT-1][2];
+} pipe_regs_rec;
+
+/* Pipe registers of the wide pipeline (psim -w).  Each holds a group
+   of up to MAX_WIDTH instructions in program order, one per slot */
+#define MAX_WIDTH 8
+
+typedef struct {
+    int count;
+    if_id_ele slot[MAX_WIDTH];
+} if_id_group;
+
+typedef struct {
+    int count;
+    id_ex_ele slot[MAX_WIDTH];
+} id_ex_group;
+
+typedef struct {
+    int count;
+    ex_mem_ele slot[MAX_WIDTH];
+} ex_mem_group;
+
+typedef struct {
+    int count;
+    mem_wb_ele slot[MAX_WIDTH];
+    /* A group makes at most one store, written as it completes */
+    int store;          /* Slot of store, or -1 */
+    word_t store_addr;
+    word_t store_data;
+} mem_wb_group;
+
+/* Current and next states of the wide pipe registers */
+typedef struct {
+    if_id_group if_id[2];
+    id_ex_group id_ex[2];
+    ex_mem_group ex_mem[2];
+    mem_wb_group mem_wb[2];
+} wide_regs_rec;
+
+/* Operation latencies in cycles (psim -L).  The first four follow alu_t */
+typedef enum { LAT_ADD, LAT_SUB, LAT_AND, LAT_XOR, LAT_LOAD, LAT_STORE,
+	       LAT_COUNT } lat_t;
+
+/* Out-of-order back end (psim -o) */
+
+/* Default reservation stations per unit and load/store queue entries */
+#define OOO_RS 8
+#define OOO_LSQ 16
+
+/* Functional units, each with its own reservation stations */
+typedef enum { FU_NONE, FU_ALU, FU_BRANCH, FU_MEM, FU_COUNT } fu_t;
+
+/* Operand that does not wait for an instruction in flight */
+#define NO_TAG ((word_t) -1)
+
+/* Reorder-buffer entry.  Instructions in flight are tagged by their
+   position in program order, which also selects their entry */
+typedef struct {
+    id_ex_ele d;        /* Decoded instruction, with valA and valB once read */
+    word_t seq;         /* Position in program order */
+    fu_t fu;
+    /* Producers of operands A and B and of the condition codes */
+    word_t src_tag[2];
+    bool_t src_m[2];    /* Operand is producer's valM rather than valE */
+    word_t cc_tag;
+    bool_t issued;
+    word_t e_ready;     /* Cycle from which valE, Cnd and CC can be used */
+    word_t m_ready;     /* Cycle from which valM can be used */
+    word_t vale;
+    word_t valm;
+    cc_t cc;
+    bool_t cnd;
+    word_t addr;        /* Address of load or store */
+    bool_t resolved;    /* Jump or return checked against its prediction */
+    bool_t mispredicted;
+} rob_ele, *rob_ptr;
+
 /************ Global Declarations ********************/
 
 extern pc_ele bubble_pc;
@@ -83,6 +189,7 @@ void do_if_stage();
 void do_id_wb_stages();  /* Both ID and WB */
 void do_ex_stage();
 void do_mem_stage();
+void do_split_stages();  /* Extra cycles of fetch and memory (-S) */
 
 /* Set stalling conditions for different stages */
 void do_stall_check();
@@ -0,0 +1,69 @@
+#!/usr/bin/perl 
+#!/usr/local/bin/perl 
+# Test timing of loads after stores, for the out-of-order core.
+# A load should not wait for an earlier store to a word that does not
+# overlap its own, whether that word is below or above it
+
+use Getopt::Std;
+use lib ".";
+use tester;
+
+cmdline();
+# Cycle counts are reported as performance checks
+$check_perf = 1;
+
+# Offsets of stored word from loaded word
+@offsets = (-16, -8, 8, 16);
+$cycles0 = -1;
+
+# Run test, checking it against the ISA simulator, and return cycles
+sub time_test
+{
+    local ($tname) = @_;
+    system "$yas $tname.ys" || die "Can't open file $tname.ys\n";
+    local $result = `$sim $simflags -v 0 -t $tname.yo`;
+    $tcount++;
+    if (!($result =~ "Succeed")) {
+	print "Test $tname failed\n";
+	$ecount++;
+	return -1;
+    }
+    $result =~ m#CPI:[^0-9]*([0-9]+)[^0-9]*([0-9]+)#;
+    system "rm $tname.ys $tname.yo";
+    return $1;
+}
+
+foreach $off (@offsets) {
+    $soff = 16 + $off;
+    $tname = "m-$soff";
+    open(YFILE, ">$tname.ys") || die "Can't write to $tname.ys\n";
+    print YFILE <<STUFF;
+	irmovq data,%rbx
+	irmovq \$1,%rcx
+loop:	rmmovq %rcx,$soff(%rbx)    # Store near the counter
+	mrmovq 16(%rbx),%rsi      # Load the counter
+	subq %rcx,%rsi
+	rmmovq %rsi,16(%rbx)
+	jne loop
+	halt
+	.align 8
+data:	.quad 0
+	.quad 0
+	.quad 20
+	.quad 0
+	.quad 0
+STUFF
+    close YFILE;
+    $cycles = &time_test($tname);
+    if ($cycles < 0) {
+	next;
+    }
+    if ($cycles0 < 0) {
+	$cycles0 = $cycles;
+    } elsif ($cycles != $cycles0) {
+	print "Test $tname.\tMeasured cycles=$cycles != Cycles of m-0=$cycles0\n";
+	$pecount++;
+    }
+}
+
+&test_stat();
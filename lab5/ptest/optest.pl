@@ -35,6 +35,25 @@ STUFF
     }
 }
 
+# OPq with invalid function codes
+foreach $fn ("4", "e") {
+    $tname = "op-badfun-$fn";
+    open (YFILE, ">$tname.ys") || die "Can't write to $tname.ys\n";
+    print YFILE <<STUFF;
+	      irmovq \$$vals[0], %rdx
+	      nop
+	      nop
+	      nop
+	      .byte 0x6$fn
+	      .byte 0x23
+	      nop
+	      nop
+	      halt
+STUFF
+    close YFILE;
+    run_test($tname);
+}
+
 if ($testiaddq) {
     foreach $ra (@regs) {
 	foreach $val (@vals) {
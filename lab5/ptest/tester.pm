@@ -8,6 +8,9 @@ $yas = "../misc/yas";
 # Which simulator is being tested?
 $sim = "../pipe/psim";
 
+# Extra options for the simulator
+$simflags = "";
+
 # By default, don't test iaddq instruction.
 $testiaddq = 0;
 
@@ -50,7 +53,7 @@ sub run_sim_test
 {
     local ($tname) = @_;
     system "$yas $tname.ys" || die "Can't open file $tname.ys\n";
-    local $result = `$sim -v 0 -t $tname.yo`;
+    local $result = `$sim $simflags -v 0 -t $tname.yo`;
     if (!($result =~ "Succeed")) {
 	print "Test $tname failed\n";
 	$ecount++;
@@ -133,13 +136,14 @@ sub test_stat
 
 sub cmdline {
     # parse command line arguments
-    getopts('his:Pp:d:Vm:');
+    getopts('his:f:Pp:d:Vm:');
 
     if ($opt_h) {
-        print STDERR "Usage $argv[0] [-h] [-i] [-s <sim>] [-P] [-p <pfile>]\n";
+        print STDERR "Usage $argv[0] [-h] [-i] [-s <sim>] [-f <flags>] [-P] [-p <pfile>]\n";
         print STDERR "   -h       print Help message\n";
         print STDERR "   -i       test iaddq instruction\n";
         print STDERR "   -s <sim> Specify simulator\n";
+        print STDERR "   -f <flags> Pass flags to simulator\n";
         print STDERR "   -d <dir> Specify directory for counterexamples\n";
         print STDERR "   -P Generate performance data\n";
         print STDERR "   -p <version> Check using performance file <pfile>\n";
@@ -168,6 +172,9 @@ sub cmdline {
     if ($opt_s) {
 	$sim = $opt_s;
     }
+    if ($opt_f) {
+	$simflags = $opt_f;
+    }
     if ($opt_V) {
 	$test_vlog = 1;
 	if ($opt_m) {
@@ -19,8 +19,8 @@ extern word_t memCnt;
 
 /* Register file */
 extern mem_t reg;
-/* Condition code register */
-extern cc_t cc;
+/* Condition code register (read with get_cc) */
+extern lazy_cc_rec cc;
 /* Program counter */
 extern word_t pc;
 
@@ -68,6 +68,13 @@ void sim_reset();
 */
 word_t sim_run(word_t max_instr, byte_t *statusp, cc_t *ccp);
 
+/*
+  Run processor under control of commands read from in (see hist_debug),
+  recording each instruction so that it can be stepped backward.
+  At most max_instr instructions are executed.  Results are as for sim_run.
+*/
+word_t sim_debug(FILE *in, word_t max_instr, byte_t *statusp, cc_t *ccp);
+
 /* If dumpfile set nonNULL, lots of status info printed out */
 void sim_set_dumpfile(FILE *file);
 
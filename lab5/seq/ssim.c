@@ -13,6 +13,7 @@
 #include <string.h>
 #include "isa.h"
 #include "sim.h"
+#include "history.h"
 
 #define MAXBUF 1024
 
@@ -39,6 +40,10 @@ FILE *object_file;       /* Input file handle */
 bool_t verbosity = 2;    /* Verbosity level [TTY only] (-v) */ 
 word_t instr_limit = 10000; /* Instruction limit [TTY only] (-l) */
 bool_t do_check = FALSE; /* Test with YIS? [TTY only] (-t) */
+bool_t do_debug = FALSE; /* Debug with reverse execution? [TTY only] (-r) */
+bool_t fast_forward = FALSE; /* Run without logging? [TTY only] (-f) */
+word_t detail_pc = -1;    /* Log from this PC on [TTY only] (-a) */
+word_t detail_count = -1; /* Log from this instruction on [TTY only] (-c) */
 
 /* keep a copy of mem and reg for diff display */
 mem_t mem0, reg0;
@@ -84,7 +89,7 @@ int sim_main(int argc, char **argv)
 
     
     /* Parse the command line arguments */
-    while ((c = getopt(argc, argv, "htgl:v:")) != -1) {
+    while ((c = getopt(argc, argv, "htrfga:c:l:v:")) != -1) {
 	switch(c) {
 	case 'h':
 	    usage(argv[0]);
@@ -102,6 +107,20 @@ int sim_main(int argc, char **argv)
 	case 't':
 	    do_check = TRUE;
 	    break;
+	case 'r':
+	    do_debug = TRUE;
+	    break;
+	case 'f':
+	    fast_forward = TRUE;
+	    break;
+	case 'a':
+	    fast_forward = TRUE;
+	    detail_pc = strtoull(optarg, NULL, 0);
+	    break;
+	case 'c':
+	    fast_forward = TRUE;
+	    detail_count = atoll(optarg);
+	    break;
 	case 'g':
 	    gui_mode = TRUE;
 	    break;
@@ -113,6 +132,15 @@ int sim_main(int argc, char **argv)
     }
 
 
+    if (do_check && do_debug) {
+	printf("Options -t and -r cannot be combined\n");
+	usage(argv[0]);
+    }
+    if (fast_forward && do_debug) {
+	printf("Options -f, -a, -c and -r cannot be combined\n");
+	usage(argv[0]);
+    }
+
     /* Do we have too many arguments? */
     if (optind < argc - 1) {
 	printf("Too many command line arguments:");
@@ -198,11 +226,16 @@ static void run_tty_sim()
     status = STAT_AOK;
     cc_t result_cc = 0;
     word_t byte_cnt = 0;
+    machine_ptr isa_mach = NULL;
     state_ptr isa_state = NULL;
 
 
     /* In TTY mode, the default object file comes from stdin */
     if (!object_file) {
+	if (do_debug) {
+	    fprintf(stderr, "Debugging requires an object file argument\n");
+	    exit(1);
+	}
 	object_file = stdin;
     }
 
@@ -223,7 +256,8 @@ static void run_tty_sim()
     }
     fclose(object_file);
     if (do_check) {
-	isa_state = new_state(0);
+	isa_mach = new_machine(0, error_to_file, stdout);
+	isa_state = isa_mach->s;
 	free_mem(isa_state->r);
 	free_mem(isa_state->m);
 	isa_state->m = copy_mem(mem);
@@ -235,7 +269,10 @@ static void run_tty_sim()
     reg0 = copy_mem(reg);
     
 
-    icount = sim_run(instr_limit, &status, &result_cc);
+    if (do_debug)
+	icount = sim_debug(stdin, instr_limit, &status, &result_cc);
+    else
+	icount = sim_run(instr_limit, &status, &result_cc);
     if (verbosity > 0) {
 	printf("%lld instructions executed\n", icount);
 	printf("Status = %s\n", stat_name(status));
@@ -246,13 +283,9 @@ static void run_tty_sim()
 	diff_mem(mem0, mem, stdout);
     }
     if (do_check) {
-	byte_t e = STAT_AOK;
-	int step;
 	bool_t match = TRUE;
 
-	for (step = 0; step < instr_limit && e == STAT_AOK; step++) {
-	    e = step_state(isa_state, stdout);
-	}
+	run_machine(isa_mach, instr_limit, NULL);
 
 	if (diff_reg(isa_state->r, reg, NULL)) {
 	    match = FALSE;
@@ -268,11 +301,11 @@ static void run_tty_sim()
 		diff_mem(isa_state->m, mem, stdout);
 	    }
 	}
-	if (isa_state->cc != result_cc) {
+	if (get_cc(&isa_state->cc) != result_cc) {
 	    match = FALSE;
 	    if (verbosity > 0) {
 		printf("ISA Cond. Codes (%s) != Pipeline Cond. Codes (%s)\n",
-		       cc_name(isa_state->cc), cc_name(result_cc));
+		       cc_name(get_cc(&isa_state->cc)), cc_name(result_cc));
 	    }
 	}
 	if (match) {
@@ -290,13 +323,17 @@ static void run_tty_sim()
  */
 static void usage(char *name)
 {
-    printf("Usage: %s [-htg] [-l m] [-v n] file.yo\n", name);
+    printf("Usage: %s [-htrfg] [-a addr] [-c n] [-l m] [-v n] file.yo\n", name);
     printf("file.yo required in GUI mode, optional in TTY mode (default stdin)\n");
     printf("   -h     Print this message\n");
     printf("   -g     Run in GUI mode instead of TTY mode (default TTY)\n");  
     printf("   -l m   Set instruction limit to m [TTY mode only] (default %lld)\n", instr_limit);
     printf("   -v n   Set verbosity level to 0 <= n <= 3 [TTY mode only] (default %d)\n", verbosity);
     printf("   -t     Test result against ISA simulator (yis) [TTY mode only]\n");
+    printf("   -r     Debug with reverse execution, reading commands from stdin [TTY mode only]\n");
+    printf("   -f     Fast-forward without logging, reporting only final state [TTY mode only]\n");
+    printf("   -a addr Fast-forward until PC = addr, then log each step [TTY mode only]\n");
+    printf("   -c n   Fast-forward n instructions, then log each step [TTY mode only]\n");
     exit(0);
 }
 
@@ -320,8 +357,8 @@ word_t memCnt = 0;
 
 /* Other processor state */
 mem_t reg;               /* Register file */
-cc_t cc = DEFAULT_CC;    /* Condition code register */
-cc_t cc_in = DEFAULT_CC; /* Input to condition code register */
+lazy_cc_rec cc = {DEFAULT_CC};    /* Condition code register */
+lazy_cc_rec cc_in = {DEFAULT_CC}; /* Input to condition code register */
 
 /* Program Counter */
 word_t pc = 0; /* Program counter value */
@@ -361,6 +398,91 @@ byte_t status = STAT_AOK;
 /* Log file */
 FILE *dumpfile = NULL;
 
+/*
+ * Control logic.  The HCL control signals of SEQ are given as one row
+ * per instruction code in icode_ctl.  sim_init expands the rows into
+ * seq_ctl, indexed by (icode, ifun, cond), so that each stage selects
+ * its inputs with a table load rather than chains of compares.  A
+ * different instruction set needs only a different icode_ctl.
+ */
+
+/* Register ID selections */
+typedef enum { R_NONE, R_A, R_B, R_SP } reg_sel_t;
+/* ALU operand selections */
+typedef enum { ALU_ZERO, ALU_VALA, ALU_VALB, ALU_VALC,
+	       ALU_MINUS8, ALU_PLUS8 } alu_sel_t;
+/* Memory address and data selections */
+typedef enum { ADDR_VALE, ADDR_VALA } addr_sel_t;
+typedef enum { DATA_VALA, DATA_VALP } data_sel_t;
+/* New PC selections */
+typedef enum { NPC_VALP, NPC_VALC, NPC_VALM } pc_sel_t;
+
+typedef struct {
+  byte_t valid;        /* Is instruction code valid? */
+  byte_t need_regids;  /* Has register specifier byte? */
+  byte_t need_valc;    /* Has constant word? */
+  byte_t srca, srcb;   /* reg_sel_t */
+  byte_t deste, destm; /* reg_sel_t */
+  byte_t alua, alub;   /* alu_sel_t */
+  byte_t alufun;       /* alu_t.  A_NONE in icode_ctl means ifun */
+  byte_t setcc;        /* Set condition codes? */
+  byte_t mem_read;
+  byte_t mem_write;
+  byte_t mem_addr;     /* addr_sel_t */
+  byte_t mem_data;     /* data_sel_t */
+  byte_t new_pc;       /* pc_sel_t */
+  byte_t on_cond;      /* deste and new_pc only when cond holds */
+  byte_t stat;         /* Status, unless there is a memory error */
+} seq_ctl_rec, *seq_ctl_ptr;
+
+static const seq_ctl_rec icode_ctl[16] = {
+  /*          val rid vc  srcA  srcB  dstE  dstM  aluA        aluB      alufun st rd wr addr       data       newPC     cnd stat */
+  [I_HALT]  = {1, 0,  0,  R_NONE,R_NONE,R_NONE,R_NONE, ALU_ZERO,  ALU_ZERO, A_ADD, 0, 0, 0, ADDR_VALE, DATA_VALA, NPC_VALP, 0, STAT_HLT},
+  [I_NOP]   = {1, 0,  0,  R_NONE,R_NONE,R_NONE,R_NONE, ALU_ZERO,  ALU_ZERO, A_ADD, 0, 0, 0, ADDR_VALE, DATA_VALA, NPC_VALP, 0, STAT_AOK},
+  [I_RRMOVQ]= {1, 1,  0,  R_A,   R_NONE,R_B,   R_NONE, ALU_VALA,  ALU_ZERO, A_ADD, 0, 0, 0, ADDR_VALE, DATA_VALA, NPC_VALP, 1, STAT_AOK},
+  [I_IRMOVQ]= {1, 1,  1,  R_NONE,R_NONE,R_B,   R_NONE, ALU_VALC,  ALU_ZERO, A_ADD, 0, 0, 0, ADDR_VALE, DATA_VALA, NPC_VALP, 0, STAT_AOK},
+  [I_RMMOVQ]= {1, 1,  1,  R_A,   R_B,   R_NONE,R_NONE, ALU_VALC,  ALU_VALB, A_ADD, 0, 0, 1, ADDR_VALE, DATA_VALA, NPC_VALP, 0, STAT_AOK},
+  [I_MRMOVQ]= {1, 1,  1,  R_NONE,R_B,   R_NONE,R_A,    ALU_VALC,  ALU_VALB, A_ADD, 0, 1, 0, ADDR_VALE, DATA_VALA, NPC_VALP, 0, STAT_AOK},
+  [I_ALU]   = {1, 1,  0,  R_A,   R_B,   R_B,   R_NONE, ALU_VALA,  ALU_VALB, A_NONE,1, 0, 0, ADDR_VALE, DATA_VALA, NPC_VALP, 0, STAT_AOK},
+  [I_JMP]   = {1, 0,  1,  R_NONE,R_NONE,R_NONE,R_NONE, ALU_ZERO,  ALU_ZERO, A_ADD, 0, 0, 0, ADDR_VALE, DATA_VALA, NPC_VALC, 1, STAT_AOK},
+  [I_CALL]  = {1, 0,  1,  R_NONE,R_SP,  R_SP,  R_NONE, ALU_MINUS8,ALU_VALB, A_ADD, 0, 0, 1, ADDR_VALE, DATA_VALP, NPC_VALC, 0, STAT_AOK},
+  [I_RET]   = {1, 0,  0,  R_SP,  R_SP,  R_SP,  R_NONE, ALU_PLUS8, ALU_VALB, A_ADD, 0, 1, 0, ADDR_VALA, DATA_VALA, NPC_VALM, 0, STAT_AOK},
+  [I_PUSHQ] = {1, 1,  0,  R_A,   R_SP,  R_SP,  R_NONE, ALU_MINUS8,ALU_VALB, A_ADD, 0, 0, 1, ADDR_VALE, DATA_VALA, NPC_VALP, 0, STAT_AOK},
+  [I_POPQ]  = {1, 1,  0,  R_SP,  R_SP,  R_SP,  R_A,    ALU_PLUS8, ALU_VALB, A_ADD, 0, 1, 0, ADDR_VALA, DATA_VALA, NPC_VALP, 0, STAT_AOK},
+  [I_IADDQ] = {1, 1,  1,  R_NONE,R_B,   R_B,   R_NONE, ALU_VALC,  ALU_VALB, A_ADD, 1, 0, 0, ADDR_VALE, DATA_VALA, NPC_VALP, 0, STAT_AOK},
+};
+
+/* Control signals for each (icode, ifun, cond) */
+static seq_ctl_rec seq_ctl[16][16][2];
+/* Does condition ifun hold for each value of the condition codes? */
+static bool_t cond_tab[8][16];
+
+static void build_control()
+{
+    int i, f, c;
+    for (i = 0; i < 16; i++)
+	for (f = 0; f < 16; f++)
+	    for (c = 0; c < 2; c++) {
+		seq_ctl_ptr e = &seq_ctl[i][f][c];
+		*e = icode_ctl[i];
+		if (!e->valid) {
+		    /* Executes as a nop that stops the processor */
+		    *e = icode_ctl[I_NOP];
+		    e->valid = FALSE;
+		    e->stat = STAT_INS;
+		}
+		if (e->alufun == A_NONE)
+		    e->alufun = f;
+		if (e->on_cond && !c) {
+		    e->deste = R_NONE;
+		    e->new_pc = NPC_VALP;
+		}
+	    }
+    for (c = 0; c < 8; c++)
+	for (f = 0; f < 16; f++)
+	    cond_tab[c][f] = cond_holds(c, f);
+}
+
 #ifdef HAS_GUI
 /* Representations of digits */
 static char digits[16] =
@@ -470,7 +592,7 @@ static void sim_report() {
 	report_state("E", format_e());
 	report_state("M", format_m());
 	report_state("NPC", format_npc());
-	show_cc(cc);
+	show_cc(get_cc(&cc));
     }
 #endif /* HAS_GUI */
 
@@ -482,6 +604,7 @@ void sim_init()
 
     /* Create memory and register files */
     initialized = 1;
+    build_control();
     mem = init_mem(MEM_SIZE);
     reg = init_reg();
     sim_reset();
@@ -505,8 +628,8 @@ void sim_reset()
 #endif
 
 	pc_in = 0;
-    cc = DEFAULT_CC;
-    cc_in = DEFAULT_CC;
+    set_cc(&cc, DEFAULT_CC);
+    set_cc(&cc_in, DEFAULT_CC);
     destE = REG_NONE;
     destM = REG_NONE;
     mem_write = FALSE;
@@ -537,8 +660,8 @@ void sim_reset()
     sim_report();
 }
 
-/* Update the processor state */
-static void update_state()
+/* Update the processor state.  Log the update if detail */
+static inline void update_state(bool_t detail)
 {
 	pc = pc_in;
     cc = cc_in;
@@ -551,6 +674,7 @@ static void update_state()
     if (mem_write) {
       /* Should have already tested this address */
         set_word_val(mem, mem_addr, mem_data);
+	if (detail)
 	    sim_log("Wrote 0x%llx to address 0x%llx\n", mem_data, mem_addr);
 #ifdef HAS_GUI
 	    if (gui_mode) {
@@ -581,83 +705,131 @@ static void update_state()
  * and then return the correct status.
  *****************************************************************/
 
-static byte_t sim_step()
+static inline byte_t seq_step(bool_t detail)
 {
+    seq_ctl_ptr c;
+    byte_t regids = HPACK(REG_NONE, REG_NONE);
+    word_t reg_in[4];
+    word_t alu_in[6];
+
     status = STAT_AOK;
     imem_error = dmem_error = FALSE;
 
-    update_state(); /* Update state from last cycle */
-
-    /*********************** Fetch stage ************************
-     * TODO: update [icode, ifun, instr, ra, rb, valc, valp, status]
-     * you may find these functions useful: 
-     * HPACK(), get_byte_val(), get_word_val(), HI4(), LO4()
-     ************************************************************/
-
-    /* dummy placeholders, replace them with your implementation */
-    icode = I_NOP;
-    ifun = F_NONE;
-    instr = HPACK(I_NOP, F_NONE);
-    ra = REG_NONE;
-    rb = REG_NONE;
+    update_state(detail); /* Update state from last cycle */
+
+    /*********************** Fetch stage ************************/
+
+    valp = pc;
+    imem_error = !get_byte_val(mem, valp++, &instr);
+    imem_icode = HI4(instr);
+    imem_ifun = LO4(instr);
+    icode = imem_error ? I_NOP : imem_icode;
+    ifun = imem_error ? F_NONE : imem_ifun;
+    /* Fetch signals do not depend on cond */
+    c = &seq_ctl[icode][ifun][0];
+    instr_valid = c->valid;
+    if (c->need_regids)
+	imem_error |= !get_byte_val(mem, valp++, &regids);
+    ra = HI4(regids);
+    rb = LO4(regids);
     valc = 0;
-    valp = 0;
-    status = STAT_AOK;
+    if (c->need_valc) {
+	imem_error |= !get_word_val(mem, valp, &valc);
+	valp += 8;
+    }
 
     /* logging function, do not change this */
-    sim_log("IF: Fetched %s at 0x%llx.  ra=%s, rb=%s, valC = 0x%llx\n",
-	    iname(HPACK(icode,ifun)), pc, reg_name(ra), reg_name(rb), valc);
+    if (detail)
+	sim_log("IF: Fetched %s at 0x%llx.  ra=%s, rb=%s, valC = 0x%llx\n",
+		iname(HPACK(icode,ifun)), pc, reg_name(ra), reg_name(rb), valc);
     
-    /*********************** Decode stage ***********************
-     * TODO: update [srcA, srcB, destE, destM, vala, valb]
-     * you may find these functions useful: 
-     * get_reg_val(), cond_holds()
-     ************************************************************/
-
-    /* dummy placeholders, replace them with your implementation */
-    srcA = REG_NONE;
-    srcB = REG_NONE;
-    destE = REG_NONE;
-    destM = REG_NONE;
-    vala = 0;
-    valb = 0;
-
-    /*********************** Execute stage **********************
-     * TODO: update [vale, cc_in]
-     * you may find these functions useful: 
-     * compute_alu(), compute_cc()
-     ************************************************************/
-    
-    /* dummy placeholders, replace them with your implementation */
-    vale = 0;
-    cc_in = DEFAULT_CC; /* should not overwrite original cc */
+    /*********************** Decode stage ***********************/
+
+    /* Condition is needed here by conditional moves.  Only jumps and
+       moves read it, so other instructions leave lazy CC unevaluated */
+    cond = bcond = (icode == I_JMP || icode == I_RRMOVQ) ?
+	cond_tab[get_cc(&cc)][ifun] : FALSE;
+    c = &seq_ctl[icode][ifun][cond];
+    reg_in[R_NONE] = REG_NONE;
+    reg_in[R_A] = ra;
+    reg_in[R_B] = rb;
+    reg_in[R_SP] = REG_RSP;
+    srcA = reg_in[c->srca];
+    srcB = reg_in[c->srcb];
+    destE = reg_in[c->deste];
+    destM = reg_in[c->destm];
+    vala = get_reg_val(reg, srcA);
+    valb = get_reg_val(reg, srcB);
+
+    /*********************** Execute stage **********************/
+
+    alu_in[ALU_ZERO] = 0;
+    alu_in[ALU_VALA] = vala;
+    alu_in[ALU_VALB] = valb;
+    alu_in[ALU_VALC] = valc;
+    alu_in[ALU_MINUS8] = -8;
+    alu_in[ALU_PLUS8] = 8;
+    vale = compute_alu(c->alufun, alu_in[c->alua], alu_in[c->alub]);
+    cc_in = cc;
+    if (c->setcc)
+	set_cc_op(&cc_in, c->alufun, alu_in[c->alua], alu_in[c->alub]);
+
+    /*********************** Memory stage ***********************/
 
-    /*********************** Memory stage ***********************
-     * TODO: update [valm, mem_write, mem_addr, mem_data, status]
-     * you may find these functions useful: 
-     * get_word_val()
-     ************************************************************/
-
-    /* dummy placeholders, replace them with your implementation */
     valm = 0;
-    mem_write = FALSE;
-    mem_addr = 0;
-    mem_data = 0;
-    status = STAT_AOK;
+    mem_addr = c->mem_addr == ADDR_VALA ? vala : vale;
+    mem_data = c->mem_data == DATA_VALP ? valp : vala;
+    if (c->mem_read)
+	dmem_error = !get_word_val(mem, mem_addr, &valm);
+    mem_write = c->mem_write;
+    if (mem_write) {
+	/* Do a read of address just to check validity */
+	word_t sink;
+	dmem_error = !get_word_val(mem, mem_addr, &sink);
+	mem_write = !dmem_error;
+    }
+    status = imem_error || dmem_error ? STAT_ADR : c->stat;
 
-    /****************** Program Counter Update ******************
-     * TODO: update [pc_in]
-     ************************************************************/
+    /****************** Program Counter Update ******************/
 
-    /* dummy placeholders, replace them with your implementation */
-    pc_in = 0; /* should not overwrite original pc */
+    pc_in = c->new_pc == NPC_VALC ? valc : c->new_pc == NPC_VALM ? valm : valp;
 
     /* GUI util function, do not change this */
-    sim_report();
+    if (detail)
+	sim_report();
 
     return status;
 }
 
+/* Execute one instruction, logging and reporting it */
+static byte_t sim_step()
+{
+    return seq_step(TRUE);
+}
+
+/*
+  Fast-forward: run processor without logging or reporting until
+  max_instr instructions have completed, an error status is
+  encountered, or the next instruction is number detail_count or is at
+  detail_pc.  Set *statusp to status of final instruction and return
+  number of instructions executed.
+*/
+static word_t sim_fast(word_t max_instr, byte_t *statusp)
+{
+    word_t icount = 0;
+    byte_t run_status = STAT_AOK;
+    /* pc_in is PC of next instruction */
+    while (icount < max_instr && (uword_t) icount < (uword_t) detail_count &&
+	   pc_in != detail_pc) {
+	run_status = seq_step(FALSE);
+	icount++;
+	if (run_status != STAT_AOK)
+	    break;
+    }
+    *statusp = run_status;
+    return icount;
+}
+
 /*
   Run processor until one of following occurs:
   - An error status is encountered in WB.
@@ -671,7 +843,13 @@ word_t sim_run(word_t max_instr, byte_t *statusp, cc_t *ccp)
 {
     word_t icount = 0;
     byte_t run_status = STAT_AOK;
-    while (icount < max_instr) {
+    if (fast_forward) {
+	icount = sim_fast(max_instr, &run_status);
+	if (run_status == STAT_AOK && icount < max_instr)
+	    sim_log("Detailed simulation from instruction %lld, PC = 0x%llx\n",
+		    icount + 1, pc_in);
+    }
+    while (icount < max_instr && run_status == STAT_AOK) {
         if (verbosity == 3) {
             sim_log("-------- Step %d --------\n", icount + 1);
         }
@@ -680,7 +858,7 @@ word_t sim_run(word_t max_instr, byte_t *statusp, cc_t *ccp)
 
         /* print step-wise diff if verbosity = 3 */
         if (verbosity == 3) {
-            sim_log("Status '%s', CC %s\n", stat_name(status), cc_name(cc_in));
+            sim_log("Status '%s', CC %s\n", stat_name(status), cc_name(get_cc(&cc_in)));
             sim_log("Changes to registers:\n");
             diff_reg(reg0, reg, stdout);
 
@@ -695,7 +873,77 @@ word_t sim_run(word_t max_instr, byte_t *statusp, cc_t *ccp)
     if (statusp)
 	*statusp = run_status;
     if (ccp)
-	*ccp = cc;
+	*ccp = get_cc(&cc);
+    return icount;
+}
+
+static stat_t debug_step(void *arg)
+{
+    return sim_step();
+}
+
+static word_t debug_pc(void *arg)
+{
+    return pc;
+}
+
+static void debug_show(void *arg, word_t step, stat_t e, bool_t full)
+{
+    printf("Step %lld: PC = 0x%llx, Status '%s', CC %s\n",
+	   step, pc, stat_name(e), cc_name(get_cc(&cc)));
+    if (full) {
+	printf("Changes to registers:\n");
+	diff_reg(reg0, reg, stdout);
+	printf("\nChanges to memory:\n");
+	diff_mem(mem0, mem, stdout);
+    }
+}
+
+word_t sim_debug(FILE *in, word_t max_instr, byte_t *statusp, cc_t *ccp)
+{
+    hist_ptr h = new_history(HIST_WINDOW);
+    hist_sim_rec sim = {debug_step, debug_pc, debug_show, NULL};
+    word_t icount;
+    hist_add_mem(h, reg);
+    hist_add_mem(h, mem);
+    HIST_VAR(h, pc);
+    HIST_VAR(h, pc_in);
+    HIST_VAR(h, cc);
+    HIST_VAR(h, cc_in);
+    HIST_VAR(h, status);
+    HIST_VAR(h, imem_icode);
+    HIST_VAR(h, imem_ifun);
+    HIST_VAR(h, icode);
+    HIST_VAR(h, ifun);
+    HIST_VAR(h, instr);
+    HIST_VAR(h, ra);
+    HIST_VAR(h, rb);
+    HIST_VAR(h, valc);
+    HIST_VAR(h, valp);
+    HIST_VAR(h, imem_error);
+    HIST_VAR(h, instr_valid);
+    HIST_VAR(h, srcA);
+    HIST_VAR(h, srcB);
+    HIST_VAR(h, destE);
+    HIST_VAR(h, destM);
+    HIST_VAR(h, vala);
+    HIST_VAR(h, valb);
+    HIST_VAR(h, vale);
+    HIST_VAR(h, bcond);
+    HIST_VAR(h, cond);
+    HIST_VAR(h, valm);
+    HIST_VAR(h, dmem_error);
+    HIST_VAR(h, mem_write);
+    HIST_VAR(h, mem_addr);
+    HIST_VAR(h, mem_data);
+    hist_start(h);
+    hist_debug(h, &sim, in, max_instr);
+    icount = h->cur;
+    if (statusp)
+	*statusp = hist_stat(h);
+    if (ccp)
+	*ccp = get_cc(&cc);
+    free_history(h);
     return icount;
 }
 